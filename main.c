@@ -2,34 +2,72 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "csmv.h"
 #include "dsmv.h"
 #include "smvm.h"
+#include "tsmv.h"
 #include "util.h"
 
-char *readfile(const char *fname);
+char *readfile(const char *fname, long *size);
 char *get_file_extension(const char *filename);
 void print_usage(const char *program_name);
 int write_bytecode(smvm *vm, const char *output_filename);
+int write_c(smvm *vm, const char *filename, char *output_filename);
 char *replace_extension(const char *filename, const char *new_extension);
 
+static const char *trap_names[] = {
+    [trap_none] = "trap",
+    [trap_operand_mode] = "unknown operand mode",
+    [trap_syscall_missing] = "syscall has no implementation",
+    [trap_syscall_range] = "syscall index out of bounds",
+    [trap_stack_underflow] = "stack underflow",
+    [trap_stack_overflow] = "stack overflow",
+    [trap_quota] = "memory quota exceeded",
+    [trap_protection] = "access to a mapped region it doesn't allow",
+    [trap_misaligned] = "misaligned atomic",
+    [trap_heap] = "free of something alloc didn't give out",
+    [trap_bounds] = "memory access past the end of guest memory",
+};
+
 int main(int argc, char **argv) {
   smvm vm;
   char *content;
   char *output;
   int disassemble_mode = 0;
   int bytecode_mode = 0;
+  int threaded_mode = 0;
+  int jit_mode = 0;
+  int tracing_mode = 0;
+  int transpile_mode = 0;
+  int stats_mode = 0;
   char *bytecode_output = NULL;
+  char *c_output = NULL;
+  smvm_result result = {0};
   char *filename = NULL;
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-d") == 0) {
       disassemble_mode = 1;
+    } else if (strcmp(argv[i], "-t") == 0) {
+      threaded_mode = 1;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      jit_mode = 1;
+    } else if (strcmp(argv[i], "-T") == 0) {
+      tracing_mode = 1;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      stats_mode = 1;
     } else if (strcmp(argv[i], "-b") == 0) {
       bytecode_mode = 1;
       if (i + 1 < argc && argv[i + 1][0] != '-') {
         bytecode_output = argv[i + 1];
         i++;
       }
+    } else if (strcmp(argv[i], "-c") == 0) {
+      transpile_mode = 1;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        c_output = argv[i + 1];
+        i++;
+      }
     } else if (filename == NULL) {
       filename = argv[i];
     } else {
@@ -45,10 +83,14 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  content = readfile(filename);
+  long content_size;
+  content = readfile(filename, &content_size);
   if (content == NULL) { return -1; }
 
   smvm_init(&vm);
+  if (threaded_mode) vm.engine = engine_threaded;
+  if (jit_mode) vm.engine = engine_jit;
+  if (tracing_mode) vm.engine = engine_tracing;
 
   char *extension = get_file_extension(filename);
   if (extension == NULL) {
@@ -61,28 +103,30 @@ int main(int argc, char **argv) {
   if (strcmp(extension, "asmv") == 0) {
     smvm_assemble(&vm, content);
 
+    if (transpile_mode) {
+      int status = write_c(&vm, filename, c_output);
+      free(content);
+      smvm_free(&vm);
+      return status;
+    }
+
     if (bytecode_mode) {
+      // only free the name if it was derived here, not taken from argv
+      char *derived_output = NULL;
       if (bytecode_output == NULL) {
-        bytecode_output = replace_extension(filename, "smvm");
+        bytecode_output = derived_output = replace_extension(filename, "smvm");
       }
 
       if (write_bytecode(&vm, bytecode_output) != 0) {
         printf("Error: Failed to write bytecode to file %s\n", bytecode_output);
-        if (bytecode_output != NULL &&
-            bytecode_output != replace_extension(filename, "smvm")) {
-          free(bytecode_output);
-        }
+        free(derived_output);
         free(content);
         smvm_free(&vm);
         return -1;
       }
 
       printf("Bytecode written to %s\n", bytecode_output);
-
-      if (bytecode_output != NULL &&
-          bytecode_output != replace_extension(filename, "smvm")) {
-        free(bytecode_output);
-      }
+      free(derived_output);
 
       if (!disassemble_mode) {
         free(content);
@@ -98,11 +142,20 @@ int main(int argc, char **argv) {
       return -1;
     }
 
-    smvm_execute(&vm);
+    result = smvm_execute(&vm);
   } else if (strcmp(extension, "smvm") == 0) {
-    u64 content_size = strlen(content);
-    for (u64 i = 0; i < content_size; i++) {
-      listmv_push(&vm.bytecode, &content[i]);
+    if (!smvm_load_image(&vm, (u8 *)content, content_size)) {
+      printf("Error: '%s' is not a valid smvm image\n", filename);
+      free(content);
+      smvm_free(&vm);
+      return -1;
+    }
+
+    if (transpile_mode) {
+      int status = write_c(&vm, filename, c_output);
+      free(content);
+      smvm_free(&vm);
+      return status;
     }
 
     if (disassemble_mode) {
@@ -114,7 +167,7 @@ int main(int argc, char **argv) {
              (char *)disassembler.code.data);
       dsmv_free(&disassembler);
     } else {
-      smvm_execute(&vm);
+      result = smvm_execute(&vm);
     }
   } else {
     printf("Error: Unsupported file extension '%s'\n", extension);
@@ -123,9 +176,16 @@ int main(int argc, char **argv) {
     return -1;
   }
 
+  if (stats_mode) tsmv_print_stats(&vm, stderr);
+
+  if (result.status == status_trapped) {
+    fprintf(stderr, "Error: %s at instruction %lu\n", trap_names[result.trap],
+            result.index);
+  }
+
   free(content);
   smvm_free(&vm);
-  return 0;
+  return result.status == status_trapped ? -1 : 0;
 }
 
 int write_bytecode(smvm *vm, const char *output_filename) {
@@ -135,14 +195,41 @@ int write_bytecode(smvm *vm, const char *output_filename) {
     return -1;
   }
 
-  size_t bytes_written = fwrite(vm->bytecode.data, 1, vm->bytecode.len, fp);
-  if (bytes_written != vm->bytecode.len) {
+  listmv(u8) image;
+  listmv_init(&image, sizeof(u8));
+  smvm_emit_image(vm, &image);
+
+  size_t bytes_written = fwrite(image.data, 1, image.len, fp);
+  if (bytes_written != image.len) {
     perror("Error writing bytecode to file");
+    listmv_free(&image);
     fclose(fp);
     return -1;
   }
 
+  listmv_free(&image);
+  fclose(fp);
+  return 0;
+}
+
+int write_c(smvm *vm, const char *filename, char *output_filename) {
+  // only free the name if it was derived here, not taken from argv
+  char *derived_output = NULL;
+  if (output_filename == NULL) {
+    output_filename = derived_output = replace_extension(filename, "c");
+  }
+
+  FILE *fp = fopen(output_filename, "w");
+  if (fp == NULL) {
+    perror("Error opening output file");
+    free(derived_output);
+    return -1;
+  }
+
+  csmv_transpile(vm, fp);
   fclose(fp);
+  printf("C written to %s\n", output_filename);
+  free(derived_output);
   return 0;
 }
 
@@ -177,18 +264,24 @@ void print_usage(const char *program_name) {
   printf("Options:\n");
   printf(
       "  -d                Disassemble the input file and print the result\n");
+  printf("  -t                Run on the threaded engine\n");
+  printf("  -j                Run on the x86-64 jit, if available\n");
+  printf("  -T                Run on the loop engine, tracing hot loops\n");
+  printf("  -s                Print threaded engine statistics after the run\n");
   printf("  -b [output_file]  Generate bytecode file after assembly\n");
   printf(
       "                    If no output_file is specified, uses input filename "
       "with .smvm extension\n");
+  printf("  -c [output_file]  Transpile the program to a standalone C file\n");
+  printf("                    Defaults to the input filename with .c\n");
   printf("\n");
   printf("Supported file extensions:\n");
   printf("  .asmv    Assembly source code\n");
   printf("  .smvm    VM bytecode\n");
 }
 
-char *readfile(const char *fname) {
-  FILE *fp = fopen(fname, "r");
+char *readfile(const char *fname, long *size) {
+  FILE *fp = fopen(fname, "rb");
   long file_size;
 
   if (fp == NULL) {
@@ -218,6 +311,7 @@ char *readfile(const char *fname) {
   }
 
   content[file_size] = '\0';
+  *size = file_size;
 
   fclose(fp);
   return content;
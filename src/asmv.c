@@ -5,21 +5,25 @@
 void asmv_init(asmv *as, struct smvm *vm) {
   as->index = 0;
   as->panic_mode = false;
+  arenamv_init(&as->arena);
   listmv_init(&as->bytecode, sizeof(u8));
+  listmv_init(&as->memory, sizeof(u8));
+  listmv_init(&as->stringpool, sizeof(u8));
   listmv_init(&as->instructions, sizeof(asmv_inst));
-  listmv_init(&as->label_addrs, sizeof(asmv_label));
-  listmv_init(&as->label_refs, sizeof(label_reference));
-  listmv_init(&as->syscalls, sizeof(smvm_syscall));
-
-  for (int i = 0; i < vm->syscalls.len; i++) {
-    smvm_syscall *syscall = listmv_at(&vm->syscalls, i);
-    smvm_syscall new_syscall = {
-        .id = syscall->id,
-        .name = malloc((strlen(syscall->name) + 1) * sizeof(char)),
-        .function = syscall->function};
-    strcpy(new_syscall.name, syscall->name);
-    listmv_push(&as->syscalls, &new_syscall);
-  }
+  listmv_init_arena(&as->label_addrs, sizeof(asmv_label), &as->arena);
+  listmv_init_arena(&as->label_refs, sizeof(label_reference), &as->arena);
+  listmv_init_arena(&as->syscalls, sizeof(smvm_syscall), &as->arena);
+  asmv_strings_init(&as->strings, &as->arena);
+  // the vm outlives the assembler, its names can be shared
+  listmv_push_array(&as->syscalls, vm->syscalls.data, vm->syscalls.len);
+}
+
+// len bytes of the code from the current index, NUL terminated in the arena
+static char *asmv_name(asmv *as, u64 len) {
+  char *name = arenamv_alloc(&as->arena, len + 1);
+  memcpy(name, as->code + as->index, len);
+  name[len] = '\0';
+  return name;
 }
 
 u8 asmv_parse_register(asmv *as) {
@@ -45,26 +49,26 @@ u8 asmv_parse_register(asmv *as) {
 
   if (asmv_current(as) == 'a' || asmv_current(as) == 'b' ||
       asmv_current(as) == 'c' || asmv_current(as) == 'd') {
+    smvm_register reg = reg_a + asmv_current(as) - 'a';
     asmv_skip(as);
     if (asmv_current(as) == '8') {
       asmv_skip(as);
-      return (smvm_reg8 << 3) | (reg_a + asmv_prev(as) - 'a');
+      return (smvm_reg8 << 3) | reg;
     }
     if (asmv_current(as) == '1' && asmv_peek(as) == '6') {
       as->index += 2;
-      return (smvm_reg16 << 3) | (reg_a + asmv_prev2(as) - 'a');
+      return (smvm_reg16 << 3) | reg;
     }
     if (asmv_current(as) == '3' && asmv_peek(as) == '2') {
       as->index += 2;
-      return (smvm_reg32 << 3) | (reg_a + asmv_prev2(as) - 'a');
+      return (smvm_reg32 << 3) | reg;
     }
     if (asmv_current(as) == '6' && asmv_peek(as) == '4') {
       as->index += 2;
-      return (smvm_reg64 << 3) | (reg_a + asmv_prev2(as) - 'a');
+      return (smvm_reg64 << 3) | reg;
     }
 
-    if (!isdigit(asmv_current(as)))
-      return (smvm_reg64 << 3) | (reg_a + asmv_prev(as) - 'a');
+    if (!isdigit(asmv_current(as))) return (smvm_reg64 << 3) | reg;
   }
 
   as->index = backup_index;
@@ -134,6 +138,148 @@ u8 parse_offset(asmv *as) {
   return (sign == '+') ? offset.num : -offset.num;
 }
 
+// the >64, >32, >16 or >8 after a direct address, 64 bits without one and
+// width when it's none of those
+smvm_data_width parse_width(asmv *as, smvm_data_width width) {
+  if (asmv_current(as) != '>') return smvm_reg64;
+  asmv_skip(as);
+  if (asmv_current(as) == '6' && asmv_peek(as) == '4') {
+    as->index += 2;
+    return smvm_reg64;
+  } else if (asmv_current(as) == '3' && asmv_peek(as) == '2') {
+    as->index += 2;
+    return smvm_reg32;
+  } else if (asmv_current(as) == '1' && asmv_peek(as) == '6') {
+    as->index += 2;
+    return smvm_reg16;
+  } else if (asmv_current(as) == '8') {
+    asmv_skip(as);
+    return smvm_reg8;
+  }
+  return width;
+}
+
+// a quoted string onto out, escapes resolved and NUL terminated
+void parse_string(asmv *as, listmv(u8) *out) {
+  char current;
+  asmv_skip(as);
+  while (asmv_current(as) != '"' && asmv_current(as) != '\0') {
+    current = asmv_current(as);
+    // checks for `\n`, etc.
+    if (current == '\\' && asmv_peek(as) != '\0') {
+      current = asmv_next(as);
+      switch (current) {
+        case 'n': current = '\n'; break;
+        case 't': current = '\t'; break;
+        case 'r': current = '\r'; break;
+        case '\\':
+        case '"': break;
+        default: as->index--; current = '\\';
+      }
+    }
+    listmv_push(out, &current);
+    asmv_skip(as);
+  }
+  listmv_push(out, &(char){'\0'});
+  if (asmv_current(as) == '"') asmv_skip(as);
+}
+
+static void asmv_skip_blank(asmv *as) {
+  for (;;) {
+    while (isspace(asmv_current(as))) asmv_skip(as);
+    if (asmv_current(as) != ';' && asmv_current(as) != '#') return;
+    while (asmv_current(as) != '\n' && asmv_current(as) != '\0')
+      asmv_skip(as);
+  }
+}
+
+static void asmv_skip_space(asmv *as) {
+  while (asmv_current(as) == ' ' || asmv_current(as) == '\t' ||
+         asmv_current(as) == ',')
+    asmv_skip(as);
+}
+
+static void asmv_put_be(listmv(u8) *out, u64 value, u8 size) {
+  for (int n = size - 1; n >= 0; n--)
+    listmv_push(out, &(u8){value >> (n * 8)});
+}
+
+// the values one let has gathered so far, all of one kind
+typedef struct asmv_global {
+  u64 addr;
+  u8 kind;  // enum smvm_global_kind
+  listmv(u8) bytes;
+} asmv_global;
+
+static void asmv_put_global(asmv *as, asmv_global *global, u64 len) {
+  if (len == 0) return;
+  asmv_put_be(&as->memory, global->addr, 8);
+  asmv_put_be(&as->memory, len, 8);
+  listmv_push(&as->memory, &global->kind);
+  listmv_push_array(&as->memory, global->bytes.data, global->bytes.len);
+  global->addr += len;
+  global->bytes.len = 0;
+}
+
+// let @addr[>width] values..., up to the end of the line. numbers take
+// width bytes each, strings their bytes and a NUL, zero n is n zero bytes.
+// nothing gets run for them, they go into the data section (as->memory)
+// and smvm_load_globals writes them into memory in one go
+static void asmv_lex_let(asmv *as) {
+  as->index += 3;
+  asmv_skip_space(as);
+  if (asmv_current(as) != '@' || !isdigit(asmv_peek(as))) {
+    printf("error in assembling: %d\n", asmv_misc_error);
+    while (asmv_current(as) != '\n' && asmv_current(as) != '\0')
+      asmv_skip(as);
+    return;
+  }
+  asmv_skip(as);
+
+  asmv_global global = {.addr = parse_number(as).unum};
+  u8 width = 1 << parse_width(as, smvm_reg64);
+  listmv_init_arena(&global.bytes, sizeof(u8), &as->arena);
+
+  for (;;) {
+    asmv_skip_space(as);
+    char current = asmv_current(as);
+    if (current == '\0' || current == '\n' || current == ';' ||
+        current == '#')
+      break;
+
+    if (current == '"') {
+      if (global.kind != global_bytes)
+        asmv_put_global(as, &global, global.bytes.len);
+      global.kind = global_bytes;
+      parse_string(as, &global.bytes);
+    } else if (current == '-' || isdigit(current)) {
+      if (global.kind != width) asmv_put_global(as, &global, global.bytes.len);
+      global.kind = width;
+      asmv_op_data data = parse_number(as);
+      u64 value = data.unum;
+      if (data.type == asmv_fnum_type && width == 8)
+        memcpy(&value, &data.fnum, 8);
+      else if (data.type == asmv_fnum_type && width == 4)
+        memcpy(&value, &(f32){data.fnum}, 4);
+      else if (data.type == asmv_fnum_type)
+        value = data.fnum;
+      asmv_put_be(&global.bytes, value, width);
+    } else if (!strncmp(as->code + as->index, "zero", 4)) {
+      as->index += 4;
+      asmv_skip_space(as);
+      asmv_put_global(as, &global, global.bytes.len);
+      global.kind = global_zero;
+      asmv_put_global(as, &global, parse_number(as).unum);
+    } else {
+      printf("error in assembling: %d\n", asmv_misc_error);
+      while (asmv_current(as) != '\n' && asmv_current(as) != '\0')
+        asmv_skip(as);
+      break;
+    }
+  }
+  asmv_put_global(as, &global, global.bytes.len);
+}
+
 // I hate nesting
 asmv_inst asmv_lex_inst(asmv *as) {
   char buffer[512];
@@ -155,10 +301,7 @@ asmv_inst asmv_lex_inst(asmv *as) {
     asmv_skip(as);
     offset = 0;
     while (isalnum(as->code[as->index + offset])) offset++;
-    char eof = '\0';
-    listmv_init(&inst.str, sizeof(char));
-    listmv_push_array(&inst.str, as->code + as->index, offset);
-    listmv_push(&inst.str, &eof);
+    inst.str = asmv_name(as, offset);
     inst.label = true;
     inst.index = as->index;
     as->index += offset;
@@ -212,22 +355,7 @@ asmv_inst asmv_lex_inst(asmv *as) {
           op.mode = mode_direct;
           op.data = parse_number(as);
           op.size = min_space_neededu(op.data.unum);
-          if (asmv_current(as) == '>') {
-            asmv_skip(as);
-            if (asmv_current(as) == '6' && asmv_peek(as) == '4') {
-              op.width = smvm_reg64;
-              as->index += 2;
-            } else if (asmv_current(as) == '3' && asmv_peek(as) == '2') {
-              op.width = smvm_reg32;
-              as->index += 2;
-            } else if (asmv_current(as) == '1' && asmv_peek(as) == '6') {
-              op.width = smvm_reg16;
-              as->index += 2;
-            } else if (asmv_current(as) == '8') {
-              op.width = smvm_reg8;
-              asmv_skip(as);
-            }
-          } else op.width = smvm_reg64;
+          op.width = parse_width(as, op.width);
           op.offset = parse_offset(as);
         } else if (asmv_current(as) == 'r') {
           // else if register, indirect addressing mode
@@ -255,42 +383,18 @@ asmv_inst asmv_lex_inst(asmv *as) {
       } else if (current == '"' &&
                  (inst.code == op_puts || inst.code == op_extern ||
                   inst.code == op_scall)) {
-        asmv_skip(as);
-        listmv_init(&op.data.str, sizeof(char));
-
-        while (asmv_current(as) != '"') {
-          current = asmv_current(as);
-          // checks for `\n`, etc.
-          if (current == '\\' && asmv_peek(as) != '\0') {
-            current = asmv_next(as);
-            switch (current) {
-              case 'n': current = '\n'; break;
-              case 't': current = '\t'; break;
-              case 'r': current = '\r'; break;
-              case '\\':
-              case '"': break;
-              default: as->index--; current = '\\';
-            }
-          }
-          listmv_push(&op.data.str, &current);
-          asmv_skip(as);
-        }
-
-        listmv_push(&op.data.str, &(char){'\0'});
-
+        u64 start = as->stringpool.len;
+        parse_string(as, &as->stringpool);
+        op.data.str = asmv_intern(&as->stringpool, &as->strings, start);
         op.data.type = asmv_str_type;
         op.mode = mode_register;
-        asmv_skip(as);
       } else if (current == '.') {  // handling labels
         asmv_skip(as);
         offset = 0;
         while (isalnum(as->code[as->index + offset])) offset++;
         op.data.type = asmv_label_type;
         op.mode = mode_immediate;
-        char eof = '\0';
-        listmv_init(&op.data.str, sizeof(char));
-        listmv_push_array(&op.data.str, as->code + as->index, offset);
-        listmv_push(&op.data.str, &eof);
+        op.data.label = asmv_name(as, offset);
         as->code += offset;
       } else {
         // TODO edge cases, error handling
@@ -308,9 +412,12 @@ void asmv_assemble(asmv *as) {
 
   // first pass
   while (as->code[as->index] != '\0') {
-    // TODO also lex "let"?
-    // if (asmv_current(as) == 'l' && asmv_peek(as) == 'e' &&
-    //     asmv_peek2(as) == 't' && !isalnum(as->code[as->index])) {}
+    asmv_skip_blank(as);
+    if (!strncmp(as->code + as->index, "let", 3) &&
+        isspace(as->code[as->index + 3])) {
+      asmv_lex_let(as);
+      continue;
+    }
 
     asmv_inst inst = asmv_lex_inst(as);
     if (inst.eof) break;
@@ -319,15 +426,17 @@ void asmv_assemble(asmv *as) {
           .address = offset, .str = inst.str, .index = as->instructions.len};
       listmv_push(&as->label_addrs, &label);
     } else {
+      inst.index = offset;
       if (instruction_table[inst.code].num_ops == 0) offset++;
       else {
-        inst.index = offset;
         offset += instruction_table[inst.code].num_ops == 3 ? 4 : 3;
         for (int i = 0; i < instruction_table[inst.code].num_ops; i++) {
+          if (inst.operands[i].offset) offset++;
           // TODO efficiency for storing labels
           if (inst.operands[i].data.type == asmv_label_type) offset += 8;
           else if (inst.operands[i].data.type == asmv_str_type)
-            offset += inst.operands[i].data.str.len;
+            // syscall names become an 8 byte index in the second pass
+            offset += inst.code == op_scall ? 8 : inst.operands[i].data.str.len;
           else if (inst.operands[i].mode > 1)
             offset += 1 << inst.operands[i].size;
         }
@@ -347,36 +456,31 @@ void asmv_assemble(asmv *as) {
       }
   }
 
-  // check labels
+  // check labels, every reference has to be resolved before the second pass
+  // writes the addresses out
   for (int i = 0; i < as->label_addrs.len; i++) {
     asmv_label label = *(asmv_label *)listmv_at(&as->label_addrs, i);
-    bool matched = false;
     for (int j = 0; j < as->label_refs.len; j++) {
       label_reference *ref = listmv_at(&as->label_refs, j);
       asmv_inst *inst = listmv_at(&as->instructions, ref->inst_index);
       asmv_operand *op = &inst->operands[ref->op_index];
-      if (op->data.str.cap && !strcmp(label.str.data, op->data.str.data)) {
+      if (op->data.type != asmv_label_type) continue;
+      if (!strcmp(label.str, op->data.label)) {
         inst->label_index = label.index;
-        listmv_free(&op->data.str);
         op->mode = mode_immediate;
+        op->data.type = asmv_unum_type;
         op->data.unum = label.address;
         op->width = smvm_reg64;
         op->size = smvm_reg64;
-        matched = true;
-        break;
       }
     }
-    if (matched) continue;
   }
 
   // second pass
   for (int i = 0; i < as->instructions.len; i++) {
     asmv_inst inst = *(asmv_inst *)listmv_at(&as->instructions, i);
     if (inst.eof) break;
-    if (inst.label) {
-      listmv_free(&inst.str);
-      continue;
-    }
+    if (inst.label) continue;
     if (inst.error != asmv_all_ok) {
       // TODO, better error handling?
       printf("error in assembling: %d\n", inst.error);
@@ -408,50 +512,43 @@ void asmv_assemble(asmv *as) {
     for (int i = 0; i < num_ops; i++) {
       asmv_operand op = inst.operands[i];
 
-      // set the info and mode bits
-      primary_bytes[i] |= op.mode << 6;
-
       if (op.data.type == asmv_str_type) {
-        if (inst.code == op_scall) {
-          const char *syscall_name = (char *)op.data.str.data;
-          bool found = false;
-
-          for (u64 j = 0; j < as->syscalls.len; j++) {
-            smvm_syscall *syscall = (smvm_syscall *)listmv_at(&as->syscalls, j);
-            if (strcmp(syscall->name, syscall_name) == 0) {
-              // use the index instead of the name
-              op.mode = mode_immediate;
-              op.data.type = asmv_unum_type;
-              op.data.unum = j;
-              op.width = smvm_reg64;
-              op.size = smvm_reg64;
-              inst.operands[i] = op;
-              listmv_free(&op.data.str);
-              found = true;
-              break;
-            }
+        // strings stay inline, syscall names turn into an index that is
+        // written out like any other immediate
+        if (inst.code != op_scall) continue;
+        const char *syscall_name =
+            listmv_at(&as->stringpool, op.data.str.offset);
+        u64 index = as->syscalls.len;
+
+        for (u64 j = 0; j < as->syscalls.len; j++) {
+          smvm_syscall *syscall = (smvm_syscall *)listmv_at(&as->syscalls, j);
+          if (strcmp(syscall->name, syscall_name) == 0) {
+            index = j;
+            break;
           }
+        }
 
-          if (!found) {
-            smvm_syscall new_syscall = {
-                .id = as->syscalls.len,
-                .function = NULL,
-                .name = malloc(strlen(syscall_name) + 1)};
-            strcpy(new_syscall.name, syscall_name);
-            listmv_push(&as->syscalls, &new_syscall);
-
-            op.mode = mode_immediate;
-            op.data.type = asmv_unum_type;
-            op.data.unum = new_syscall.id;
-            op.width = smvm_reg64;
-            op.size = smvm_reg64;
-            inst.operands[i] = op;
-            listmv_free(&op.data.str);
-          }
+        if (index == as->syscalls.len) {
+          smvm_syscall new_syscall = {
+              .id = index,
+              .function = NULL,
+              .name = arenamv_alloc(&as->arena, strlen(syscall_name) + 1)};
+          strcpy(new_syscall.name, syscall_name);
+          listmv_push(&as->syscalls, &new_syscall);
         }
-        continue;
+
+        // use the index instead of the name
+        op.mode = mode_immediate;
+        op.data.type = asmv_unum_type;
+        op.data.unum = index;
+        op.width = smvm_reg64;
+        op.size = smvm_reg64;
+        inst.operands[i] = op;
       }
 
+      // set the info and mode bits
+      primary_bytes[i] |= op.mode << 6;
+
       if (op.offset) immediate_bytes[immediate_size++] = op.offset;
       if (op.mode == mode_register || op.mode == mode_indirect) {
         primary_bytes[i == 2 ? 3 : 2] |= op.data.reg << (i == 1 ? 3 : 0);
@@ -465,52 +562,97 @@ void asmv_assemble(asmv *as) {
       }
     }
 
+    // keep resolved syscall indices
+    *(asmv_inst *)listmv_at(&as->instructions, i) = inst;
+
     listmv_push_array(&as->bytecode, primary_bytes, num_ops == 3 ? 4 : 3);
     listmv_push_array(&as->bytecode, immediate_bytes, immediate_size);
     for (int i = 0; i < num_ops; i++) {
       asmv_operand op = inst.operands[i];
       if (op.data.type != asmv_str_type) continue;
-      listmv_push_array(&as->bytecode, op.data.str.data, op.data.str.len);
+      listmv_push_array(&as->bytecode,
+                        listmv_at(&as->stringpool, op.data.str.offset),
+                        op.data.str.len);
     }
   }
 
-  for (int i = 0; i < as->label_addrs.len; i++) {
-    asmv_label label = *(asmv_label *)listmv_at(&as->label_addrs, i);
-    bool matched = false;
-    for (int j = 0; j < as->label_refs.len; j++) {
-      label_reference *ref = listmv_at(&as->label_refs, j);
-      asmv_inst *inst = listmv_at(&as->instructions, ref->inst_index);
-      asmv_operand *op = &inst->operands[ref->op_index];
-      if (op->data.str.cap && !strcmp(label.str.data, op->data.str.data)) {
-        listmv_free(&op->data.str);
-        op->mode = mode_immediate;
-        op->data.unum = label.address;
-        op->width = smvm_reg64;
-        op->size = smvm_reg64;
-        matched = true;
-        break;
-      }
-    }
-    if (matched) continue;
-  }
-
   // append the header now
   as->header = (smvm_header){
       .version = smvm_version,
       .header_flags = 0,          // TODO
       .checksum = 0,              // TODO
-      .global_variables_len = 0,  // TODO
+      .global_variables_len = as->memory.len,
       .code_len = as->bytecode.len,
   };
 }
 
 void asmv_free(asmv *as) {
-  listmv_free(&as->label_refs);
-  listmv_free(&as->label_addrs);
-  // don't free syscalls, bytecode, or instructions
+  arenamv_free(&as->arena);
+  // don't free bytecode, stringpool, memory or instructions
   // ownership is transferred to VM
 }
 
+void asmv_strings_init(asmv_strings *strings, arenamv *arena) {
+  listmv_init_arena(&strings->slots, sizeof(asmv_slot), arena);
+  strings->count = 0;
+}
+
+void asmv_strings_free(asmv_strings *strings) {
+  listmv_free(&strings->slots);
+  strings->count = 0;
+}
+
+// fnv-1a
+static u64 asmv_hash(u8 *bytes, u64 len) {
+  u64 hash = 0xcbf29ce484222325;
+  for (u64 i = 0; i < len; i++) hash = (hash ^ bytes[i]) * 0x100000001b3;
+  return hash;
+}
+
+// the slot holding an equal string, or the empty one it would go in
+static asmv_slot *asmv_find(asmv_strings *strings, u8 *pool, u8 *bytes,
+                            u64 len, u64 hash) {
+  u64 mask = strings->slots.len - 1;
+  for (u64 i = hash & mask;; i = (i + 1) & mask) {
+    asmv_slot *slot = listmv_at(&strings->slots, i);
+    if (slot->len == 0 || (slot->hash == hash && slot->len == len &&
+                           !memcmp(pool + slot->offset, bytes, len)))
+      return slot;
+  }
+}
+
+// twice the slots, 16 to start with, everything put back in its new place
+static void asmv_rehash(asmv_strings *strings, u8 *pool) {
+  listmv(asmv_slot) old = strings->slots;
+  u64 cap = old.len ? old.len * 2 : 16;
+  listmv_init_arena(&strings->slots, sizeof(asmv_slot), old.arena);
+  listmv_reserve(&strings->slots, cap);
+  for (u64 i = 0; i < cap; i++) listmv_push(&strings->slots, &(asmv_slot){0});
+  for (u64 i = 0; i < old.len; i++) {
+    asmv_slot *slot = listmv_at(&old, i);
+    if (slot->len)
+      *asmv_find(strings, pool, pool + slot->offset, slot->len, slot->hash) =
+          *slot;
+  }
+  listmv_free(&old);
+}
+
+asmv_string asmv_intern(listmv(u8) *pool, asmv_strings *strings, u64 start) {
+  u64 len = pool->len - start;
+  if ((strings->count + 1) * 2 > strings->slots.len)
+    asmv_rehash(strings, pool->data);
+  u8 *bytes = (u8 *)pool->data + start;
+  u64 hash = asmv_hash(bytes, len);
+  asmv_slot *slot = asmv_find(strings, pool->data, bytes, len, hash);
+  if (slot->len) {
+    pool->len = start;
+    return (asmv_string){slot->offset, len};
+  }
+  *slot = (asmv_slot){start, len, hash};
+  strings->count++;
+  return (asmv_string){start, len};
+}
+
 char asmv_current(asmv *a) { return a->code[a->index]; }
 char asmv_peek(asmv *a) { return a->code[a->index + 1]; }
 char asmv_peek2(asmv *a) { return a->code[a->index + 2]; }
@@ -4,15 +4,35 @@
 #include "smvm.h"
 #include "util.h"
 
+// everything that only lives while a program is being assembled, label
+// names, the label lists, a let's bytes and syscall names, comes from arena
+// and goes in one arenamv_free. what the vm keeps (instructions, bytecode,
+// stringpool and memory) is malloc'd and handed over as it is
+// a pool's strings by hash, so asmv_intern compares against about one of
+// them however many the pool holds. open addressing, at most half full
+typedef struct asmv_slot {
+  u64 offset;
+  u64 len;  // with the NUL, 0 for an empty slot
+  u64 hash;
+} asmv_slot;
+
+typedef struct asmv_strings {
+  listmv(asmv_slot) slots;  // a power of two of them, none before the first
+  u64 count;
+} asmv_strings;
+
 typedef struct asmv {
   char *code;  // input
+  arenamv arena;
   listmv(asmv_inst) instructions;
-  listmv(asmv_label) label_refs;
-  listmv(label_reference) label_addrs;
-  listmv(smvm_syscall) syscalls;
+  listmv(label_reference) label_refs;
+  listmv(asmv_label) label_addrs;
+  listmv(smvm_syscall) syscalls;  // the vm's first, their names borrowed
   smvm_header header;
-  listmv(u8) memory;
+  listmv(u8) memory;  // the data section, see smvm_global_kind
   listmv(u8) bytecode;
+  listmv(u8) stringpool;
+  asmv_strings strings;  // what's in stringpool, in the arena
   u64 index;
   bool panic_mode;
 } asmv;
@@ -26,6 +46,13 @@ typedef enum asmv_error {
   asmv_misc_error = 5,
 } asmv_error;
 
+// a string operand, interned in vm->stringpool (as->stringpool while it's
+// being assembled), see asmv_intern
+typedef struct asmv_string {
+  u64 offset;
+  u64 len;  // with the NUL
+} asmv_string;
+
 typedef struct asmv_op_data {
   enum asmv_op_type {
     asmv_reg_type,
@@ -41,7 +68,8 @@ typedef struct asmv_op_data {
     i64 num;
     u64 unum;
     f64 fnum;
-    listmv str;
+    asmv_string str;
+    char *label;  // the name, in the arena, until the label is resolved
   };
 } asmv_op_data;
 
@@ -57,7 +85,7 @@ typedef struct asmv_inst {
   smvm_opcode code;
   union {
     asmv_operand operands[3];
-    listmv str;
+    char *str;  // a label's name, in the arena
   };
   bool eof : 1;
   bool label : 1;
@@ -67,7 +95,7 @@ typedef struct asmv_inst {
 } asmv_inst;
 
 typedef struct asmv_label {
-  listmv str;
+  char *str;
   u64 address;
   u64 index;  // index in instruction array
 } asmv_label;
@@ -81,6 +109,12 @@ void asmv_init(asmv *as, smvm *vm);
 void asmv_assemble(asmv *as);
 asmv_inst asmv_lex_inst(asmv *as);
 void asmv_free(asmv *as);
+// the string pushed onto pool since start, or an equal one from before it.
+// strings has seen every string in pool, it sees this one too
+asmv_string asmv_intern(listmv(u8) *pool, asmv_strings *strings, u64 start);
+// the table takes its memory from arena, or from malloc when it's NULL
+void asmv_strings_init(asmv_strings *strings, arenamv *arena);
+void asmv_strings_free(asmv_strings *strings);
 
 char asmv_current(asmv *a);
 char asmv_peek(asmv *a);
@@ -0,0 +1,460 @@
+#include "bsmv.h"
+
+// the avx2 paths are built whatever -march says and only taken on cpus that
+// have it, see bsmv_has_avx2
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define bsmv_avx2 (1)
+#define bsmv_vector __attribute__((target("avx2")))
+#else
+#define bsmv_avx2 (0)
+#endif
+
+#include "asmv.h"
+#include "smvm.h"
+
+#define bsmv_done ((u64)INT64_MAX)  // pc of a finished lane, signed max for avx2
+// lanes run in lockstep together, small enough for their registers to stay
+// in l1 for the whole run
+#define bsmv_block (256)
+
+typedef enum bsmv_kind : u8 {
+  kind_scalar = 0,  // lane by lane through smvm_step
+  kind_halt,
+  kind_mov,
+  kind_add,
+  kind_sub,
+  kind_mul,
+  kind_and,
+  kind_or,
+  kind_xor,
+  kind_jmp,
+  kind_je,
+  kind_jne,
+  kind_jl,
+} bsmv_kind;
+
+// one instruction, with the operands the lockstep handlers need
+typedef struct bsmv_inst {
+  i64 imm;     // the right hand side, when right_imm
+  u64 target;  // instruction index for branches
+  u64 label;   // bytecode address for branches, goes to bp
+  u8 dest;
+  u8 left;
+  u8 right;
+  bool right_imm;
+  bsmv_kind kind;
+} bsmv_inst;
+
+typedef struct bsmv {
+  u64 count;  // lanes in this block
+  u64 *pc;
+  i64 *regs;       // register r of lane l at regs[r * count + l]
+  msmv *stacks;  // per lane, reused from block to block, cleared for each
+  hsmv *heaps;   // per lane, emptied for each block
+  bool failed;   // a lane's memory or stack couldn't be reserved
+} bsmv;
+
+// 'r' is ra..rd at full width
+static char bsmv_shape(asmv_operand *op) {
+  if (op->data.type == asmv_str_type) return '?';
+  if (op->mode == mode_register && op->width == smvm_reg64 &&
+      op->data.reg <= reg_d)
+    return 'r';
+  if (op->mode == mode_immediate) return 'i';
+  return '?';
+}
+
+static void bsmv_right(bsmv_inst *decoded, asmv_operand *op, char shape) {
+  decoded->right_imm = shape == 'i';
+  if (shape == 'i') decoded->imm = op->data.unum;
+  else decoded->right = op->data.reg;
+}
+
+static bsmv_inst bsmv_decode(asmv_inst *inst) {
+  char shape[4] = {0};
+  for (int i = 0; i < instruction_table[inst->code].num_ops; i++)
+    shape[i] = bsmv_shape(&inst->operands[i]);
+
+  bsmv_inst decoded = {.kind = kind_scalar};
+  switch (inst->code) {
+    case op_halt: decoded.kind = kind_halt; return decoded;
+    case op_mov:
+    case op_movu:
+    case op_movf:
+      if (strcmp(shape, "rr") && strcmp(shape, "ri")) return decoded;
+      decoded.dest = decoded.left = inst->operands[0].data.reg;
+      bsmv_right(&decoded, &inst->operands[1], shape[1]);
+      decoded.kind = kind_mov;
+      return decoded;
+    case op_inc:
+    case op_dec:
+      if (strcmp(shape, "r")) return decoded;
+      decoded.dest = decoded.left = inst->operands[0].data.reg;
+      decoded.right_imm = true;
+      decoded.imm = inst->code == op_inc ? 1 : (u64)-1;
+      decoded.kind = kind_add;
+      return decoded;
+    case op_jmp:
+      if (strcmp(shape, "i")) return decoded;
+      decoded.target = inst->label_index;
+      decoded.label = inst->operands[0].data.unum;
+      decoded.kind = kind_jmp;
+      return decoded;
+    case op_je:
+    case op_jne:
+    case op_jl:
+      if (strcmp(shape, "rri") && strcmp(shape, "rii")) return decoded;
+      decoded.left = inst->operands[0].data.reg;
+      bsmv_right(&decoded, &inst->operands[1], shape[1]);
+      decoded.target = inst->label_index;
+      decoded.label = inst->operands[2].data.unum;
+      decoded.kind = inst->code == op_je    ? kind_je
+                     : inst->code == op_jne ? kind_jne
+                                            : kind_jl;
+      return decoded;
+    default: break;
+  }
+
+  switch (inst->code) {
+    case op_add:
+    case op_addu: decoded.kind = kind_add; break;
+    case op_sub:
+    case op_subu: decoded.kind = kind_sub; break;
+    case op_mul:
+    case op_mulu: decoded.kind = kind_mul; break;
+    case op_and: decoded.kind = kind_and; break;
+    case op_or: decoded.kind = kind_or; break;
+    case op_xor: decoded.kind = kind_xor; break;
+    default: return decoded;
+  }
+  if (strcmp(shape, "rrr") && strcmp(shape, "rri")) {
+    decoded.kind = kind_scalar;
+    return decoded;
+  }
+  decoded.dest = inst->operands[0].data.reg;
+  decoded.left = inst->operands[1].data.reg;
+  bsmv_right(&decoded, &inst->operands[2], shape[2]);
+  return decoded;
+}
+
+static u64 bsmv_min_pc(bsmv *b) {
+  u64 min = bsmv_done;
+  for (u64 l = 0; l < b->count; l++)
+    if (b->pc[l] < min) min = b->pc[l];
+  return min;
+}
+
+static void bsmv_finish(bsmv *b, bsmv_lane *lanes, u64 l, smvm_result result) {
+  lanes[l].result = result;
+  b->regs[reg_ip * b->count + l] = result.index;
+  b->pc[l] = bsmv_done;
+}
+
+#if bsmv_avx2
+#define bsmv_load(_p) _mm256_loadu_si256((__m256i *)(_p))
+#define bsmv_store(_p, _v) _mm256_storeu_si256((__m256i *)(_p), _v)
+
+static bool bsmv_has_avx2(void) {
+  static int has = -1;  // asked once, every caller gets the same answer
+  if (has < 0) has = __builtin_cpu_supports("avx2") ? 1 : 0;
+  return has;
+}
+
+// pcs are never above bsmv_done, so a signed min works
+bsmv_vector static inline __m256i bsmv_min4(__m256i a, __m256i b) {
+  return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+}
+
+bsmv_vector static inline u64 bsmv_reduce(__m256i v, u64 min) {
+  u64 pcs[4];
+  bsmv_store(pcs, v);
+  for (int i = 0; i < 4; i++)
+    if (pcs[i] < min) min = pcs[i];
+  return min;
+}
+
+// bsmv_compute four lanes at a time, as many as fit, l ends up past them
+bsmv_vector static u64 bsmv_compute4(bsmv *b, bsmv_inst *inst, u64 cur,
+                                     u64 *l) {
+  u64 n = b->count;
+  i64 *dest = b->regs + inst->dest * n;
+  i64 *left = b->regs + inst->left * n;
+  i64 *right = inst->right_imm ? NULL : b->regs + inst->right * n;
+  __m256i at = _mm256_set1_epi64x(cur);
+  __m256i imm = _mm256_set1_epi64x(inst->imm);
+  __m256i mins = _mm256_set1_epi64x(bsmv_done);
+  for (; *l + 4 <= n; *l += 4) {
+    __m256i pc = bsmv_load(b->pc + *l);
+    __m256i active = _mm256_cmpeq_epi64(pc, at);
+    __m256i x = bsmv_load(left + *l);
+    __m256i y = right ? bsmv_load(right + *l) : imm;
+    __m256i result;
+    switch (inst->kind) {
+      case kind_mov: result = y; break;
+      case kind_add: result = _mm256_add_epi64(x, y); break;
+      case kind_sub: result = _mm256_sub_epi64(x, y); break;
+      case kind_and: result = _mm256_and_si256(x, y); break;
+      case kind_or: result = _mm256_or_si256(x, y); break;
+      default: result = _mm256_xor_si256(x, y); break;
+    }
+    bsmv_store(dest + *l,
+               _mm256_blendv_epi8(bsmv_load(dest + *l), result, active));
+    pc = _mm256_sub_epi64(pc, active);  // active is -1
+    bsmv_store(b->pc + *l, pc);
+    mins = bsmv_min4(mins, pc);
+  }
+  return bsmv_reduce(mins, bsmv_done);
+}
+#endif
+
+// dest = left op right, on every lane at cur, returns the next min pc
+static u64 bsmv_compute(bsmv *b, bsmv_inst *inst, u64 cur) {
+  u64 n = b->count, l = 0, min = bsmv_done;
+  i64 *dest = b->regs + inst->dest * n;
+  i64 *left = b->regs + inst->left * n;
+  i64 *right = inst->right_imm ? NULL : b->regs + inst->right * n;
+
+#if bsmv_avx2
+  // no 64-bit lane multiply before avx-512, mul stays scalar
+  if (inst->kind != kind_mul && bsmv_has_avx2())
+    min = bsmv_compute4(b, inst, cur, &l);
+#endif
+
+  for (; l < n; l++) {
+    if (b->pc[l] != cur) {
+      if (b->pc[l] < min) min = b->pc[l];
+      continue;
+    }
+    i64 x = left[l], y = right ? right[l] : inst->imm;
+    switch (inst->kind) {
+      case kind_mov: dest[l] = y; break;
+      case kind_add: dest[l] = x + y; break;
+      case kind_sub: dest[l] = x - y; break;
+      case kind_mul: dest[l] = x * y; break;
+      case kind_and: dest[l] = x & y; break;
+      case kind_or: dest[l] = x | y; break;
+      default: dest[l] = x ^ y; break;
+    }
+    if (++b->pc[l] < min) min = b->pc[l];
+  }
+  return min;
+}
+
+#if bsmv_avx2
+// bsmv_branch four lanes at a time, as many as fit, l ends up past them
+bsmv_vector static u64 bsmv_branch4(bsmv *b, bsmv_inst *inst, u64 cur,
+                                    u64 *l) {
+  u64 n = b->count;
+  i64 *left = b->regs + inst->left * n;
+  i64 *right = inst->right_imm ? NULL : b->regs + inst->right * n;
+  i64 *bp = b->regs + reg_bp * n;
+  __m256i at = _mm256_set1_epi64x(cur);
+  __m256i next = _mm256_set1_epi64x(cur + 1);
+  __m256i target = _mm256_set1_epi64x(inst->target);
+  __m256i label = _mm256_set1_epi64x(inst->label);
+  __m256i imm = _mm256_set1_epi64x(inst->imm);
+  __m256i ones = _mm256_set1_epi64x(-1);
+  __m256i sign = _mm256_set1_epi64x(1ull << 63);  // unsigned compare, i64 is
+                                                   // a u64 (util.h)
+  __m256i mins = _mm256_set1_epi64x(bsmv_done);
+  for (; *l + 4 <= n; *l += 4) {
+    __m256i pc = bsmv_load(b->pc + *l);
+    __m256i active = _mm256_cmpeq_epi64(pc, at);
+    __m256i taken = ones;
+    if (inst->kind != kind_jmp) {
+      __m256i x = bsmv_load(left + *l);
+      __m256i y = right ? bsmv_load(right + *l) : imm;
+      switch (inst->kind) {
+        case kind_je: taken = _mm256_cmpeq_epi64(x, y); break;
+        case kind_jne:
+          taken = _mm256_xor_si256(_mm256_cmpeq_epi64(x, y), ones);
+          break;
+        default:  // jl_fn jumps unless x < y
+          taken = _mm256_xor_si256(
+              _mm256_cmpgt_epi64(_mm256_xor_si256(y, sign),
+                                 _mm256_xor_si256(x, sign)),
+              ones);
+          break;
+      }
+    }
+    __m256i moved = _mm256_blendv_epi8(next, target, taken);
+    pc = _mm256_blendv_epi8(pc, moved, active);
+    bsmv_store(b->pc + *l, pc);
+    bsmv_store(bp + *l, _mm256_blendv_epi8(bsmv_load(bp + *l), label,
+                                           _mm256_and_si256(active, taken)));
+    mins = bsmv_min4(mins, pc);
+  }
+  return bsmv_reduce(mins, bsmv_done);
+}
+#endif
+
+// lanes at cur go to target or cur + 1, this is where they split up
+static u64 bsmv_branch(bsmv *b, bsmv_inst *inst, u64 cur) {
+  u64 n = b->count, l = 0, min = bsmv_done;
+  i64 *left = b->regs + inst->left * n;
+  i64 *right = inst->right_imm ? NULL : b->regs + inst->right * n;
+  i64 *bp = b->regs + reg_bp * n;
+
+#if bsmv_avx2
+  if (bsmv_has_avx2()) min = bsmv_branch4(b, inst, cur, &l);
+#endif
+
+  for (; l < n; l++) {
+    if (b->pc[l] != cur) {
+      if (b->pc[l] < min) min = b->pc[l];
+      continue;
+    }
+    bool taken = true;
+    if (inst->kind != kind_jmp) {
+      i64 x = left[l], y = right ? right[l] : inst->imm;
+      switch (inst->kind) {
+        case kind_je: taken = x == y; break;
+        case kind_jne: taken = x != y; break;
+        default: taken = !(x < y); break;
+      }
+    }
+    b->pc[l] = taken ? inst->target : cur + 1;
+    if (taken) bp[l] = inst->label;
+    if (b->pc[l] < min) min = b->pc[l];
+  }
+  return min;
+}
+
+// anything else, on the lane's own registers, memory and stack
+static void bsmv_step(bsmv *b, smvm *vm, bsmv_lane *lanes, u64 l, u64 cur) {
+  // only lane by lane steps reach memory, the lane gets it on the first one.
+  // a lane the host can't reserve it for ends like it ran out of quota
+  bool fresh = lanes[l].memory.base == NULL;
+  if ((fresh && !msmv_init(&lanes[l].memory, vm->memory.size,
+                           vm->memory.flags & ~msmv_file)) ||
+      (b->stacks[l].base == NULL &&
+       !msmv_stack_init(&b->stacks[l], vm->stack.size,
+                        vm->stack.flags & ~msmv_file))) {
+    b->failed = true;
+    bsmv_finish(b, lanes, l, (smvm_result){status_trapped, trap_quota, cur});
+    return;
+  }
+
+  u64 n = b->count;
+  for (int reg = 0; reg < smvm_register_num; reg++)
+    vm->registers[reg] = b->regs[reg * n + l];
+  vm->memory = lanes[l].memory;
+  vm->stack = b->stacks[l];
+  vm->heap = b->heaps[l];
+  vm->flags = 0;
+
+  // a fresh one starts out with the data section, like vm->memory did
+  u64 next = fresh && !smvm_load_globals(vm) ? smvm_step_exit
+                                             : smvm_step(vm, cur);
+
+  for (int reg = 0; reg < smvm_register_num; reg++)
+    b->regs[reg * n + l] = vm->registers[reg];
+  lanes[l].memory = vm->memory;
+  b->stacks[l] = vm->stack;  // what it committed
+  b->heaps[l] = vm->heap;
+
+  if (next == smvm_step_exit) bsmv_finish(b, lanes, l, vm->result);
+  else b->pc[l] = next;
+}
+
+// runs count <= bsmv_block lanes to the end, in lockstep
+static void bsmv_run(bsmv *b, smvm *vm, bsmv_inst *program, bsmv_lane *lanes,
+                     u64 count) {
+  u64 len = vm->instructions.len;
+  b->count = count;
+  for (u64 l = 0; l < count; l++) {
+    for (int reg = 0; reg < smvm_register_num; reg++)
+      b->regs[reg * count + l] = lanes[l].registers[reg];
+    b->regs[reg_sp * count + l] = 0;
+    b->pc[l] = 0;
+    hsmv_free(&b->heaps[l]);
+    // nothing of the last block's lane, contents or committed pages, like
+    // smvm_reset does
+    if (b->stacks[l].base) msmv_clear(&b->stacks[l]);
+  }
+
+  // the vector handlers hand back the next min pc, the rest rescan
+  for (u64 cur = 0; cur != bsmv_done;) {
+    if (cur >= len) {
+      for (u64 l = 0; l < count; l++)
+        if (b->pc[l] == cur)
+          bsmv_finish(b, lanes, l,
+                      (smvm_result){status_halted, trap_none, len});
+      cur = bsmv_min_pc(b);
+      continue;
+    }
+
+    bsmv_inst *inst = &program[cur];
+    switch (inst->kind) {
+      case kind_scalar:
+        for (u64 l = 0; l < count; l++)
+          if (b->pc[l] == cur) bsmv_step(b, vm, lanes, l, cur);
+        break;
+      case kind_halt:
+        for (u64 l = 0; l < count; l++)
+          if (b->pc[l] == cur)
+            bsmv_finish(b, lanes, l,
+                        (smvm_result){status_halted, trap_none, cur});
+        break;
+      case kind_jmp:
+      case kind_je:
+      case kind_jne:
+      case kind_jl: cur = bsmv_branch(b, inst, cur); continue;
+      default: cur = bsmv_compute(b, inst, cur); continue;
+    }
+    cur = bsmv_min_pc(b);
+  }
+
+  for (u64 l = 0; l < count; l++)
+    for (int reg = 0; reg < smvm_register_num; reg++)
+      lanes[l].registers[reg] = b->regs[reg * count + l];
+}
+
+bool bsmv_execute(smvm *vm, bsmv_lane *lanes, u64 count) {
+  u64 len = vm->instructions.len;
+  bsmv_inst *program = malloc((len + 1) * sizeof(bsmv_inst));
+  for (u64 i = 0; i < len; i++)
+    program[i] = bsmv_decode(listmv_at(&vm->instructions, i));
+
+  bsmv b = {
+      .pc = malloc(bsmv_block * sizeof(u64)),
+      .regs = malloc(smvm_register_num * bsmv_block * sizeof(i64)),
+      .stacks = calloc(bsmv_block, sizeof(msmv)),
+      .heaps = calloc(bsmv_block, sizeof(hsmv)),
+  };
+
+  // the lanes borrow vm for smvm_step, the rest of it is put back after
+  smvm saved = *vm;
+  vm->engine = engine_loop;
+  vm->fuel = smvm_fuel_unlimited;
+  vm->escape = NULL;
+  vm->regions.len = 0;  // in vm->memory, the lanes have their own
+
+  for (u64 base = 0; base < count; base += bsmv_block)
+    bsmv_run(&b, vm, program, lanes + base,
+             count - base < bsmv_block ? count - base : bsmv_block);
+
+  vm->memory = saved.memory;
+  vm->stack = saved.stack;
+  vm->heap = saved.heap;
+  memcpy(vm->registers, saved.registers, sizeof(vm->registers));
+  vm->flags = saved.flags;
+  vm->engine = saved.engine;
+  vm->fuel = saved.fuel;
+  vm->peak = saved.peak;
+  vm->regions = saved.regions;
+  vm->escape = saved.escape;
+  vm->result = saved.result;
+
+  for (u64 l = 0; l < bsmv_block; l++) {
+    msmv_free(&b.stacks[l]);
+    hsmv_free(&b.heaps[l]);
+  }
+  free(b.pc);
+  free(b.regs);
+  free(b.stacks);
+  free(b.heaps);
+  free(program);
+  return !b.failed;
+}
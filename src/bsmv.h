@@ -0,0 +1,34 @@
+#ifndef smv_smvm_bsmv_h
+#define smv_smvm_bsmv_h
+
+#include "smvm.h"
+#include "util.h"
+
+// bsmv - the batch engine
+// runs one assembled program over many lanes in lockstep, spmd style. the
+// lanes' registers are kept as structure of arrays, and every step runs the
+// instruction at the lowest pc any live lane is at, masked to the lanes that
+// are there. lanes that branched apart sit out until the others catch up,
+// and they run together again once their pcs meet. mov, the arithmetic and
+// the branches on ra..rd and immediates are done for all lanes at once, 4 at
+// a time with avx2 when the cpu has it, which is checked once at run time.
+// everything else runs lane by lane through smvm_step, on that lane's own
+// memory and stack.
+// vm->fuel is not counted, vm->quota holds for each lane on its own, each
+// lane starts with an empty heap of its own, and nothing gets traced or
+// jitted.
+
+typedef struct bsmv_lane {
+  i64 registers[smvm_register_num];  // in: initial state, out: final state
+  msmv memory;  // in: initial memory, or none for a fresh one the size of
+                // vm->memory with vm->globals in it once needed. out:
+                // final, owned by the caller
+  smvm_result result;   // out
+} bsmv_lane;
+
+// false when some lane couldn't be given its memory or stack, that lane
+// ends trapped with trap_quota at the instruction that needed it and the
+// rest run to the end as usual
+bool bsmv_execute(smvm *vm, bsmv_lane *lanes, u64 count);
+
+#endif
@@ -0,0 +1,267 @@
+#include "csmv.h"
+
+#include "asmv.h"
+#include "smvm.h"
+
+static const char *csmv_regs[] = {"ra", "rb", "rc", "rd"};
+
+// 'r' is ra..rd at full width, these are the ones living in locals
+static char csmv_shape(asmv_operand *op) {
+  if (op->data.type == asmv_str_type) return '?';
+  if (op->mode == mode_register && op->width == smvm_reg64 &&
+      op->data.reg <= reg_d)
+    return 'r';
+  if (op->mode == mode_immediate) return 'i';
+  return '?';
+}
+
+static void csmv_operand(FILE *out, asmv_operand *op) {
+  if (op->mode == mode_register) fputs(csmv_regs[op->data.reg], out);
+  else fprintf(out, "(i64)0x%llxull", (unsigned long long)op->data.unum);
+}
+
+static void csmv_string(FILE *out, u8 *str) {
+  fputc('"', out);
+  for (; *str; str++) {
+    u8 c = *str;
+    if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+    else if (c == '\n') fputs("\\n", out);
+    else if (c >= 0x20 && c < 0x7f) fputc(c, out);
+    else fprintf(out, "\\%03o", c);
+  }
+  fputc('"', out);
+}
+
+static void csmv_goto(FILE *out, asmv_inst *inst, u64 bp) {
+  fprintf(out, "{ vm->registers[reg_bp] = 0x%llx; goto i%llu; }\n",
+          (unsigned long long)bp, (unsigned long long)inst->label_index);
+}
+
+static bool csmv_binary(FILE *out, asmv_inst *inst, const char *shape) {
+  const char *op;
+  switch (inst->code) {
+    case op_add:
+    case op_addu: op = "+"; break;
+    case op_sub:
+    case op_subu: op = "-"; break;
+    case op_mul:
+    case op_mulu: op = "*"; break;
+    case op_and: op = "&"; break;
+    case op_or: op = "|"; break;
+    case op_xor: op = "^"; break;
+    default: return false;
+  }
+  if (strcmp(shape, "rrr") && strcmp(shape, "rri")) return false;
+
+  // through u64 so overflow wraps like on the interpreter
+  fprintf(out, "  %s = (u64)%s %s (u64)", csmv_regs[inst->operands[0].data.reg],
+          csmv_regs[inst->operands[1].data.reg], op);
+  csmv_operand(out, &inst->operands[2]);
+  fputs(";\n", out);
+  return true;
+}
+
+static bool csmv_branch(FILE *out, asmv_inst *inst, const char *shape) {
+  const char *format;
+  switch (inst->code) {
+    case op_je: format = "  if (%s == "; break;
+    case op_jne: format = "  if (%s != "; break;
+    case op_jl: format = "  if (!(%s < "; break;  // jl_fn jumps unless <
+    default: return false;
+  }
+  if (strcmp(shape, "rri") && strcmp(shape, "rii")) return false;
+
+  fprintf(out, format, csmv_regs[inst->operands[0].data.reg]);
+  csmv_operand(out, &inst->operands[1]);
+  fputs(inst->code == op_jl ? ")) " : ") ", out);
+  csmv_goto(out, inst, inst->operands[2].data.unum);
+  return true;
+}
+
+static bool csmv_inst(smvm *vm, FILE *out, asmv_inst *inst, u64 index) {
+  char shape[4] = {0};
+  for (int i = 0; i < instruction_table[inst->code].num_ops; i++)
+    shape[i] = csmv_shape(&inst->operands[i]);
+
+  switch (inst->code) {
+    case op_halt:
+      fprintf(out,
+              "  vm->registers[reg_ip] = %llu;\n"
+              "  smvm_set_flag(vm, flag_t);\n"
+              "  goto exit;\n",
+              (unsigned long long)index);
+      return true;
+    case op_mov:
+    case op_movu:
+    case op_movf:
+      if (strcmp(shape, "rr") && strcmp(shape, "ri")) return false;
+      fprintf(out, "  %s = ", csmv_regs[inst->operands[0].data.reg]);
+      csmv_operand(out, &inst->operands[1]);
+      fputs(";\n", out);
+      return true;
+    case op_inc:
+    case op_dec:
+      if (strcmp(shape, "r")) return false;
+      fprintf(out, "  %s = (u64)%s %c 1;\n",
+              csmv_regs[inst->operands[0].data.reg],
+              csmv_regs[inst->operands[0].data.reg],
+              inst->code == op_inc ? '+' : '-');
+      return true;
+    case op_jmp:
+      if (strcmp(shape, "i")) return false;
+      fputs("  ", out);
+      csmv_goto(out, inst, inst->operands[0].data.unum);
+      return true;
+    case op_call:
+      if (strcmp(shape, "i")) return false;
+      // a push past the stack faults out of here, with vm up to date
+      fprintf(out,
+              "  smvm_aot_spill();\n"
+              "  vm->registers[reg_ip] = %llu;\n"
+              "  smvm_push_frame(vm, %llu, 0x%llx);\n  ",
+              (unsigned long long)index, (unsigned long long)index,
+              (unsigned long long)inst->index);
+      csmv_goto(out, inst, inst->operands[0].data.unum);
+      return true;
+    case op_ret:
+      fprintf(out,
+              "  vm->registers[reg_ip] = %llu;\n"
+              "  next = smvm_pop_frame(vm);\n"
+              "  goto dispatch;\n",
+              (unsigned long long)index);
+      return true;
+    case op_scall:
+      // a missing native falls back, smvm_step reports it and traps
+      if (strcmp(shape, "i")) return false;
+      fprintf(out, "  smvm_aot_scall(%llu, %llu);\n",
+              (unsigned long long)index,
+              (unsigned long long)inst->operands[0].data.unum);
+      return true;
+    case op_puti:
+    case op_putu:
+      if (strcmp(shape, "r")) return false;
+      fprintf(out, "  printf(\"%s\\n\", (%s)%s);\n  fflush(stdout);\n",
+              inst->code == op_puti ? "%li" : "%lu",
+              inst->code == op_puti ? "i64" : "u64",
+              csmv_regs[inst->operands[0].data.reg]);
+      return true;
+    case op_puts:
+      if (inst->operands[0].data.type != asmv_str_type) return false;
+      fputs("  fputs(", out);
+      csmv_string(out,
+                  listmv_at(&vm->stringpool, inst->operands[0].data.str.offset));
+      fputs(", stdout);\n  fflush(stdout);\n", out);
+      return true;
+    default:
+      return csmv_binary(out, inst, shape) || csmv_branch(out, inst, shape);
+  }
+}
+
+void csmv_transpile(smvm *vm, FILE *out) {
+  u64 len = vm->instructions.len;
+
+  fputs(
+      "// generated by smvm -c, see csmv.h\n"
+      "#include <stdio.h>\n\n"
+      "#include \"smvm.h\"\n\n",
+      out);
+
+  listmv(u8) image;
+  listmv_init(&image, sizeof(u8));
+  smvm_emit_image(vm, &image);
+  fprintf(out, "static u8 smvm_aot_image[%llu] = {",
+          (unsigned long long)image.len);
+  for (u64 i = 0; i < image.len; i++)
+    fprintf(out, "%s0x%02x,", i % 12 ? " " : "\n    ",
+            ((u8 *)image.data)[i]);
+  fputs("\n};\n\n", out);
+  listmv_free(&image);
+
+  fputs(
+      "bool smvm_aot_load(smvm *vm) {\n"
+      "  return smvm_load_image(vm, smvm_aot_image, sizeof(smvm_aot_image));\n"
+      "}\n\n"
+      "#define smvm_aot_spill()         \\\n"
+      "  vm->registers[reg_a] = ra; \\\n"
+      "  vm->registers[reg_b] = rb; \\\n"
+      "  vm->registers[reg_c] = rc; \\\n"
+      "  vm->registers[reg_d] = rd\n"
+      "#define smvm_aot_reload()        \\\n"
+      "  ra = vm->registers[reg_a]; \\\n"
+      "  rb = vm->registers[reg_b]; \\\n"
+      "  rc = vm->registers[reg_c]; \\\n"
+      "  rd = vm->registers[reg_d]\n\n"
+      "// anything without a template, through the instruction_table handler\n"
+      "#define smvm_aot_step(_index)                  \\\n"
+      "  smvm_aot_spill();                            \\\n"
+      "  next = smvm_step(vm, _index);                \\\n"
+      "  smvm_aot_reload();                           \\\n"
+      "  if (next == smvm_step_exit) goto exit;       \\\n"
+      "  if (next != (_index) + 1) goto dispatch\n\n"
+      "#define smvm_aot_scall(_index, _id)                              \\\n"
+      "  if ((_id) < vm->syscalls.len &&                                \\\n"
+      "      ((smvm_syscall *)listmv_at(&vm->syscalls, _id))->function) { \\\n"
+      "    smvm_aot_spill();                                              \\\n"
+      "    vm->registers[reg_ip] = _index;                                \\\n"
+      "    ((smvm_syscall *)listmv_at(&vm->syscalls, _id))->function(vm); \\\n"
+      "    smvm_aot_reload();                                             \\\n"
+      "    if (smvm_get_flag(vm, flag_t)) goto exit;                      \\\n"
+      "  } else {                                                         \\\n"
+      "    smvm_aot_step(_index);                                         \\\n"
+      "  }\n\n",
+      out);
+
+  fputs(
+      "static void smvm_aot_body(smvm *vm) {\n"
+      "  i64 ra, rb, rc, rd;\n"
+      "  u64 next = 0;\n"
+      "  smvm_aot_reload();\n"
+      "  goto i0;\n\n"
+      "  // targets only known at run time, after a fallback or ret\n"
+      "dispatch:\n"
+      "  switch (next) {\n",
+      out);
+  for (u64 i = 0; i < len; i++)
+    fprintf(out, "    case %llu: goto i%llu;\n", (unsigned long long)i,
+            (unsigned long long)i);
+  fprintf(out, "    default: goto i%llu;\n  }\n\n", (unsigned long long)len);
+
+  for (u64 i = 0; i < len; i++) {
+    asmv_inst *inst = listmv_at(&vm->instructions, i);
+    fprintf(out, "i%llu:  // %s\n", (unsigned long long)i,
+            instruction_table[inst->code].name);
+    if (!csmv_inst(vm, out, inst, i))
+      fprintf(out, "  smvm_aot_step(%llu);\n", (unsigned long long)i);
+  }
+
+  fprintf(out,
+          "i%llu:\n"
+          "  vm->registers[reg_ip] = %llu;\n"
+          "exit:\n"
+          "  smvm_aot_spill();\n"
+          "}\n\n",
+          (unsigned long long)len, (unsigned long long)len);
+
+  // traps leave the body through vm->escape, set up here
+  fputs(
+      "smvm_result smvm_aot_run(smvm *vm) {\n"
+      "  return smvm_execute_aot(vm, smvm_aot_body);\n"
+      "}\n\n",
+      out);
+
+  fputs(
+      "#ifndef smvm_aot_no_main\n"
+      "int main(void) {\n"
+      "  smvm vm;\n"
+      "  smvm_init(&vm);\n"
+      "  if (!smvm_aot_load(&vm)) return 1;\n"
+      "  smvm_result result = smvm_aot_run(&vm);\n"
+      "  smvm_free(&vm);\n"
+      "  if (result.status != status_trapped) return 0;\n"
+      "  fprintf(stderr, \"Error: trap %d at instruction %llu\\n\", result.trap,\n"
+      "          (unsigned long long)result.index);\n"
+      "  return -1;\n"
+      "}\n"
+      "#endif\n",
+      out);
+}
@@ -0,0 +1,22 @@
+#ifndef smv_smvm_csmv_h
+#define smv_smvm_csmv_h
+
+#include <stdio.h>
+
+#include "smvm.h"
+#include "util.h"
+
+// csmv - the ahead-of-time asmv to C transpiler
+// turns vm->instructions into a standalone C file with one goto label per
+// instruction and ra..rd as locals. the image is embedded as well, anything
+// without a C template runs through smvm_step on it, so the output only needs
+// smvm.h and the smvm library. the generated file has:
+//   bool smvm_aot_load(smvm *vm);        // load the embedded image into vm
+//   smvm_result smvm_aot_run(smvm *vm);  // run it, like smvm_execute
+//   int main(void);                      // unless smvm_aot_no_main is defined, -1 on a trap
+// natives linked with smvm_link_syscall before smvm_aot_load are kept, scall
+// goes through vm->syscalls just like on the interpreter.
+
+void csmv_transpile(smvm *vm, FILE *out);
+
+#endif
@@ -1,16 +1,163 @@
 #include "dsmv.h"
 
+#include "smvm.h"
+
 void dsmv_init(dsmv *ds) {
   listmv_init(&ds->code, sizeof(char));
+  listmv_init(&ds->stringpool, sizeof(u8));
+  asmv_strings_init(&ds->strings, NULL);
   ds->index = 0;
 }
 
+u64 dsmv_decode_inst(u8 *bytes, u64 len, asmv_inst *inst, listmv(u8) *pool,
+                     asmv_strings *strings) {
+  *inst = (asmv_inst){.code = bytes[0] & 0b111111};
+  if (inst->code >= instruction_table_len) return 0;
+
+  const u8 num_ops = instruction_table[inst->code].num_ops;
+  if (num_ops == 0) return 1;
+
+  u64 size = num_ops == 3 ? 4 : 3;
+  if (len < size) return 0;
+
+  // see the layout in asmv_assemble's second pass
+  u8 modes[3] = {bytes[0] >> 6, bytes[1] >> 6, bytes[2] >> 6};
+  u8 offsets[3] = {(bytes[1] >> 5) & 1, (bytes[1] >> 4) & 1, 0};
+  u8 widths[3] = {(bytes[1] >> 2) & 0b11, bytes[1] & 0b11, 0};
+  u8 fields[3] = {bytes[2] & 0b111, (bytes[2] >> 3) & 0b111, 0};
+  if (num_ops == 3) {
+    offsets[2] = (bytes[3] >> 5) & 1;
+    widths[2] = (bytes[3] >> 3) & 0b11;
+    fields[2] = bytes[3] & 0b111;
+  }
+
+  for (int i = 0; i < num_ops; i++) {
+    asmv_operand *op = &inst->operands[i];
+    op->mode = modes[i];
+    op->width = widths[i];
+
+    if (offsets[i]) {
+      if (size >= len) return 0;
+      op->offset = bytes[size++];
+    }
+
+    if (op->mode == mode_register || op->mode == mode_indirect) {
+      op->data.type = asmv_reg_type;
+      op->data.reg = fields[i];
+      op->size = smvm_reg64;
+    } else {
+      u8 data_size = 1 << fields[i];
+      if (size + data_size > len) return 0;
+      op->data.type = asmv_unum_type;
+      op->data.unum = 0;
+      op->size = fields[i];
+      for (int n = 0; n < data_size; n++)
+        op->data.unum = (op->data.unum << 8) | bytes[size++];
+    }
+  }
+
+  // puts and extern carry their string inline, after the immediates
+  if (inst->code != op_puts && inst->code != op_extern) return size;
+  for (int i = 0; i < num_ops; i++) {
+    asmv_operand *op = &inst->operands[i];
+    if (op->mode != mode_register) continue;
+
+    u8 *end = memchr(bytes + size, '\0', len - size);
+    if (end == NULL) return 0;
+    u64 str_len = end - (bytes + size) + 1;
+
+    op->data.type = asmv_str_type;
+    u64 start = pool->len;
+    listmv_push_array(pool, bytes + size, str_len);
+    op->data.str = asmv_intern(pool, strings, start);
+    size += str_len;
+  }
+
+  return size;
+}
+
+static void dsmv_emit(dsmv *ds, const char *text) {
+  listmv_push_array(&ds->code, (void *)text, strlen(text));
+}
+
+static void dsmv_emit_register(dsmv *ds, u8 reg, smvm_data_width width) {
+  static const char *names[] = {"a", "b", "c", "d", "fl", "sp", "ip", "bp"};
+  static const char *suffixes[] = {"8", "16", "32", ""};
+  dsmv_emit(ds, "r");
+  dsmv_emit(ds, names[reg]);
+  if (reg <= reg_d) dsmv_emit(ds, suffixes[width]);
+}
+
+static void dsmv_emit_operand(dsmv *ds, asmv_operand *op) {
+  char buffer[32];
+
+  if (op->data.type == asmv_str_type) {
+    dsmv_emit(ds, "\"");
+    char *str = listmv_at(&ds->stringpool, op->data.str.offset);
+    for (char *c = str; *c; c++) {
+      switch (*c) {
+        case '\n': dsmv_emit(ds, "\\n"); break;
+        case '\t': dsmv_emit(ds, "\\t"); break;
+        case '\r': dsmv_emit(ds, "\\r"); break;
+        case '"': dsmv_emit(ds, "\\\""); break;
+        case '\\': dsmv_emit(ds, "\\\\"); break;
+        default: listmv_push(&ds->code, c);
+      }
+    }
+    dsmv_emit(ds, "\"");
+    return;
+  }
+
+  switch (op->mode) {
+    case mode_register: dsmv_emit_register(ds, op->data.reg, op->width); break;
+    case mode_indirect:
+      dsmv_emit(ds, "@");
+      dsmv_emit_register(ds, op->data.reg, op->width);
+      break;
+    case mode_direct:
+      snprintf(buffer, sizeof(buffer), "@%lu", op->data.unum);
+      dsmv_emit(ds, buffer);
+      if (op->width != smvm_reg64) {
+        snprintf(buffer, sizeof(buffer), ">%d", 8 << op->width);
+        dsmv_emit(ds, buffer);
+      }
+      break;
+    case mode_immediate:
+      snprintf(buffer, sizeof(buffer), "%lu", op->data.unum);
+      dsmv_emit(ds, buffer);
+      break;
+  }
+}
+
 void dsmv_disassemble(dsmv *ds) {
+  u8 *bytes = ds->bytecode.data;
+
+  for (ds->index = 0; ds->index < ds->bytecode.len;) {
+    asmv_inst inst;
+    u64 size = dsmv_decode_inst(bytes + ds->index, ds->bytecode.len - ds->index,
+                                &inst, &ds->stringpool, &ds->strings);
+    if (size == 0) {
+      dsmv_emit(ds, "; malformed bytecode\n");
+      break;
+    }
+
+    dsmv_emit(ds, instruction_table[inst.code].name);
+    for (int i = 0; i < instruction_table[inst.code].num_ops; i++) {
+      dsmv_emit(ds, " ");
+      dsmv_emit_operand(ds, &inst.operands[i]);
+    }
+    dsmv_emit(ds, "\n");
+    ds->index += size;
+  }
+
+  listmv_push(&ds->code, &(char){'\0'});
 }
 
 /* vm - disassembler (dsmv) - functions */
 void dsmv_free(dsmv *ds) {
   listmv_free(&ds->code);
+  listmv_free(&ds->stringpool);
+  asmv_strings_free(&ds->strings);
   // ownership of ds->bytecode goes to a vm
   // so no need to free it
 }
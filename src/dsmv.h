@@ -1,11 +1,14 @@
 #ifndef smv_smvm_dsmv_h
 #define smv_smvm_dsmv_h
 
+#include "asmv.h"
 #include "util.h"
 
 typedef struct dsmv {
   listmv(u8) bytecode;  // input
   listmv(char *) code;  // output
+  listmv(u8) stringpool;
+  asmv_strings strings;  // what's in stringpool
   u64 index;
 } dsmv;
 
@@ -13,4 +16,10 @@ void dsmv_init(dsmv *ds);
 void dsmv_disassemble(dsmv *ds);
 void dsmv_free(dsmv *ds);
 
+// decodes the instruction at the start of bytes, see docs/BYTECODE.md
+// returns its size in bytes, or 0 if it runs past len or is malformed.
+// strings get interned into pool, see asmv_intern
+u64 dsmv_decode_inst(u8 *bytes, u64 len, asmv_inst *inst, listmv(u8) *pool,
+                     asmv_strings *strings);
+
 #endif
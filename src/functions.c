@@ -1,9 +1,10 @@
 #include <stdio.h>
 
 #include "asmv.h"
+#include "jsmv.h"
 #include "smvm.h"
 
-void trap_fn(smvm *vm) { smvm_set_flag(vm, flag_t); }
+void trap_fn(smvm *vm) { smvm_raise(vm, status_halted, trap_none); }
 void mov_fn(smvm *vm) {
   mov_mem((u8 *)vm->cache.pointers[0], (u8 *)vm->cache.pointers[1],
           vm->cache.widths[0]);
@@ -104,60 +105,70 @@ void shli_fn(smvm *vm) {}
 void shri_fn(smvm *vm) {}
 void slc_fn(smvm *vm) {}
 void src_fn(smvm *vm) {}
-void jmp_fn(smvm *vm) {
-  vm->registers[reg_bp] = 0;
-  mov_mem((u8 *)&vm->registers[reg_bp], (u8 *)vm->cache.pointers[2],
-          vm->cache.widths[2]);
-  vm->registers[reg_ip] = vm->cache.instruction->label_index - 1;
-}
+// every taken jump or call costs one unit of fuel
+static void charge_fuel(smvm *vm) {
+  if (vm->fuel == smvm_fuel_unlimited) return;
+  if (vm->fuel == 0) smvm_raise(vm, status_out_of_fuel, trap_none);
+  else vm->fuel--;
+}
+// every taken jump ends up here, backward ones feed the tracing jit
+static void branch_taken(smvm *vm, u8 label) {
+  charge_fuel(vm);
+  vm->registers[reg_bp] = *vm->cache.pointers[label];
+
+  u64 from = vm->registers[reg_ip];
+  u64 target = vm->cache.extra[0];
+  vm->registers[reg_ip] = target - 1;
+  if (vm->engine == engine_tracing && target <= from &&
+      vm->fuel == smvm_fuel_unlimited)
+    jsmv_backward_branch(vm, target);
+}
+void jmp_fn(smvm *vm) { branch_taken(vm, 0); }
 void je_fn(smvm *vm) {
   if (*vm->cache.pointers[0] != *vm->cache.pointers[1]) { return; }  // else
-  vm->registers[reg_bp] = 0;
-  mov_mem((u8 *)&vm->registers[reg_bp], (u8 *)vm->cache.pointers[2],
-          vm->cache.widths[2]);
-  vm->registers[reg_ip] = vm->cache.instruction->label_index - 1;
+  branch_taken(vm, 2);
 }
 void jne_fn(smvm *vm) {
   i64 left = 0, right = 0;
   mov_mem((u8 *)&left, (u8 *)vm->cache.pointers[0], vm->cache.widths[0]);
   mov_mem((u8 *)&right, (u8 *)vm->cache.pointers[1], vm->cache.widths[1]);
   if (left == right) { return; }  // else
-  vm->registers[reg_bp] = 0;
-  mov_mem((u8 *)&vm->registers[reg_bp], (u8 *)vm->cache.pointers[2],
-          vm->cache.widths[2]);
-  vm->registers[reg_ip] = vm->cache.instruction->label_index - 1;
+  branch_taken(vm, 2);
 }
 void jl_fn(smvm *vm) {
   i64 left = 0, right = 0;
   mov_mem((u8 *)&left, (u8 *)vm->cache.pointers[0], vm->cache.widths[0]);
   mov_mem((u8 *)&right, (u8 *)vm->cache.pointers[1], vm->cache.widths[1]);
   if (left < right) { return; }  // else
-  vm->registers[reg_bp] = 0;
-  mov_mem((u8 *)&vm->registers[reg_bp], (u8 *)vm->cache.pointers[2],
-          vm->cache.widths[2]);
-  vm->registers[reg_ip] = vm->cache.instruction->label_index - 1;
+  branch_taken(vm, 2);
 }
 void loop_fn(smvm *vm) { smvm_push(vm, (u8 *)&vm->registers[reg_ip], 8); }
 void call_fn(smvm *vm) {
-  u64 addr = vm->registers[reg_ip];
-  smvm_push(vm, (u8 *)&addr, 8);
-  vm->registers[reg_bp] = 0;
-  mov_mem((u8 *)&vm->registers[reg_bp], (u8 *)vm->cache.pointers[0],
-          vm->cache.widths[0]);
-  vm->registers[reg_ip] = vm->cache.instruction->label_index - 1;
-}
-void ret_fn(smvm *vm) {
-  vm->registers[reg_ip] = *(i64 *)smvm_pop(vm, 8);
-  asmv_inst *inst =
-      (asmv_inst *)listmv_at(&vm->instructions, vm->registers[reg_ip]);
-  vm->registers[reg_bp] = inst->index;
+  charge_fuel(vm);
+  smvm_push_frame(vm, vm->registers[reg_ip], vm->cache.extra[1]);
+  vm->registers[reg_bp] = *vm->cache.pointers[0];
+  vm->registers[reg_ip] = vm->cache.extra[0] - 1;
+}
+void ret_fn(smvm *vm) { vm->registers[reg_ip] = smvm_pop_frame(vm) - 1; }
+// vsmv_verify proved the frame is there
+void ret_unchecked_fn(smvm *vm) {
+  smvm_frame frame;
+  u64 sp = vm->registers[reg_sp] -= sizeof(smvm_frame);
+  mov_mem((u8 *)&frame, msmv_stack_at(&vm->stack, sp), sizeof(smvm_frame));
+  vm->registers[reg_bp] = frame.bp;
+  vm->registers[reg_ip] = frame.ip;
 }
 void push_fn(smvm *vm) {
   smvm_push(vm, (u8 *)vm->cache.pointers[0], vm->cache.widths[0]);
 }
 void pop_fn(smvm *vm) {
   u8 *data = smvm_pop(vm, vm->cache.widths[0]);
-  mov_mem((u8 *)vm->cache.pointers[0], data, vm->cache.widths[0]);
+  if (data) mov_mem((u8 *)vm->cache.pointers[0], data, vm->cache.widths[0]);
+}
+void pop_unchecked_fn(smvm *vm) {
+  u64 sp = vm->registers[reg_sp] -= vm->cache.widths[0];
+  mov_mem((u8 *)vm->cache.pointers[0], msmv_stack_at(&vm->stack, sp),
+          vm->cache.widths[0]);
 }
 void extern_fn(smvm *vm) {
   char *name = (char *)vm->cache.pointers[0];
@@ -181,17 +192,17 @@ void extern_fn(smvm *vm) {
 void scall_fn(smvm *vm) {
   u64 index = *vm->cache.pointers[0];
 
-  if (index < vm->syscalls.len) {
-    smvm_syscall *syscall = (smvm_syscall *)listmv_at(&vm->syscalls, index);
-    if (syscall->function != NULL) {
-      syscall->function(vm);
-      return;
-    }
-    fprintf(stderr, "Error: Syscall '%s' (index %ld) has no implementation\n",
-            syscall->name, index);
-  } else fprintf(stderr, "Error: Syscall index %ld is out of bounds\n", index);
+  if (index >= vm->syscalls.len) {
+    smvm_raise(vm, status_trapped, trap_syscall_range);
+    return;
+  }
 
-  smvm_set_flag(vm, flag_t);
+  smvm_syscall *syscall = (smvm_syscall *)listmv_at(&vm->syscalls, index);
+  if (syscall->function == NULL) {
+    smvm_raise(vm, status_trapped, trap_syscall_missing);
+    return;
+  }
+  syscall->function(vm);
 }
 void getu_fn(smvm *vm) {
   u64 input;
@@ -216,6 +227,110 @@ void putf_fn(smvm *vm) {
   fflush(stdout);
 }
 void puts_fn(smvm *vm) {
-  printf("%s", (char *)vm->cache.instruction->operands[0].data.str.data);
+  printf("%s", (char *)vm->cache.pointers[0]);
   fflush(stdout);
 }
+
+// the atomics take their width from the memory operand, always the first
+// one but for aload
+static void *atomic_at(smvm *vm, int op) {
+  u8 width = vm->cache.widths[op];
+  if ((uintptr_t)vm->cache.pointers[op] & (width - 1))
+    smvm_raise(vm, status_trapped, trap_misaligned);
+  return vm->cache.pointers[op];
+}
+// zero extended to 64 bits
+static u64 operand_value(smvm *vm, int op) {
+  u64 value = 0;
+  mov_mem((u8 *)&value, (u8 *)vm->cache.pointers[op], vm->cache.widths[op]);
+  return value;
+}
+#define atomic_sized(_width, _fn, _at, ...)                    \
+  ((_width) == 1   ? _fn((u8 *)(_at), __VA_ARGS__)             \
+   : (_width) == 2 ? _fn((u16 *)(_at), __VA_ARGS__)            \
+   : (_width) == 4 ? _fn((u32 *)(_at), __VA_ARGS__)            \
+                   : _fn((u64 *)(_at), __VA_ARGS__))
+void aload_fn(smvm *vm) {
+  void *at = atomic_at(vm, 1);
+  u64 value = atomic_sized(vm->cache.widths[1], __atomic_load_n, at,
+                           __ATOMIC_SEQ_CST);
+  mov_mem((u8 *)vm->cache.pointers[0], (u8 *)&value, vm->cache.widths[0]);
+}
+void astore_fn(smvm *vm) {
+  void *at = atomic_at(vm, 0);
+  u64 value = operand_value(vm, 1);
+  atomic_sized(vm->cache.widths[0], __atomic_store_n, at, value,
+               __ATOMIC_SEQ_CST);
+}
+void cas_fn(smvm *vm) {
+  void *at = atomic_at(vm, 0);
+  u8 width = vm->cache.widths[0];
+  u64 expected = operand_value(vm, 1), desired = operand_value(vm, 2);
+  // the narrow ones compare what they'd read, the rest of expected is zero
+  u64 seen = expected;
+  bool swapped;
+  switch (width) {
+    case 1: {
+      u8 old = seen;
+      swapped = __atomic_compare_exchange_n((u8 *)at, &old, desired, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      seen = old;
+      break;
+    }
+    case 2: {
+      u16 old = seen;
+      swapped = __atomic_compare_exchange_n((u16 *)at, &old, desired, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      seen = old;
+      break;
+    }
+    case 4: {
+      u32 old = seen;
+      swapped = __atomic_compare_exchange_n((u32 *)at, &old, desired, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      seen = old;
+      break;
+    }
+    default:
+      swapped = __atomic_compare_exchange_n((u64 *)at, &seen, desired, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+  // like cmpxchg, ry still equal to what the guest expected means it swapped
+  if (swapped) smvm_set_flag(vm, flag_z);
+  else {
+    smvm_reset_flag(vm, flag_z);
+    mov_mem((u8 *)vm->cache.pointers[1], (u8 *)&seen, vm->cache.widths[1]);
+  }
+}
+void xadd_fn(smvm *vm) {
+  void *at = atomic_at(vm, 0);
+  u64 value = operand_value(vm, 1);
+  u64 old = atomic_sized(vm->cache.widths[0], __atomic_fetch_add, at, value,
+                         __ATOMIC_SEQ_CST);
+  mov_mem((u8 *)vm->cache.pointers[1], (u8 *)&old, vm->cache.widths[1]);
+}
+void fence_fn(smvm *vm) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+#undef atomic_sized
+
+// the upper half of memory, unless smvm_set_heap said otherwise
+static hsmv *guest_heap(smvm *vm) {
+  if (vm->heap.base == 0)
+    hsmv_init(&vm->heap, vm->memory.size / 2, vm->memory.size / 2);
+  return &vm->heap;
+}
+void alloc_fn(smvm *vm) {
+  u64 size = operand_value(vm, 1);
+  u64 addr = hsmv_alloc(guest_heap(vm), size);
+  mov_mem((u8 *)vm->cache.pointers[0], (u8 *)&addr, vm->cache.widths[0]);
+}
+void free_fn(smvm *vm) {
+  u64 addr = operand_value(vm, 0);
+  if (addr != 0 && !hsmv_release(guest_heap(vm), &vm->memory, addr))
+    smvm_raise(vm, status_trapped, trap_heap);
+}
+void realloc_fn(smvm *vm) {
+  u64 addr = operand_value(vm, 0), size = operand_value(vm, 1);
+  u64 to = hsmv_resize(guest_heap(vm), &vm->memory, addr, size);
+  if (to == hsmv_invalid) smvm_raise(vm, status_trapped, trap_heap);
+  mov_mem((u8 *)vm->cache.pointers[0], (u8 *)&to, vm->cache.widths[0]);
+}
@@ -0,0 +1,244 @@
+#include "hsmv.h"
+
+static const u16 hsmv_classes[hsmv_class_num] = {
+    16,  32,  48,  64,  80,  96,  112,  128,  160,  192,  224,  256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048};
+
+// 16 byte steps up to 128, then 4 classes to each doubling
+static u8 hsmv_class(u64 size) {
+  if (size <= 128) return size ? (size - 1) / 16 : 0;
+  u64 shift = 63 - __builtin_clzll(size - 1);
+  return 8 + (shift - 7) * 4 + ((size - 1) >> (shift - 2)) - 4;
+}
+
+static hsmv_page *hsmv_at(hsmv *heap, u32 p) {
+  return listmv_at(&heap->pages, p);
+}
+
+static void hsmv_link(hsmv *heap, u32 *head, u32 p) {
+  hsmv_page *page = hsmv_at(heap, p);
+  page->prev = hsmv_none;
+  page->next = *head;
+  if (*head != hsmv_none) hsmv_at(heap, *head)->prev = p;
+  *head = p;
+}
+
+static void hsmv_unlink(hsmv *heap, u32 *head, u32 p) {
+  hsmv_page *page = hsmv_at(heap, p);
+  if (page->prev != hsmv_none) hsmv_at(heap, page->prev)->next = page->next;
+  else *head = page->next;
+  if (page->next != hsmv_none) hsmv_at(heap, page->next)->prev = page->prev;
+}
+
+bool hsmv_init(hsmv *heap, u64 base, u64 size) {
+  if (base == 0 || base % hsmv_page_size || size < hsmv_page_size)
+    return false;
+  u64 pages = size / hsmv_page_size;
+  if (pages >= hsmv_none) pages = hsmv_none - 1;
+  *heap = (hsmv){.base = base, .size = pages * hsmv_page_size};
+  for (int c = 0; c < hsmv_class_num; c++) heap->partial[c] = hsmv_none;
+  heap->spans = hsmv_none;
+  listmv_init(&heap->pages, sizeof(hsmv_page));
+  return true;
+}
+
+void hsmv_free(hsmv *heap) {
+  if (heap->base != 0) listmv_free(&heap->pages);
+  *heap = (hsmv){0};
+}
+
+void hsmv_reset(hsmv *heap) {
+  if (heap->base == 0) return;
+  heap->top = 0;
+  heap->pages.len = 0;
+  for (int c = 0; c < hsmv_class_num; c++) heap->partial[c] = hsmv_none;
+  heap->spans = hsmv_none;
+  heap->stats = (hsmv_stats){0};
+}
+
+void hsmv_copy(hsmv *to, hsmv *from) {
+  *to = *from;
+  if (from->base == 0) return;
+  listmv_init(&to->pages, sizeof(hsmv_page));
+  listmv_push_array(&to->pages, from->pages.data, from->pages.len);
+}
+
+// n pages from the first free span they fit in, or from past top.
+// hsmv_none when there's no room
+static u32 hsmv_take(hsmv *heap, u64 n) {
+  for (u32 p = heap->spans; p != hsmv_none; p = hsmv_at(heap, p)->next) {
+    u32 len = hsmv_at(heap, p)->pages;
+    if (len < n) continue;
+    hsmv_unlink(heap, &heap->spans, p);
+    if (len > n) {
+      hsmv_at(heap, p + n)->pages = hsmv_at(heap, p + len - 1)->pages =
+          len - n;
+      hsmv_link(heap, &heap->spans, p + n);
+    }
+    heap->stats.free_pages -= n;
+    return p;
+  }
+
+  if (n > heap->size / hsmv_page_size - heap->top) return hsmv_none;
+  u32 p = heap->top;
+  heap->top += n;
+  listmv_reserve(&heap->pages, n);
+  memset(hsmv_at(heap, p), 0, n * sizeof(hsmv_page));
+  heap->pages.len = heap->top;
+  heap->stats.footprint = heap->top * hsmv_page_size;
+  return p;
+}
+
+// pages [p, p + n) back to the spans, merged with the ones either side, and
+// back to the untouched part when they end at top
+static void hsmv_give_back(hsmv *heap, msmv *memory, u32 p, u32 n) {
+  for (u32 i = 0; i < n; i++) hsmv_at(heap, p + i)->kind = page_free;
+  msmv_discard(memory, heap->base + (u64)p * hsmv_page_size,
+               (u64)n * hsmv_page_size);
+  heap->stats.free_pages += n;
+
+  // only a span's first and last page know how long it is
+  if (p > 0 && hsmv_at(heap, p - 1)->kind == page_free) {
+    u32 left = p - hsmv_at(heap, p - 1)->pages;
+    hsmv_unlink(heap, &heap->spans, left);
+    n += p - left;
+    p = left;
+  }
+  if (p + n < heap->top && hsmv_at(heap, p + n)->kind == page_free) {
+    u32 right = hsmv_at(heap, p + n)->pages;
+    hsmv_unlink(heap, &heap->spans, p + n);
+    n += right;
+  }
+
+  if (p + n == heap->top) {
+    heap->top = p;
+    heap->pages.len = p;
+    heap->stats.free_pages -= n;
+    heap->stats.footprint = heap->top * hsmv_page_size;
+    return;
+  }
+  hsmv_at(heap, p)->pages = hsmv_at(heap, p + n - 1)->pages = n;
+  hsmv_link(heap, &heap->spans, p);
+}
+
+u64 hsmv_alloc(hsmv *heap, u64 size) {
+  if (size > hsmv_max_class) {
+    u64 n = (size + hsmv_page_size - 1) / hsmv_page_size;
+    u32 p = n < hsmv_none ? hsmv_take(heap, n) : hsmv_none;
+    if (p == hsmv_none) return 0;
+    hsmv_at(heap, p)->kind = page_large;
+    hsmv_at(heap, p)->pages = n;
+    for (u32 i = 1; i < n; i++) hsmv_at(heap, p + i)->kind = page_tail;
+    heap->stats.in_use += n * hsmv_page_size;
+    heap->stats.blocks++;
+    heap->stats.allocs++;
+    return heap->base + (u64)p * hsmv_page_size;
+  }
+
+  u8 c = hsmv_class(size);
+  u64 blocks = hsmv_page_size / hsmv_classes[c];
+  u32 p = heap->partial[c];
+  if (p == hsmv_none) {
+    p = hsmv_take(heap, 1);
+    if (p == hsmv_none) return 0;
+    hsmv_page *slab = hsmv_at(heap, p);
+    *slab = (hsmv_page){.kind = page_slab, .size_class = c};
+    // the bits past the last block are never free
+    for (u64 b = blocks; b < 256; b++) slab->bitmap[b / 64] |= 1ull << (b % 64);
+    hsmv_link(heap, &heap->partial[c], p);
+    heap->stats.slabs++;
+  }
+
+  hsmv_page *slab = hsmv_at(heap, p);
+  int w = 0;
+  while (slab->bitmap[w] == ~0ull) w++;
+  u64 b = w * 64 + __builtin_ctzll(~slab->bitmap[w]);
+  slab->bitmap[w] |= 1ull << (b % 64);
+  if (++slab->used == blocks) hsmv_unlink(heap, &heap->partial[c], p);
+  heap->stats.in_use += hsmv_classes[c];
+  heap->stats.blocks++;
+  heap->stats.allocs++;
+  return heap->base + (u64)p * hsmv_page_size + b * hsmv_classes[c];
+}
+
+// the page addr's block starts on and its index there, false unless addr is
+// a block given out
+static bool hsmv_find(hsmv *heap, u64 addr, u32 *p, u64 *b) {
+  if (addr < heap->base || addr - heap->base >= heap->top * hsmv_page_size)
+    return false;
+  *p = (addr - heap->base) / hsmv_page_size;
+  u64 offset = (addr - heap->base) % hsmv_page_size;
+  hsmv_page *page = hsmv_at(heap, *p);
+  switch (page->kind) {
+    case page_large: *b = 0; return offset == 0;
+    case page_slab: {
+      u64 size = hsmv_classes[page->size_class];
+      *b = offset / size;
+      return offset % size == 0 && *b < hsmv_page_size / size &&
+             (page->bitmap[*b / 64] >> (*b % 64) & 1);
+    }
+    default: return false;
+  }
+}
+
+bool hsmv_release(hsmv *heap, msmv *memory, u64 addr) {
+  u32 p;
+  u64 b;
+  if (!hsmv_find(heap, addr, &p, &b)) return false;
+  hsmv_page *page = hsmv_at(heap, p);
+  heap->stats.blocks--;
+  heap->stats.frees++;
+  if (page->kind == page_large) {
+    heap->stats.in_use -= (u64)page->pages * hsmv_page_size;
+    hsmv_give_back(heap, memory, p, page->pages);
+    return true;
+  }
+
+  u8 c = page->size_class;
+  heap->stats.in_use -= hsmv_classes[c];
+  page->bitmap[b / 64] &= ~(1ull << (b % 64));
+  if (page->used-- == hsmv_page_size / hsmv_classes[c])
+    hsmv_link(heap, &heap->partial[c], p);
+  // an empty slab goes back unless it's the last one with room, a block
+  // allocated and freed over and over doesn't cost a page each time
+  if (page->used == 0 &&
+      (page->prev != hsmv_none || page->next != hsmv_none)) {
+    hsmv_unlink(heap, &heap->partial[c], p);
+    heap->stats.slabs--;
+    hsmv_give_back(heap, memory, p, 1);
+  }
+  return true;
+}
+
+u64 hsmv_resize(hsmv *heap, msmv *memory, u64 addr, u64 size) {
+  if (addr == 0) return hsmv_alloc(heap, size);
+  u32 p;
+  u64 b;
+  if (!hsmv_find(heap, addr, &p, &b)) return hsmv_invalid;
+
+  hsmv_page *page = hsmv_at(heap, p);
+  u64 capacity;
+  if (page->kind == page_large) {
+    capacity = (u64)page->pages * hsmv_page_size;
+    u64 n = (size + hsmv_page_size - 1) / hsmv_page_size;
+    // a large block shrinks where it is, the pages past it go back
+    if (size > hsmv_max_class && n <= page->pages) {
+      u32 extra = page->pages - n;
+      page->pages = n;
+      heap->stats.in_use -= (u64)extra * hsmv_page_size;
+      if (extra) hsmv_give_back(heap, memory, p + n, extra);
+      return addr;
+    }
+  } else {
+    capacity = hsmv_classes[page->size_class];
+    if (size <= hsmv_max_class && hsmv_class(size) == page->size_class)
+      return addr;
+  }
+
+  u64 to = hsmv_alloc(heap, size);
+  if (to == 0) return 0;
+  memmove(msmv_at(memory, to), msmv_at(memory, addr),
+          size < capacity ? size : capacity);
+  hsmv_release(heap, memory, addr);
+  return to;
+}
@@ -0,0 +1,78 @@
+#ifndef smv_smvm_hsmv_h
+#define smv_smvm_hsmv_h
+
+#include "msmv.h"
+#include "util.h"
+
+// hsmv - the guest heap
+// what alloc, free and realloc hand out, a range of guest memory cut into
+// pages of hsmv_page_size. small blocks come from slabs, a page given to
+// one size class, large ones get whole pages. the bookkeeping is all on the
+// host, so nothing the guest writes can break it, and it belongs to one vm
+// and is never locked. pages come from free spans first, first fit, then
+// from the untouched part past top. a slab that empties and the pages of a
+// large block go back to the spans, merged with their neighbours or handed
+// back to top, and the host gets their memory back (see msmv_discard), so a
+// long running guest is never holding more than its live blocks need.
+
+#define hsmv_page_size (4096)
+#define hsmv_class_num (24)
+#define hsmv_max_class (2048)  // past it blocks are whole pages
+#define hsmv_none ((u32)-1)
+
+typedef enum hsmv_kind : u8 {
+  page_free = 0,  // in a free span
+  page_slab = 1,
+  page_large = 2,  // the first page of a large block
+  page_tail = 3,   // the pages after it
+} hsmv_kind;
+
+typedef struct hsmv_page {
+  hsmv_kind kind;
+  u8 size_class;   // of a slab
+  u16 used;        // blocks of a slab given out
+  u32 pages;       // of a large block, or a free span at its first and last
+  u32 prev, next;  // the size class's slabs with room, or the free spans
+  u64 bitmap[4];   // a slab's blocks in use, the ones past its last set too
+} hsmv_page;
+
+typedef struct hsmv_stats {
+  u64 in_use;      // bytes of the blocks given out, rounded to their class
+  u64 blocks;      // given out
+  u64 slabs;       // pages that are slabs
+  u64 free_pages;  // in free spans
+  u64 footprint;   // bytes below top
+  u64 allocs;
+  u64 frees;
+} hsmv_stats;
+
+typedef struct hsmv {
+  u64 base;  // guest address, 0 for no heap yet
+  u64 size;
+  u64 top;   // pages below it have been handed out at some point
+  u32 partial[hsmv_class_num];  // slabs with room, by size class
+  u32 spans;                    // free spans
+  listmv(hsmv_page) pages;      // one for each page below top
+  hsmv_stats stats;
+} hsmv;
+
+// base is page aligned and not 0, size at least a page, false otherwise
+bool hsmv_init(hsmv *heap, u64 base, u64 size);
+void hsmv_free(hsmv *heap);
+// a heap like from, blocks and all, for a vm with a copy of its memory
+void hsmv_copy(hsmv *to, hsmv *from);
+
+// the guest address of a block of at least size bytes, 0 when the heap is
+// full. a block of 0 bytes is a block like any other
+u64 hsmv_alloc(hsmv *heap, u64 size);
+// false if addr isn't a block hsmv_alloc gave out, or was released already
+bool hsmv_release(hsmv *heap, msmv *memory, u64 addr);
+// every block gone at once, the room for the pages' bookkeeping stays. the
+// memory the blocks were in is the caller's to clear
+void hsmv_reset(hsmv *heap);
+// addr's block grown or shrunk to size, moved when it has to be. 0 when the
+// heap is full and addr is kept, hsmv_invalid when addr isn't a block
+u64 hsmv_resize(hsmv *heap, msmv *memory, u64 addr, u64 size);
+#define hsmv_invalid ((u64)-1)
+
+#endif
@@ -0,0 +1,665 @@
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS
+
+#include "jsmv.h"
+
+#include <stddef.h>
+
+#include "asmv.h"
+#include "smvm.h"
+#include "tsmv.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define jsmv_supported (1)
+#include <sys/mman.h>
+#else
+#define jsmv_supported (0)
+#endif
+
+typedef enum jsmv_host_reg : u8 {
+  host_rax = 0,
+  host_rcx = 1,
+  host_rdx = 2,
+  host_rbx = 3,  // the smvm pointer, for the whole run
+  host_rsp = 4,
+  host_rbp = 5,
+  host_rsi = 6,
+  host_rdi = 7,
+  host_r12 = 12,  // ra
+  host_r13 = 13,  // rb
+  host_r14 = 14,  // rc
+  host_r15 = 15,  // rd
+} jsmv_host_reg;
+
+typedef enum jsmv_cond : u8 {
+  cond_e = 0x4,
+  cond_ne = 0x5,
+  cond_b = 0x2,  // unsigned, i64 is a u64 underneath (util.h)
+  cond_ae = 0x3,
+} jsmv_cond;
+
+typedef struct jsmv_fixup {
+  u64 at;      // offset of a rel32
+  u64 target;  // label index
+} jsmv_fixup;
+
+typedef struct jsmv_emitter {
+  u8 *code;
+  u64 len;
+  listmv(jsmv_fixup) fixups;
+} jsmv_emitter;
+
+#define jsmv_reg_offset(_reg) \
+  (offsetof(smvm, registers) + (_reg) * sizeof(i64))
+#define jsmv_host(_reg) (host_r12 + (_reg))
+
+/* emitter */
+
+static void emit(jsmv_emitter *e, u8 byte) { e->code[e->len++] = byte; }
+
+static void emit32(jsmv_emitter *e, u32 value) {
+  memcpy(e->code + e->len, &value, 4);
+  e->len += 4;
+}
+
+static void emit64(jsmv_emitter *e, u64 value) {
+  memcpy(e->code + e->len, &value, 8);
+  e->len += 8;
+}
+
+static void emit_rex(jsmv_emitter *e, u8 reg, u8 rm) {
+  emit(e, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+static void emit_modrm(jsmv_emitter *e, u8 mod, u8 reg, u8 rm) {
+  emit(e, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_mov_rr(jsmv_emitter *e, u8 dest, u8 src) {
+  emit_rex(e, src, dest);
+  emit(e, 0x89);
+  emit_modrm(e, 3, src, dest);
+}
+
+static void emit_mov_imm(jsmv_emitter *e, u8 dest, u64 imm) {
+  if ((int64_t)imm == (int32_t)imm) {
+    emit_rex(e, 0, dest);
+    emit(e, 0xc7);
+    emit_modrm(e, 3, 0, dest);
+    emit32(e, imm);
+    return;
+  }
+  emit_rex(e, 0, dest);
+  emit(e, 0xb8 + (dest & 7));
+  emit64(e, imm);
+}
+
+// add 0x01, or 0x09, and 0x21, sub 0x29, xor 0x31, cmp 0x39
+static void emit_alu(jsmv_emitter *e, u8 opcode, u8 dest, u8 src) {
+  emit_rex(e, src, dest);
+  emit(e, opcode);
+  emit_modrm(e, 3, src, dest);
+}
+
+static void emit_imul(jsmv_emitter *e, u8 dest, u8 src) {
+  emit_rex(e, dest, src);
+  emit(e, 0x0f);
+  emit(e, 0xaf);
+  emit_modrm(e, 3, dest, src);
+}
+
+static void emit_load(jsmv_emitter *e, u8 dest, u32 offset) {
+  emit_rex(e, dest, host_rbx);
+  emit(e, 0x8b);
+  emit_modrm(e, 2, dest, host_rbx);
+  emit32(e, offset);
+}
+
+static void emit_store(jsmv_emitter *e, u32 offset, u8 src) {
+  emit_rex(e, src, host_rbx);
+  emit(e, 0x89);
+  emit_modrm(e, 2, src, host_rbx);
+  emit32(e, offset);
+}
+
+static void emit_jump(jsmv_emitter *e, u64 target) {
+  emit(e, 0xe9);
+  listmv_push(&e->fixups, &(jsmv_fixup){e->len, target});
+  emit32(e, 0);
+}
+
+static void emit_jump_if(jsmv_emitter *e, jsmv_cond cond, u64 target) {
+  emit(e, 0x0f);
+  emit(e, 0x80 | cond);
+  listmv_push(&e->fixups, &(jsmv_fixup){e->len, target});
+  emit32(e, 0);
+}
+
+static void emit_spill(jsmv_emitter *e) {
+  for (int reg = reg_a; reg <= reg_d; reg++)
+    emit_store(e, jsmv_reg_offset(reg), jsmv_host(reg));
+}
+
+static void emit_reload(jsmv_emitter *e) {
+  for (int reg = reg_a; reg <= reg_d; reg++)
+    emit_load(e, jsmv_host(reg), jsmv_reg_offset(reg));
+}
+
+/* templates */
+
+// 'r' is ra..rd at full width, these are the ones living in host registers
+static char jsmv_shape(asmv_operand *op) {
+  if (op->data.type == asmv_str_type) return '?';
+  if (op->mode == mode_register && op->width == smvm_reg64 &&
+      op->data.reg <= reg_d)
+    return 'r';
+  if (op->mode == mode_immediate) return 'i';
+  return '?';
+}
+
+// loads a 'r' or 'i' operand into host, returns the host register holding it
+static u8 jsmv_operand(jsmv_emitter *e, asmv_operand *op, u8 scratch) {
+  if (op->mode == mode_register) return jsmv_host(op->data.reg);
+  emit_mov_imm(e, scratch, op->data.unum);
+  return scratch;
+}
+
+static void emit_call_c(jsmv_emitter *e, void *fn) {
+  emit_mov_rr(e, host_rdi, host_rbx);
+  emit_rex(e, 0, host_rax);
+  emit(e, 0xb8);
+  emit64(e, (u64)fn);
+  emit(e, 0xff);  // call rax
+  emit(e, 0xd0);
+}
+
+static void emit_helper(jsmv_emitter *e, u64 index, u64 len) {
+  emit_spill(e);
+  emit_mov_imm(e, host_rsi, index);
+  emit_call_c(e, smvm_step);
+  emit_reload(e);
+
+  // most instructions just fall through
+  emit_mov_imm(e, host_rcx, index + 1);
+  emit_alu(e, 0x39, host_rax, host_rcx);
+  emit_jump_if(e, cond_e, index + 1);
+  emit_rex(e, 0, host_rax);  // cmp rax, smvm_step_exit
+  emit(e, 0x83);
+  emit_modrm(e, 3, 7, host_rax);
+  emit(e, 0xff);
+  emit_jump_if(e, cond_e, len + 1);
+  emit_jump(e, len + 2);
+}
+
+static bool emit_binary(jsmv_emitter *e, asmv_inst *inst, const char *shape) {
+  u8 opcode;
+  switch (inst->code) {
+    case op_add:
+    case op_addu: opcode = 0x01; break;
+    case op_sub:
+    case op_subu: opcode = 0x29; break;
+    case op_and: opcode = 0x21; break;
+    case op_or: opcode = 0x09; break;
+    case op_xor: opcode = 0x31; break;
+    case op_mul:
+    case op_mulu: opcode = 0; break;
+    default: return false;
+  }
+  if (strcmp(shape, "rrr") && strcmp(shape, "rri")) return false;
+
+  emit_mov_rr(e, host_rax, jsmv_host(inst->operands[1].data.reg));
+  u8 right = jsmv_operand(e, &inst->operands[2], host_rcx);
+  if (opcode) emit_alu(e, opcode, host_rax, right);
+  else emit_imul(e, host_rax, right);
+  emit_mov_rr(e, jsmv_host(inst->operands[0].data.reg), host_rax);
+  return true;
+}
+
+// emits the compare of a conditional branch, returns the condition under
+// which the branch is not taken
+static jsmv_cond emit_compare(jsmv_emitter *e, asmv_inst *inst) {
+  u8 right = jsmv_operand(e, &inst->operands[1], host_rcx);
+  emit_alu(e, 0x39, jsmv_host(inst->operands[0].data.reg), right);
+  switch (inst->code) {
+    case op_je: return cond_ne;
+    case op_jne: return cond_e;
+    default: return cond_b;  // jl_fn jumps unless left < right
+  }
+}
+
+static bool jsmv_is_branch(asmv_inst *inst, const char *shape) {
+  if (inst->code != op_je && inst->code != op_jne && inst->code != op_jl)
+    return false;
+  return !strcmp(shape, "rri") || !strcmp(shape, "rii");
+}
+
+static bool emit_branch(jsmv_emitter *e, asmv_inst *inst, const char *shape) {
+  if (!jsmv_is_branch(inst, shape)) return false;
+  jsmv_cond skip = emit_compare(e, inst);
+
+  // taken: bp <- label address, then jump. always 10 + 7 + 5 bytes
+  emit(e, 0x70 | skip);
+  emit(e, 22);
+  emit_rex(e, 0, host_rax);
+  emit(e, 0xb8);
+  emit64(e, inst->operands[2].data.unum);
+  emit_store(e, jsmv_reg_offset(reg_bp), host_rax);
+  emit_jump(e, inst->label_index);
+  return true;
+}
+
+// everything that is neither a jump nor a helper call
+static bool emit_compute(jsmv_emitter *e, asmv_inst *inst, const char *shape) {
+  switch (inst->code) {
+    case op_mov:
+    case op_movu:
+    case op_movf: {
+      if (strcmp(shape, "rr") && strcmp(shape, "ri")) return false;
+      u8 dest = jsmv_host(inst->operands[0].data.reg);
+      if (shape[1] == 'r')
+        emit_mov_rr(e, dest, jsmv_host(inst->operands[1].data.reg));
+      else emit_mov_imm(e, dest, inst->operands[1].data.unum);
+      return true;
+    }
+    case op_inc:
+    case op_dec:
+      if (strcmp(shape, "r")) return false;
+      emit_rex(e, 0, jsmv_host(inst->operands[0].data.reg));
+      emit(e, 0xff);
+      emit_modrm(e, 3, inst->code == op_dec,
+                 jsmv_host(inst->operands[0].data.reg));
+      return true;
+    default: return emit_binary(e, inst, shape);
+  }
+}
+
+static void jsmv_shape_of(asmv_inst *inst, char shape[4]) {
+  memset(shape, 0, 4);
+  for (int i = 0; i < instruction_table[inst->code].num_ops; i++)
+    shape[i] = jsmv_shape(&inst->operands[i]);
+}
+
+// call and ret only touch the stack, ra..rd stay put in r12..r15 but are
+// spilled for the trap when the frame lands in the stack's guard
+static void emit_call(jsmv_emitter *e, asmv_inst *inst, u64 index) {
+  emit_spill(e);
+  emit_mov_imm(e, host_rax, index);
+  emit_store(e, jsmv_reg_offset(reg_ip), host_rax);
+  emit_mov_imm(e, host_rsi, index);
+  emit_mov_imm(e, host_rdx, inst->index);
+  emit_call_c(e, smvm_push_frame);
+  emit_rex(e, 0, host_rax);
+  emit(e, 0xb8);
+  emit64(e, inst->operands[0].data.unum);
+  emit_store(e, jsmv_reg_offset(reg_bp), host_rax);
+  emit_jump(e, inst->label_index);
+}
+
+static void emit_ret(jsmv_emitter *e, u64 index, u64 len) {
+  // an underflow traps from inside smvm_pop_frame
+  emit_spill(e);
+  emit_mov_imm(e, host_rax, index);
+  emit_store(e, jsmv_reg_offset(reg_ip), host_rax);
+  emit_call_c(e, smvm_pop_frame);
+  emit_jump(e, len + 2);
+}
+
+static bool emit_inst(jsmv_emitter *e, asmv_inst *inst, u64 index, u64 len) {
+  char shape[4];
+  jsmv_shape_of(inst, shape);
+
+  if (inst->code == op_call && shape[0] == 'i') {
+    emit_call(e, inst, index);
+    return true;
+  }
+  if (inst->code == op_ret) {
+    emit_ret(e, index, len);
+    return true;
+  }
+
+  if (inst->code == op_jmp) {
+    emit_rex(e, 0, host_rax);
+    emit(e, 0xb8);
+    emit64(e, inst->operands[0].data.unum);
+    emit_store(e, jsmv_reg_offset(reg_bp), host_rax);
+    emit_jump(e, inst->label_index);
+    return true;
+  }
+  return emit_compute(e, inst, shape) || emit_branch(e, inst, shape);
+}
+
+static void emit_prologue(jsmv_emitter *e) {
+  emit(e, 0x53);  // push rbx
+  for (int reg = reg_a; reg <= reg_d; reg++) {
+    emit(e, 0x41);  // push r12..r15
+    emit(e, 0x50 + (jsmv_host(reg) & 7));
+  }
+  emit_mov_rr(e, host_rbx, host_rdi);
+  emit_reload(e);
+}
+
+static void emit_epilogue(jsmv_emitter *e) {
+  emit_spill(e);
+  for (int reg = reg_d; reg >= reg_a; reg--) {
+    emit(e, 0x41);  // pop r15..r12
+    emit(e, 0x58 + (jsmv_host(reg) & 7));
+  }
+  emit(e, 0x5b);  // pop rbx
+  emit(e, 0xc3);  // ret
+}
+
+static void jsmv_resolve(jsmv_emitter *e, u8 **labels) {
+  for (u64 i = 0; i < e->fixups.len; i++) {
+    jsmv_fixup *fixup = listmv_at(&e->fixups, i);
+    i32 rel = labels[fixup->target] - (e->code + fixup->at + 4);
+    memcpy(e->code + fixup->at, &rel, 4);
+  }
+  listmv_free(&e->fixups);
+}
+
+/* compiler */
+
+bool jsmv_compile(smvm *vm) {
+#if jsmv_supported
+  jsmv_free(vm);
+
+  u64 len = vm->instructions.len;
+  u64 size = (len * 160 + 512 + 4095) & ~4095ull;
+  u8 *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) return false;
+
+  // [len] is the end of the program, [len + 1] the exit, [len + 2] the
+  // dispatcher for targets only known at run time
+  u8 **labels = malloc((len + 3) * sizeof(u8 *));
+  jsmv_emitter e = {.code = code};
+  listmv_init(&e.fixups, sizeof(jsmv_fixup));
+
+  // prologue: (smvm *vm in rdi, entry point in rsi)
+  emit_prologue(&e);
+  emit(&e, 0xff);  // jmp rsi
+  emit(&e, 0xe6);
+
+  for (u64 i = 0; i < len; i++) {
+    labels[i] = code + e.len;
+    asmv_inst *inst = listmv_at(&vm->instructions, i);
+    if (!emit_inst(&e, inst, i, len)) emit_helper(&e, i, len);
+  }
+
+  labels[len] = code + e.len;
+  emit_mov_imm(&e, host_rax, len);
+  emit_store(&e, jsmv_reg_offset(reg_ip), host_rax);
+
+  labels[len + 1] = code + e.len;
+  emit_epilogue(&e);
+
+  // dispatcher: next instruction index in rax
+  labels[len + 2] = code + e.len;
+  emit_mov_imm(&e, host_rcx, len);
+  emit_alu(&e, 0x39, host_rax, host_rcx);
+  emit(&e, 0x0f);  // jae end
+  emit(&e, 0x83);
+  listmv_push(&e.fixups, &(jsmv_fixup){e.len, len});
+  emit32(&e, 0);
+  emit_mov_imm(&e, host_rcx, (u64)labels);
+  emit(&e, 0xff);  // jmp [rcx + rax * 8]
+  emit(&e, 0x24);
+  emit(&e, 0xc1);
+
+  jsmv_resolve(&e, labels);
+
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    free(labels);
+    return false;
+  }
+
+  vm->jit = malloc(sizeof(jsmv));
+  *vm->jit = (jsmv){.code = code, .size = size, .len = len, .labels = labels};
+  return true;
+#else
+  return false;
+#endif
+}
+
+void jsmv_free(smvm *vm) {
+  if (vm->jit == NULL) return;
+#if jsmv_supported
+  munmap(vm->jit->code, vm->jit->size);
+#endif
+  free(vm->jit->labels);
+  free(vm->jit);
+  vm->jit = NULL;
+}
+
+void smvm_execute_jit(smvm *vm) {
+  // native code doesn't count fuel. with no jit on this host or a fuel
+  // limit, the threaded engine is the next best thing
+  if (vm->fuel != smvm_fuel_unlimited ||
+      (vm->jit == NULL && !jsmv_compile(vm))) {
+    tsmv_execute(vm);
+    return;
+  }
+
+  void (*entry)(smvm *, u8 *) = (void (*)(smvm *, u8 *))vm->jit->code;
+  u64 start = vm->registers[reg_ip], len = vm->jit->len;
+  entry(vm, vm->jit->labels[start < len ? start : len]);
+}
+
+/* traces */
+
+typedef struct jsmv_trace_entry {
+  u64 index;
+  bool taken;  // direction the branch went while recording
+} jsmv_trace_entry;
+
+// runs one traceable instruction on a copy of ra..rd, the same way the
+// templates would. false for anything a trace can't hold
+static bool jsmv_simulate(asmv_inst *inst, const char *shape, u64 *regs,
+                          u64 index, u64 *next) {
+  *next = index + 1;
+  if (inst->code == op_jmp) {
+    *next = inst->label_index;
+    return true;
+  }
+  if (jsmv_is_branch(inst, shape)) {
+    u64 left = regs[inst->operands[0].data.reg];
+    u64 right = shape[1] == 'r' ? regs[inst->operands[1].data.reg]
+                                : inst->operands[1].data.unum;
+    bool taken;
+    switch (inst->code) {
+      case op_je: taken = left == right; break;
+      case op_jne: taken = left != right; break;
+      default: taken = !(left < right); break;
+    }
+    if (taken) *next = inst->label_index;
+    return true;
+  }
+
+  if (shape[0] != 'r') return false;
+  u64 *dest = &regs[inst->operands[0].data.reg];
+  switch (inst->code) {
+    case op_mov:
+    case op_movu:
+    case op_movf:
+      if (!strcmp(shape, "rr")) *dest = regs[inst->operands[1].data.reg];
+      else if (!strcmp(shape, "ri")) *dest = inst->operands[1].data.unum;
+      else return false;
+      return true;
+    case op_inc:
+    case op_dec:
+      if (strcmp(shape, "r")) return false;
+      *dest += inst->code == op_inc ? 1 : -1;
+      return true;
+    default: break;
+  }
+
+  if (strcmp(shape, "rrr") && strcmp(shape, "rri")) return false;
+  u64 left = regs[inst->operands[1].data.reg];
+  u64 right = shape[2] == 'r' ? regs[inst->operands[2].data.reg]
+                              : inst->operands[2].data.unum;
+  switch (inst->code) {
+    case op_add:
+    case op_addu: *dest = left + right; break;
+    case op_sub:
+    case op_subu: *dest = left - right; break;
+    case op_mul:
+    case op_mulu: *dest = left * right; break;
+    case op_and: *dest = left & right; break;
+    case op_or: *dest = left | right; break;
+    case op_xor: *dest = left ^ right; break;
+    default: return false;
+  }
+  return true;
+}
+
+// follows one iteration of the loop at header from the current registers,
+// returns the number of entries or 0 if the loop can't be traced
+static u64 jsmv_record(smvm *vm, u64 header, jsmv_trace_entry *entries) {
+  u64 regs[reg_d + 1];
+  for (int reg = reg_a; reg <= reg_d; reg++) regs[reg] = vm->registers[reg];
+
+  u64 count = 0, index = header;
+  do {
+    if (count == jsmv_trace_max || index >= vm->instructions.len) return 0;
+    asmv_inst *inst = listmv_at(&vm->instructions, index);
+    char shape[4];
+    jsmv_shape_of(inst, shape);
+
+    u64 next;
+    if (!jsmv_simulate(inst, shape, regs, index, &next)) return 0;
+    entries[count++] = (jsmv_trace_entry){index, next != index + 1};
+    index = next;
+  } while (index != header);
+  return count;
+}
+
+// native signature: u64 trace(smvm *vm), returns the instruction the loop
+// engine should continue at
+static u8 *jsmv_compile_trace(smvm *vm, jsmv_trace_entry *entries, u64 count,
+                              u64 *size) {
+#if jsmv_supported
+  *size = (count * 96 + 256 + 4095) & ~4095ull;
+  u8 *code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) return NULL;
+
+  // [0] is the top of the loop, [1] the exit, [2 + k] the side exit taken
+  // when the guard of entries[k] fails
+  u8 **labels = malloc((count + 2) * sizeof(u8 *));
+  jsmv_emitter e = {.code = code};
+  listmv_init(&e.fixups, sizeof(jsmv_fixup));
+
+  emit_prologue(&e);
+  labels[0] = code + e.len;
+  for (u64 k = 0; k < count; k++) {
+    asmv_inst *inst = listmv_at(&vm->instructions, entries[k].index);
+    char shape[4];
+    jsmv_shape_of(inst, shape);
+
+    if (inst->code == op_jmp) continue;  // the trace already follows it
+    if (!jsmv_is_branch(inst, shape)) {
+      emit_compute(&e, inst, shape);
+      continue;
+    }
+    jsmv_cond skip = emit_compare(&e, inst);
+    emit_jump_if(&e, entries[k].taken ? skip : skip ^ 1, k + 2);
+  }
+  emit_jump(&e, 0);
+
+  // nothing in the trace reads bp, so the jumps it takes don't store it.
+  // an exit puts in what the last of them this time around would have, with
+  // none yet it's still the header's the branch into the trace left there
+  u64 bp = 0;
+  bool moved = false;
+  for (u64 k = 0; k < count; k++) {
+    asmv_inst *inst = listmv_at(&vm->instructions, entries[k].index);
+    char shape[4];
+    jsmv_shape_of(inst, shape);
+    if (inst->code == op_jmp) {
+      bp = inst->operands[0].data.unum;
+      moved = true;
+    }
+    if (!jsmv_is_branch(inst, shape)) continue;
+
+    labels[k + 2] = code + e.len;
+    if (entries[k].taken) {
+      if (moved) {
+        emit_rex(&e, 0, host_rax);
+        emit(&e, 0xb8);
+        emit64(&e, bp);
+        emit_store(&e, jsmv_reg_offset(reg_bp), host_rax);
+      }
+      emit_mov_imm(&e, host_rax, entries[k].index + 1);
+      bp = inst->operands[2].data.unum;
+      moved = true;
+    } else {
+      emit_rex(&e, 0, host_rax);
+      emit(&e, 0xb8);
+      emit64(&e, inst->operands[2].data.unum);
+      emit_store(&e, jsmv_reg_offset(reg_bp), host_rax);
+      emit_mov_imm(&e, host_rax, inst->label_index);
+    }
+    emit_jump(&e, 1);
+  }
+
+  labels[1] = code + e.len;
+  emit_epilogue(&e);  // leaves rax alone
+  jsmv_resolve(&e, labels);
+  free(labels);
+
+  if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, *size);
+    return NULL;
+  }
+  return code;
+#else
+  return NULL;
+#endif
+}
+
+void jsmv_backward_branch(smvm *vm, u64 target) {
+  jsmv_tracer *tracer = vm->tracer;
+  if (tracer == NULL) {
+    u64 len = vm->instructions.len;
+    tracer = vm->tracer = malloc(sizeof(jsmv_tracer));
+    *tracer = (jsmv_tracer){
+        .hotness = calloc(len, sizeof(u32)),
+        .traces = calloc(len, sizeof(u8 *)),
+        .sizes = calloc(len, sizeof(u64)),
+        .len = len,
+    };
+  }
+
+  if (tracer->traces[target] == NULL) {
+    if (tracer->hotness[target] >= jsmv_hot_threshold) return;  // cold
+    if (++tracer->hotness[target] < jsmv_hot_threshold) return;
+
+    jsmv_trace_entry *entries =
+        malloc(jsmv_trace_max * sizeof(jsmv_trace_entry));
+    u64 count = jsmv_record(vm, target, entries);
+    if (count)
+      tracer->traces[target] =
+          jsmv_compile_trace(vm, entries, count, &tracer->sizes[target]);
+    free(entries);
+    if (tracer->traces[target] == NULL) return;  // stays cold for good
+    vm->stats.traces++;
+  }
+
+  u64 (*trace)(smvm *) = (u64 (*)(smvm *))tracer->traces[target];
+  vm->stats.trace_runs++;
+  vm->registers[reg_ip] = trace(vm) - 1;
+}
+
+void jsmv_free_traces(smvm *vm) {
+  jsmv_tracer *tracer = vm->tracer;
+  if (tracer == NULL) return;
+#if jsmv_supported
+  for (u64 i = 0; i < tracer->len; i++)
+    if (tracer->traces[i]) munmap(tracer->traces[i], tracer->sizes[i]);
+#endif
+  free(tracer->hotness);
+  free(tracer->traces);
+  free(tracer->sizes);
+  free(tracer);
+  vm->tracer = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef smv_smvm_jsmv_h
+#define smv_smvm_jsmv_h
+
+#include "smvm.h"
+#include "util.h"
+
+// jsmv - the baseline x86-64 jit
+// compiles vm->instructions into one executable buffer, instruction by
+// instruction, with ra..rd living in r12..r15 for the whole run. branches
+// between basic blocks are direct native jumps, anything the templates
+// don't cover calls back into the instruction_table handlers.
+// on other hosts smvm_execute_jit just runs the threaded interpreter.
+
+typedef struct jsmv {
+  u8 *code;     // executable buffer
+  u64 size;     // mapped size of code
+  u64 len;      // number of guest instructions
+  u8 **labels;  // native address of each instruction, [len] is the end
+} jsmv;
+
+// the tracing side, for engine_tracing. backward branches taken on the
+// loop engine count towards the loop header they land on. once a header is
+// hot, one iteration of the loop is recorded from the current registers and
+// compiled as a straight line of ra..rd r64/imm templates, with a guard on
+// every conditional branch. a failing guard leaves the trace and the loop
+// engine carries on from there. loops with anything else in them stay cold,
+// and so does everything while vm->fuel is limited
+#define jsmv_hot_threshold (64)
+#define jsmv_trace_max (256)  // instructions
+
+typedef struct jsmv_tracer {
+  u32 *hotness;  // per instruction, backward branches taken into it
+  u8 **traces;   // per instruction, the trace starting there or NULL
+  u64 *sizes;    // mapped size of each trace
+  u64 len;
+} jsmv_tracer;
+
+bool jsmv_compile(smvm *vm);
+void jsmv_free(smvm *vm);
+void jsmv_backward_branch(smvm *vm, u64 target);
+void jsmv_free_traces(smvm *vm);
+
+#endif
@@ -0,0 +1,432 @@
+#define _GNU_SOURCE  // MAP_ANONYMOUS, MAP_NORESERVE, memfd_create
+
+#include "msmv.h"
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define msmv_mmap (1)
+#else
+#define msmv_mmap (0)
+#endif
+
+#if defined(__linux__)
+#define msmv_memfd (1)
+#else
+#define msmv_memfd (0)
+#endif
+
+// the widest access is a 16 byte frame, one page of guard is plenty
+u64 msmv_page(void) {
+#if msmv_mmap
+  static u64 page = 0;  // smvm's fault handler asks, keep sysconf out of it
+  if (page == 0) page = sysconf(_SC_PAGESIZE);
+  return page;
+#else
+  return 4096;
+#endif
+}
+
+#if msmv_mmap
+// maps len bytes of the guest's part from addr on, over whatever is there
+static bool msmv_back(msmv *memory, u64 addr, u64 len) {
+  // lazy ranges start out all guard, msmv_commit opens them page by page
+  int prot = memory->flags & msmv_lazy ? PROT_NONE : PROT_READ | PROT_WRITE;
+  void *at = memory->base + addr, *mapped;
+  if (memory->flags & msmv_cow)
+    mapped = mmap(at, len, prot, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE,
+                  memory->fd, memory->offset + addr);
+  else if (memory->flags & msmv_file)
+    mapped = mmap(at, len, prot, MAP_SHARED | MAP_FIXED, memory->fd, addr);
+  else
+    mapped = mmap(at, len, prot,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+                  0);
+  return mapped != MAP_FAILED;
+}
+#endif
+
+// the bits for a lazy range's pages, all clear
+static void msmv_track(msmv *memory) {
+  u64 words = (memory->size / msmv_page() + 63) / 64;
+  if (memory->open == NULL) memory->open = calloc(words, sizeof(u64));
+  else memset(memory->open, 0, words * sizeof(u64));
+  if (memory->open == NULL) {
+    fprintf(stderr, "Tracking lazy guest memory failed.\n");
+    exit(1);
+  }
+  memory->runs = 0;
+  memory->committed = 0;
+}
+
+// maps memory->reserved bytes, the ones past memory->size are the guard.
+// with msmv_file the guest's part is a new memfd, shared, with msmv_cow it's
+// memory->fd from memory->offset on, copy on write
+static bool msmv_map(msmv *memory) {
+#if msmv_mmap
+  // reserve everything, the kernel backs pages as they're first touched
+  void *base = mmap(NULL, memory->reserved, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    *memory = (msmv){0};
+    return false;
+  }
+
+#if msmv_memfd
+  if (memory->flags & msmv_file) {
+    memory->fd = memfd_create("smvm", MFD_CLOEXEC);
+    if (memory->fd >= 0 && ftruncate(memory->fd, memory->size) != 0) {
+      close(memory->fd);
+      memory->fd = -1;
+    }
+    if (memory->fd < 0) memory->flags &= ~msmv_file;
+  }
+#else
+  memory->flags &= ~msmv_file;
+#endif
+
+  memory->base = base;
+  if (!msmv_back(memory, 0, memory->size)) {
+    munmap(base, memory->reserved);
+    if (memory->flags & (msmv_file | msmv_cow)) close(memory->fd);
+    *memory = (msmv){0};
+    return false;
+  }
+#ifdef MADV_HUGEPAGE
+  if (memory->flags & msmv_huge_pages)
+    madvise(base, memory->size, MADV_HUGEPAGE);
+#endif
+  if (memory->flags & msmv_lazy) msmv_track(memory);
+#else
+  // no reservation, no guard, no file and nothing lazy, without mmap
+  memory->flags &= ~(msmv_lazy | msmv_file);
+  memory->base = calloc(memory->reserved, 1);
+  if (memory->base == NULL) {
+    *memory = (msmv){0};
+    return false;
+  }
+#endif
+  return true;
+}
+
+static u64 msmv_round(u64 size) {
+  u64 rounded = msmv_page();
+  while (rounded < size) rounded <<= 1;
+  return rounded;
+}
+
+bool msmv_init(msmv *memory, u64 size, u8 flags) {
+  u64 rounded = msmv_round(size);
+  *memory = (msmv){
+      .mask = rounded - 1,
+      .size = rounded,
+      .reserved = rounded + msmv_page(),
+      .flags = flags,
+  };
+  return msmv_map(memory);
+}
+
+bool msmv_stack_init(msmv *stack, u64 size, u8 flags) {
+  u64 rounded = msmv_round(size);
+  *stack = (msmv){
+      .mask = rounded * 2 - 1,
+      .size = rounded,
+      .reserved = rounded * 2 + msmv_page(),
+      .flags = flags,
+  };
+  return msmv_map(stack);
+}
+
+void msmv_make_lazy(msmv *memory) {
+  if (memory->flags & msmv_lazy) return;
+#if msmv_mmap
+  mprotect(memory->base, memory->size, PROT_NONE);
+  memory->flags |= msmv_lazy;
+  msmv_track(memory);
+#endif
+}
+
+#define msmv_is_open(_memory, _p) ((_memory)->open[(_p) / 64] >> ((_p) % 64) & 1)
+
+// the committed page nearest to p, p included, walking up or down. -1 when
+// there's none
+static u64 msmv_nearest(msmv *memory, u64 p, bool up) {
+  u64 pages = memory->size / msmv_page();
+  while (p < pages) {  // going under 0 wraps past it
+    if (memory->open[p / 64] == 0) p = up ? (p | 63) + 1 : (p & ~63ull) - 1;
+    else if (msmv_is_open(memory, p)) return p;
+    else p += up ? 1 : -1;
+  }
+  return (u64)-1;
+}
+
+u64 msmv_commit(msmv *memory, u8 *addr, u64 room) {
+#if msmv_mmap
+  u64 page = msmv_page(), pages = memory->size / page;
+  u64 first = (addr - memory->base) / page, last = first;
+  if (msmv_is_open(memory, first)) return 0;  // it faulted for something else
+  bool left = first > 0 && msmv_is_open(memory, first - 1);
+  bool right = last + 1 < pages && msmv_is_open(memory, last + 1);
+  if (!left && !right && memory->runs >= msmv_max_runs) {
+    u64 below = first > 0 ? msmv_nearest(memory, first - 1, false) : (u64)-1;
+    u64 above = msmv_nearest(memory, first + 1, true);
+    if (below != (u64)-1 && (above == (u64)-1 || first - below <= above - first))
+      first = below + 1, left = true;
+    else if (above != (u64)-1)
+      last = above - 1, right = true;
+  }
+
+  u64 len = (last - first + 1) * page;
+  if (len > room ||
+      mprotect(memory->base + first * page, len, PROT_READ | PROT_WRITE) != 0)
+    return 0;
+  for (u64 p = first; p <= last; p++) memory->open[p / 64] |= 1ull << (p % 64);
+  memory->runs = memory->runs + 1 - left - right;
+  memory->committed += len;
+  return len;
+#else
+  return 0;
+#endif
+}
+
+#if msmv_memfd
+// len bytes of in from at to out at to, in the kernel when it can
+static bool msmv_copy(int in, off_t at, int out, off_t to, u64 len) {
+  while (len > 0) {
+    loff_t from = at, into = to;
+    ssize_t copied = copy_file_range(in, &from, out, &into, len, 0);
+    if (copied <= 0) {
+      // other file systems, or a kernel without it
+      u8 buffer[1 << 16];
+      copied = pread(in, buffer, len < sizeof(buffer) ? len : sizeof(buffer),
+                     at);
+      if (copied <= 0 || pwrite(out, buffer, copied, to) != copied)
+        return false;
+    }
+    at += copied;
+    to += copied;
+    len -= copied;
+  }
+  return true;
+}
+
+// the pages of a cow range the guest wrote, they're anonymous now, present
+// or swapped out. pagemap has one entry per page
+static bool msmv_copy_written(msmv *memory, int fd, u64 offset) {
+  int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (pagemap < 0) return false;
+
+  u64 page = msmv_page(), pages = memory->size / page, entries[512];
+  off_t first = (u64)memory->base / page * sizeof(u64);
+  for (u64 i = 0; i < pages; i += 512) {
+    u64 n = pages - i < 512 ? pages - i : 512;
+    if (pread(pagemap, entries, n * sizeof(u64), first + i * sizeof(u64)) !=
+        (ssize_t)(n * sizeof(u64))) {
+      close(pagemap);
+      return false;
+    }
+    for (u64 j = 0; j < n; j++) {
+      bool present = entries[j] >> 63 & 1, swapped = entries[j] >> 62 & 1;
+      bool file = entries[j] >> 61 & 1;
+      if (!swapped && !(present && !file)) continue;
+
+      u8 *at = memory->base + (i + j) * page;
+      // a lazy range may have made a written page PROT_NONE again
+      if (memory->flags & msmv_lazy) mprotect(at, page, PROT_READ);
+      bool ok = pwrite(fd, at, page, offset + (i + j) * page) == (ssize_t)page;
+      if (memory->flags & msmv_lazy) mprotect(at, page, PROT_NONE);
+      if (!ok) {
+        close(pagemap);
+        return false;
+      }
+    }
+  }
+  close(pagemap);
+  return true;
+}
+#endif
+
+bool msmv_write(msmv *memory, int fd, u64 offset) {
+#if msmv_memfd
+  if (!(memory->flags & (msmv_file | msmv_cow))) return false;
+
+  // the extents of the file behind it, the holes stay holes. file to file,
+  // lazy pages the guest can't see yet are copied as well
+  off_t start = memory->flags & msmv_cow ? memory->offset : 0;
+  off_t end = start + memory->size;
+  for (off_t at = start; at < end;) {
+    at = lseek(memory->fd, at, SEEK_DATA);
+    if (at < 0 || at >= end) break;
+    off_t hole = lseek(memory->fd, at, SEEK_HOLE);
+    if (hole < 0 || hole > end) hole = end;
+    if (!msmv_copy(memory->fd, at, fd, offset + (at - start), hole - at))
+      return false;
+    at = hole;
+  }
+
+  // and for a copy, what the guest changed on top of it
+  if (memory->flags & msmv_cow) return msmv_copy_written(memory, fd, offset);
+  return true;
+#else
+  return false;
+#endif
+}
+
+int msmv_freeze(msmv *memory) {
+#if msmv_memfd
+  int fd = memfd_create("smvm-snapshot", MFD_CLOEXEC);
+  if (fd < 0) return -1;
+  if (ftruncate(fd, memory->size) != 0 || !msmv_write(memory, fd, 0)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+bool msmv_fork(msmv *memory, msmv *from, int fd, u64 offset) {
+  *memory = (msmv){
+      .mask = from->mask,
+      .size = from->size,
+      .reserved = from->reserved,
+      .fd = dup(fd),
+      .offset = offset,
+      .flags = (from->flags & ~msmv_file) | msmv_cow,
+  };
+  if (memory->fd < 0) {
+    *memory = (msmv){0};
+    return false;
+  }
+  return msmv_map(memory);
+}
+
+#if msmv_mmap
+// the runs of open pages in first..last, ones going past either end included
+static u64 msmv_runs_in(msmv *memory, u64 first, u64 last) {
+  u64 runs = 0;
+  for (u64 p = first; p <= last; p++)
+    if (msmv_is_open(memory, p) && (p == first || !msmv_is_open(memory, p - 1)))
+      runs++;
+  return runs;
+}
+
+// what a lazy range had open in len bytes at addr is gone, the quota stops
+// counting it. a msmv_file range's memfd still holds it, it's opened again
+static void msmv_release(msmv *memory, u64 addr, u64 len) {
+  if (!(memory->flags & msmv_lazy)) return;
+  u64 page = msmv_page(), pages = memory->size / page;
+  u64 first = addr / page, last = (addr + len) / page - 1;
+  if (memory->flags & msmv_file) {
+    for (u64 p = first; p <= last; p++)
+      if (msmv_is_open(memory, p))
+        mprotect(memory->base + p * page, page, PROT_READ | PROT_WRITE);
+    return;
+  }
+  // a page either side, the runs there may split or join
+  u64 from = first > 0 ? first - 1 : first, to = last + 1 < pages ? last + 1 : last;
+  u64 before = msmv_runs_in(memory, from, to);
+  for (u64 p = first; p <= last; p++) {
+    if (!msmv_is_open(memory, p)) continue;
+    memory->open[p / 64] &= ~(1ull << (p % 64));
+    memory->committed -= page;
+  }
+  memory->runs = memory->runs - before + msmv_runs_in(memory, from, to);
+}
+#endif
+
+bool msmv_alias(msmv *memory, u64 addr, void *host, u64 len, u8 prot) {
+#if msmv_memfd
+  u64 page = msmv_page();
+  if (len == 0 || addr % page || (u64)host % page || len % page ||
+      addr > memory->size || len > memory->size - addr)
+    return false;
+  // a second mapping of the same pages, only shared ones can have that
+  void *at = mremap(host, 0, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+                    memory->base + addr);
+  if (at == MAP_FAILED) return false;
+  msmv_protect(memory, addr, len, prot);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void msmv_unalias(msmv *memory, u64 addr, u64 len) {
+#if msmv_mmap
+  msmv_back(memory, addr, len);
+  msmv_release(memory, addr, len);
+#endif
+}
+
+void msmv_store(msmv *memory, u64 addr, const void *bytes, u64 len) {
+  while (len > 0) {
+    u64 at = addr & memory->mask;
+    u64 n = memory->size - at < len ? memory->size - at : len;
+    if (bytes == NULL) memset(memory->base + at, 0, n);
+    else {
+      memcpy(memory->base + at, bytes, n);
+      bytes = (const u8 *)bytes + n;
+    }
+    addr += n;
+    len -= n;
+  }
+}
+
+void msmv_discard(msmv *memory, u64 addr, u64 len) {
+#if msmv_mmap
+  u64 page = msmv_page();
+  u64 start = (addr + page - 1) & ~(page - 1), end = (addr + len) & ~(page - 1);
+  if (start >= end || end > memory->size) return;
+#if msmv_memfd
+  // a shared mapping only lets go once the file does
+  if (memory->flags & msmv_file) {
+    fallocate(memory->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+              end - start);
+    return;
+  }
+#endif
+  madvise(memory->base + start, end - start, MADV_DONTNEED);
+#endif
+}
+
+void msmv_clear(msmv *memory) {
+#if msmv_mmap
+  msmv_discard(memory, 0, memory->size);
+  if (memory->flags & msmv_lazy) {
+    mprotect(memory->base, memory->size, PROT_NONE);
+    msmv_track(memory);
+  }
+#else
+  memset(memory->base, 0, memory->size);
+#endif
+}
+
+void msmv_protect(msmv *memory, u64 addr, u64 len, u8 prot) {
+#if msmv_mmap
+  mprotect(memory->base + addr, len,
+           (prot & msmv_readable ? PROT_READ : 0) |
+               (prot & msmv_writable ? PROT_WRITE : 0));
+#endif
+}
+
+bool msmv_shared_init(msmv *memory, u64 size) {
+  if (!msmv_init(memory, size, msmv_file)) return false;
+  if (memory->flags & msmv_file) return true;
+  msmv_free(memory);  // private, nothing could alias it
+  return false;
+}
+
+void msmv_free(msmv *memory) {
+  free(memory->open);
+  if (memory->base == NULL) return;
+#if msmv_mmap
+  munmap(memory->base, memory->reserved);
+  if (memory->flags & (msmv_file | msmv_cow)) close(memory->fd);
+#else
+  free(memory->base);
+#endif
+  *memory = (msmv){0};
+}
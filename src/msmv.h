@@ -0,0 +1,118 @@
+#ifndef smv_smvm_msmv_h
+#define smv_smvm_msmv_h
+
+#include "util.h"
+
+// msmv - guest memory
+// one reserved range of virtual memory, a power of two in size. the host
+// only backs a page once the guest touches it, so sparse use of high
+// addresses costs nothing and the range never moves, pointers into it stay
+// good for the whole run. an address is masked to the size and added to
+// base, there's no size check and no growing. only the start of an access
+// is masked, so a guard page follows the range: an access of up to 8 bytes
+// (the widest the vm does) starting in range and running off the end faults
+// there instead of reaching other memory, and smvm traps it (trap_bounds).
+
+#define msmv_default_size (1ull << 32)
+#define msmv_stack_default_size (1ull << 20)
+
+typedef enum msmv_flag : u8 {
+  msmv_huge_pages = 1,  // ask for transparent huge pages
+  msmv_lazy = 1 << 1,   // pages fault until committed, see msmv_commit
+  msmv_file = 1 << 2,   // backed by fd, a memfd, so msmv_freeze can copy it
+  msmv_cow = 1 << 3,    // a private copy of fd from offset on, see msmv_fork
+} msmv_flag;
+
+typedef enum msmv_prot : u8 {
+  msmv_readable = 1,
+  msmv_writable = 1 << 1,
+} msmv_prot;
+
+typedef struct msmv {
+  u8 *base;
+  u64 mask;       // size - 1
+  u64 size;       // guest visible, guards not included
+  u64 reserved;   // mapped, guards included
+  u64 committed;  // bytes msmv_commit opened up, when msmv_lazy
+  u64 *open;      // a bit per page, set once it's committed, when msmv_lazy
+  u64 runs;       // of committed pages next to each other
+  int fd;         // with msmv_file or msmv_cow, owned
+  u64 offset;     // where a cow range starts in fd
+  u8 flags;       // enum msmv_flag
+} msmv;
+
+// size is rounded up to a power of two and at least a page
+bool msmv_init(msmv *memory, u64 size, u8 flags);
+void msmv_free(msmv *memory);
+u64 msmv_page(void);
+
+// lazy ranges account for what the guest uses a page at a time. every page
+// starts out PROT_NONE, the first touch faults and whoever catches the fault
+// (smvm's handler, see smvm_set_quota) commits the page and lets the access
+// run again. the range keeps its contents when it's made lazy, but pages
+// touched before only count once they're touched again. host code touching
+// a lazy range outside smvm_execute has to commit the pages itself
+void msmv_make_lazy(msmv *memory);
+// opens the page holding addr, returns the bytes committed. every run of
+// committed pages is a mapping of its own in the kernel, which only allows
+// so many per process. past msmv_max_runs a page on its own doesn't start
+// another, the pages between it and the nearest run are opened with it. 0
+// when that's more than room bytes or the kernel refuses
+u64 msmv_commit(msmv *memory, u8 *addr, u64 room);
+#define msmv_max_runs (1024)
+
+// copies of a range for snapshots and checkpoints. msmv_write puts what the
+// guest wrote so far into fd at offset, leaving holes where it wrote nothing,
+// and fails without msmv_file or msmv_cow. msmv_freeze does that into a new
+// memfd, or returns -1. msmv_fork maps a file like that copy on write into a
+// fresh range shaped like from, pages are shared until the guest writes them,
+// so forking costs the same however big the range is. forks dup fd, the
+// caller keeps its own
+bool msmv_write(msmv *memory, int fd, u64 offset);
+int msmv_freeze(msmv *memory);
+bool msmv_fork(msmv *memory, msmv *from, int fd, u64 offset);
+
+// msmv_alias puts len bytes of host memory at addr, the very same pages so
+// neither side copies anything and accesses there are like any other. addr,
+// host and len are page aligned and host is a shared mapping (MAP_SHARED,
+// shm, a memfd or a file), the kernel can't map private pages twice.
+// msmv_unalias puts the range's own pages back. a msmv_file range's memfd
+// kept what they held before, otherwise they're fresh, zero, or the file's
+// for a cow range, and uncommitted again when lazy. snapshots and
+// checkpoints only see those, never the host's
+bool msmv_alias(msmv *memory, u64 addr, void *host, u64 len, u8 prot);
+void msmv_unalias(msmv *memory, u64 addr, u64 len);
+// a range msmv_alias can put into any number of others, a memfd mapped
+// shared. false without memfd
+bool msmv_shared_init(msmv *memory, u64 size);
+
+#define msmv_at(_memory, _addr) ((_memory)->base + ((_addr) & (_memory)->mask))
+// hands the host pages wholly inside len bytes at addr back, the memory
+// they held is gone and they read as zero again (a cow range's file shows
+// through instead)
+void msmv_discard(msmv *memory, u64 addr, u64 len);
+// every page discarded, and uncommitted again when lazy. what msmv_alias
+// put in keeps the host's pages but not its protection, see msmv_protect
+void msmv_clear(msmv *memory);
+// len bytes at addr readable and writable as prot (enum msmv_prot) says,
+// page aligned
+void msmv_protect(msmv *memory, u64 addr, u64 len, u8 prot);
+// len bytes of bytes at addr, zeros when bytes is NULL. wraps around like
+// msmv_at, lazy pages fault like any access would
+void msmv_store(msmv *memory, u64 addr, const void *bytes, u64 len);
+
+// the guest stack is an msmv as well, size bytes followed by as many again
+// of guard and one more page. sp is masked to twice the size, so whatever
+// the guest puts in sp a push or pop either lands on the stack or faults,
+// running off the top included
+bool msmv_stack_init(msmv *stack, u64 size, u8 flags);
+
+#define msmv_stack_at(_stack, _sp) ((_stack)->base + ((_sp) & (_stack)->mask))
+#define msmv_guards(_memory, _addr)                \
+  ((u8 *)(_addr) >= (_memory)->base + (_memory)->size && \
+   (u8 *)(_addr) < (_memory)->base + (_memory)->reserved)
+#define msmv_holds(_memory, _addr)               \
+  ((u8 *)(_addr) >= (_memory)->base &&           \
+   (u8 *)(_addr) < (_memory)->base + (_memory)->size)
+
+#endif
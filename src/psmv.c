@@ -0,0 +1,326 @@
+#define _DEFAULT_SOURCE  // MAP_PRIVATE, ftruncate
+
+#include "psmv.h"
+
+#include <stdio.h>
+
+#include "asmv.h"
+#include "msmv.h"
+#include "vsmv.h"
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define psmv_supported (1)
+#else
+#define psmv_supported (0)
+#endif
+
+#define psmv_magic "smvmckpt"
+#define psmv_version (4)
+
+typedef struct psmv_section {
+  u64 offset;
+  u64 len;  // in bytes
+} psmv_section;
+
+// the start of the file, in host byte order
+typedef struct psmv_file {
+  char magic[8];
+  u32 version;
+  u32 page;       // memory and stack start on a page of this size
+  u32 inst_size;  // sizeof(asmv_inst) of the build that wrote it
+  smvm_header header;
+  i64 registers[smvm_register_num];
+  u64 fuel;
+  u64 quota;
+  u64 peak;
+  u8 flags;
+  smvm_engine engine;
+  u8 fusions;
+  msmv memory;  // shapes, offset is where each starts in the file
+  msmv stack;
+  hsmv heap;  // its pages are a section
+  psmv_section instructions;  // packed and verified again on restore
+  psmv_section bytecode;
+  psmv_section stringpool;
+  psmv_section globals;
+  psmv_section heap_pages;
+  psmv_section syscalls;  // NUL terminated names, in index order
+} psmv_file;
+
+static void psmv_put(listmv(u8) *out, psmv_section *section, void *data,
+                     u64 len) {
+  *section = (psmv_section){out->len, len};
+  listmv_push_array(out, data, len);
+}
+
+// the shape of a range, without what only means something in this process
+static msmv psmv_shape(msmv *memory, u64 offset) {
+  return (msmv){
+      .mask = memory->mask,
+      .size = memory->size,
+      .reserved = memory->reserved,
+      .offset = offset,
+      .flags = memory->flags & ~(msmv_file | msmv_cow),
+  };
+}
+
+bool psmv_save(smvm *vm, const char *path) {
+#if psmv_supported
+  if (!(vm->memory.flags & (msmv_file | msmv_cow)) ||
+      !(vm->stack.flags & (msmv_file | msmv_cow)))
+    return false;
+
+  psmv_file file = {
+      .version = psmv_version,
+      .page = msmv_page(),
+      .inst_size = sizeof(asmv_inst),
+      .header = vm->header,
+      .fuel = vm->fuel,
+      .quota = vm->quota,
+      .peak = vm->peak,
+      .flags = vm->flags,
+      .engine = vm->engine,
+      .fusions = vm->fusions,
+  };
+  memcpy(file.magic, psmv_magic, sizeof(file.magic));
+  memcpy(file.registers, vm->registers, sizeof(file.registers));
+  // a native saving mid-run is at its scall, smvm_resume carries on after it
+  if (vm->escape) file.registers[reg_ip]++;
+
+  listmv(u8) out;
+  listmv_init(&out, sizeof(u8));
+  listmv_push_array(&out, &file, sizeof(file));  // written again below
+
+  psmv_put(&out, &file.instructions, vm->instructions.data,
+           vm->instructions.len * sizeof(asmv_inst));
+  psmv_put(&out, &file.bytecode, vm->bytecode.data, vm->bytecode.len);
+  psmv_put(&out, &file.stringpool, vm->stringpool.data, vm->stringpool.len);
+  psmv_put(&out, &file.globals, vm->globals.data, vm->globals.len);
+  file.heap = vm->heap;
+  file.heap.pages = (listmv){0};
+  psmv_put(&out, &file.heap_pages, vm->heap.pages.data,
+           vm->heap.base ? vm->heap.pages.len * sizeof(hsmv_page) : 0);
+  file.syscalls = (psmv_section){out.len, 0};
+  for (u64 i = 0; i < vm->syscalls.len; i++) {
+    char *name = ((smvm_syscall *)listmv_at(&vm->syscalls, i))->name;
+    listmv_push_array(&out, name, strlen(name) + 1);
+  }
+  file.syscalls.len = out.len - file.syscalls.offset;
+
+  u64 page = msmv_page();
+  u64 at = (out.len + page - 1) / page * page;
+  file.memory = psmv_shape(&vm->memory, at);
+  file.stack = psmv_shape(&vm->stack, at + vm->memory.size);
+  u64 total = file.stack.offset + vm->stack.size;
+  memcpy(out.data, &file, sizeof(file));
+
+  // written next to path and renamed over it, a vm restored from path still
+  // has the old file mapped and a crash halfway leaves the old checkpoint
+  char *temp = malloc(strlen(path) + 5);
+  strcat(strcpy(temp, path), ".new");
+  int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool ok = fd >= 0;
+  for (u64 done = 0; ok && done < out.len;) {
+    ssize_t written = write(fd, (u8 *)out.data + done, out.len - done);
+    ok = written > 0;
+    done += ok ? written : 0;
+  }
+  // sized first, so whatever the guest never wrote stays a hole
+  ok = ok && ftruncate(fd, total) == 0 &&
+       msmv_write(&vm->memory, fd, file.memory.offset) &&
+       msmv_write(&vm->stack, fd, file.stack.offset);
+  if (fd >= 0) close(fd);
+  ok = ok && rename(temp, path) == 0;
+  if (!ok) remove(temp);
+  free(temp);
+  listmv_free(&out);
+  return ok;
+#else
+  return false;
+#endif
+}
+
+#if psmv_supported
+static bool psmv_fits(psmv_section *section, u64 size) {
+  return section->offset <= size && section->len <= size - section->offset;
+}
+
+static bool psmv_index(u32 index, u64 top) {
+  return index == hsmv_none || index < top;
+}
+
+// every index hsmv follows stays inside the pages it has, len bytes of them
+static bool psmv_valid_heap(hsmv *heap, msmv *memory, u8 *pages, u64 len) {
+  if (heap->base == 0) return heap->top == 0 && len == 0;
+  if (heap->base % hsmv_page_size || heap->size < hsmv_page_size ||
+      heap->size > memory->size || heap->base > memory->size - heap->size ||
+      heap->top > heap->size / hsmv_page_size ||
+      len != heap->top * sizeof(hsmv_page) ||
+      !psmv_index(heap->spans, heap->top))
+    return false;
+  for (int c = 0; c < hsmv_class_num; c++)
+    if (!psmv_index(heap->partial[c], heap->top)) return false;
+  for (u64 p = 0; p < heap->top; p++) {
+    hsmv_page page;
+    memcpy(&page, pages + p * sizeof(page), sizeof(page));  // not aligned
+    if (page.kind > page_tail || page.size_class >= hsmv_class_num ||
+        page.pages > heap->top || !psmv_index(page.prev, heap->top) ||
+        !psmv_index(page.next, heap->top))
+      return false;
+  }
+  return true;
+}
+
+// a known code, registers that exist, a branch target in the program or
+// right past it and strings inside the pool, NUL terminated
+static bool psmv_valid_inst(asmv_inst *inst, u64 len, u8 *pool,
+                            u64 pool_len) {
+  if (inst->code >= instruction_table_len) return false;
+  switch (inst->code) {
+    case op_call:
+    case op_jmp:
+    case op_je:
+    case op_jne:
+    case op_jl:
+      if (inst->label_index > len) return false;
+      break;
+    default: break;
+  }
+  for (int j = 0; j < instruction_table[inst->code].num_ops; j++) {
+    asmv_operand *op = &inst->operands[j];
+    if (op->data.type == asmv_str_type) {
+      asmv_string str = op->data.str;
+      if (str.len == 0 || str.offset > pool_len ||
+          str.len > pool_len - str.offset ||
+          pool[str.offset + str.len - 1] != '\0')
+        return false;
+    } else if ((op->mode == mode_register || op->mode == mode_indirect) &&
+               op->data.reg >= smvm_register_num) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool psmv_valid(psmv_file *file, u64 size) {
+  if (memcmp(file->magic, psmv_magic, sizeof(file->magic)) ||
+      file->version != psmv_version || file->page != msmv_page() ||
+      file->inst_size != sizeof(asmv_inst))
+    return false;
+
+  psmv_section *sections[] = {
+      &file->instructions, &file->bytecode,   &file->stringpool,
+      &file->globals,      &file->heap_pages, &file->syscalls,
+  };
+  for (u64 i = 0; i < sizeof(sections) / sizeof(sections[0]); i++)
+    if (!psmv_fits(sections[i], size)) return false;
+
+  if (file->instructions.len % sizeof(asmv_inst)) return false;
+
+  msmv *ranges[] = {&file->memory, &file->stack};
+  for (int i = 0; i < 2; i++)
+    if (ranges[i]->size < file->page ||
+        ranges[i]->size & (ranges[i]->size - 1) ||
+        ranges[i]->reserved <= ranges[i]->size ||
+        ranges[i]->offset % file->page ||
+        !psmv_fits(&(psmv_section){ranges[i]->offset, ranges[i]->size}, size))
+      return false;
+
+  // smvm_pack, tsmv_decode and the handlers index with these before
+  // vsmv_verify gets to look, unverified programs run all the same
+  u8 *map = (u8 *)file;
+  u64 len = file->instructions.len / sizeof(asmv_inst);
+  for (u64 i = 0; i < len; i++) {
+    asmv_inst inst;
+    memcpy(&inst, map + file->instructions.offset + i * sizeof(inst),
+           sizeof(inst));
+    if (!psmv_valid_inst(&inst, len, map + file->stringpool.offset,
+                         file->stringpool.len))
+      return false;
+  }
+  return psmv_valid_heap(&file->heap, &file->memory,
+                         map + file->heap_pages.offset, file->heap_pages.len);
+}
+
+static void psmv_list(listmv *list, long size, u8 *map, psmv_section *section) {
+  listmv_init(list, size);
+  listmv_push_array(list, map + section->offset, section->len / size);
+}
+#endif
+
+bool psmv_restore(smvm *vm, const char *path) {
+#if psmv_supported
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(psmv_file)) {
+    close(fd);
+    return false;
+  }
+  u8 *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  psmv_file *file = (psmv_file *)map;
+  msmv memory, stack;
+  if (!psmv_valid(file, st.st_size) ||
+      !msmv_fork(&memory, &file->memory, fd, file->memory.offset)) {
+    munmap(map, st.st_size);
+    close(fd);
+    return false;
+  }
+  if (!msmv_fork(&stack, &file->stack, fd, file->stack.offset)) {
+    msmv_free(&memory);
+    munmap(map, st.st_size);
+    close(fd);
+    return false;
+  }
+  close(fd);  // the forks have their own
+
+  // nothing fails from here on, the old state goes once the new one is in
+  smvm_relink_syscalls(vm, map + file->syscalls.offset,
+                       map + file->syscalls.offset + file->syscalls.len);
+  smvm old = *vm;
+  old.syscalls = (listmv){0};  // moved
+
+  psmv_list(&vm->instructions, sizeof(asmv_inst), map, &file->instructions);
+  psmv_list(&vm->bytecode, sizeof(u8), map, &file->bytecode);
+  psmv_list(&vm->stringpool, sizeof(u8), map, &file->stringpool);
+  psmv_list(&vm->globals, sizeof(u8), map, &file->globals);  // already in memory
+  vm->heap = file->heap;
+  if (vm->heap.base)
+    psmv_list(&vm->heap.pages, sizeof(hsmv_page), map, &file->heap_pages);
+  vm->packed = (smvm_packed){0};  // old's, freed with it
+  smvm_pack(vm);
+  vm->memory = memory;
+  vm->stack = stack;
+  listmv_init(&vm->regions, sizeof(smvm_region));
+  vm->program = (listmv){0};
+  vm->jit = NULL;
+  vm->tracer = NULL;
+  vm->cache = (struct cache){0};
+  vm->stats = (struct stats){0};
+
+  vm->header = file->header;
+  memcpy(vm->registers, file->registers, sizeof(vm->registers));
+  vm->fuel = file->fuel;
+  vm->quota = file->quota;
+  vm->peak = file->peak;
+  vm->flags = file->flags;
+  vm->engine = file->engine;
+  vm->fusions = file->fusions;
+  vsmv_verify(vm);  // not whatever the file claims
+
+  munmap(map, st.st_size);
+  smvm_free(&old);
+  return true;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,29 @@
+#ifndef smv_smvm_psmv_h
+#define smv_smvm_psmv_h
+
+#include "smvm.h"
+#include "util.h"
+
+// psmv - checkpoints
+// writes a vm's whole state to a file: the decoded program, its data
+// section, smvm_header, registers, flags, memory, stack, heap and syscall
+// names. the file is laid out the way restoring wants it, a fixed header in
+// host byte order, the program's arrays as they are in memory, then memory
+// and stack each on a page boundary with holes where the guest never wrote.
+// restoring maps the file, copies the arrays and maps memory and stack copy
+// on write straight from it, nothing gets parsed and guest memory is only
+// read from disk as the guest touches it. syscalls are rebound by name like
+// smvm_load_image does, host memory from smvm_map_region is left out.
+// checkpoints are for this host, they're rejected by another build or on a
+// different page size. smvm_resume picks up where the vm was saved: past
+// the native that saved it mid-run, or at the instruction a finished run
+// stopped at. smvm_execute still starts over at instruction 0.
+
+// false if vm's memory or stack has no file behind it (see msmv_write) or
+// the file can't be written
+bool psmv_save(smvm *vm, const char *path);
+// vm is initialized, with natives linked. false and vm untouched when the
+// file isn't a checkpoint this build can restore
+bool psmv_restore(smvm *vm, const char *path);
+
+#endif
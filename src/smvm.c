@@ -1,11 +1,25 @@
+#define _DEFAULT_SOURCE  // sigaction, SA_NODEFER
+
 #include "smvm.h"
 
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__unix__)
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#define smvm_guard_traps (1)
+#else
+#define smvm_guard_traps (0)
+#endif
+
 #include "asmv.h"
 #include "dsmv.h"
+#include "jsmv.h"
+#include "tsmv.h"
 #include "util.h"
+#include "vsmv.h"
 
 instruction_info instruction_table[instruction_table_len] = {
     [op_halt] = {"halt", 4, 0, trap_fn},
@@ -43,23 +57,282 @@ instruction_info instruction_table[instruction_table_len] = {
     [op_jl] = {"jl", 2, 3, jl_fn},
     [op_loop] = {"loop", 4, 2, loop_fn},
     [op_call] = {"call", 4, 1, call_fn},
-    [op_ret] = {"ret", 3, 0, ret_fn},
+    [op_ret] = {"ret", 3, 0, ret_fn, ret_unchecked_fn},
     [op_push] = {"push", 4, 1, push_fn},
-    [op_pop] = {"pop", 3, 1, pop_fn},
+    [op_pop] = {"pop", 3, 1, pop_fn, pop_unchecked_fn},
     [op_extern] = {"extern", 6, 1, extern_fn},
     [op_scall] = {"scall", 5, 1, scall_fn},
     [op_getu] = {"getu", 4, 1, getu_fn},
     [op_puti] = {"puti", 4, 1, puti_fn},
     [op_putu] = {"putu", 4, 1, putu_fn},
     [op_putf] = {"putf", 4, 1, putf_fn},
-    [op_puts] = {"puts", 4, 1, puts_fn}};
+    [op_puts] = {"puts", 4, 1, puts_fn},
+    [op_aload] = {"aload", 5, 2, aload_fn},
+    [op_astore] = {"astore", 6, 2, astore_fn},
+    [op_cas] = {"cas", 3, 3, cas_fn},
+    [op_xadd] = {"xadd", 4, 2, xadd_fn},
+    [op_fence] = {"fence", 5, 0, fence_fn},
+    [op_alloc] = {"alloc", 5, 2, alloc_fn},
+    [op_free] = {"free", 4, 1, free_fn},
+    [op_realloc] = {"realloc", 7, 2, realloc_fn}};
+
+#if smvm_guard_traps
+// the vm whose smvm_execute is innermost on this thread
+static __thread smvm *smvm_running;
+// what SIGSEGV and SIGBUS did before smvm_catch_faults
+static struct sigaction smvm_previous_segv, smvm_previous_bus;
+
+// a fault that isn't the guest's goes where it would have gone without smvm
+static void smvm_forward(int sig, siginfo_t *info, void *context) {
+  struct sigaction *previous =
+      sig == SIGBUS ? &smvm_previous_bus : &smvm_previous_segv;
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(sig, info, context);
+  } else if (previous->sa_handler == SIG_DFL ||
+             previous->sa_handler == SIG_IGN) {
+    // the access faults again with that in place, the kernel doesn't let a
+    // fault be ignored, it kills the process like SIG_DFL would
+    sigaction(sig, previous, NULL);
+  } else {
+    previous->sa_handler(sig);
+  }
+}
+
+// a push or pop off either end of the stack lands in its guard, which ends
+// the run like any other trap. a frame is the widest access, sp went under 0
+// when the fault is no further than that below where the mask wraps
+static void smvm_fault(int sig, siginfo_t *info, void *context) {
+  smvm *vm = smvm_running;
+  u8 *addr = info->si_addr;
+  if (vm == NULL || vm->escape == NULL) {
+    smvm_forward(sig, info, context);
+    return;
+  }
+
+  if (msmv_guards(&vm->stack, addr)) {
+    bool under = addr >= vm->stack.base + vm->stack.mask + 1 - sizeof(smvm_frame);
+    smvm_raise(vm, status_trapped,
+               under ? trap_stack_underflow : trap_stack_overflow);
+  }
+
+  // the start of the access was in range, the rest ran off the end
+  if (msmv_guards(&vm->memory, addr))
+    smvm_raise(vm, status_trapped, trap_bounds);
+
+  if (msmv_holds(&vm->memory, addr)) {
+    u64 at = addr - vm->memory.base;
+    for (u64 i = 0; i < vm->regions.len; i++) {
+      smvm_region *region = listmv_at(&vm->regions, i);
+      if (at >= region->addr && at - region->addr < region->len)
+        smvm_raise(vm, status_trapped, trap_protection);
+    }
+  }
+
+  // a first touch of a lazy page, the access runs again once it's committed
+  msmv *memory = msmv_holds(&vm->memory, addr)  ? &vm->memory
+                 : msmv_holds(&vm->stack, addr) ? &vm->stack
+                                                : NULL;
+  if (memory != NULL && memory->flags & msmv_lazy) {
+    u64 current = smvm_get_usage(vm).current;
+    u64 room = vm->quota > current ? vm->quota - current : 0;
+    // past the quota, or the host can't give the guest any more
+    if (msmv_commit(memory, addr, room) == 0)
+      smvm_raise(vm, status_trapped, trap_quota);
+    current = smvm_get_usage(vm).current;
+    if (current > vm->peak) vm->peak = current;
+    return;
+  }
+  smvm_forward(sig, info, context);
+}
+
+// SA_NODEFER as smvm_raise leaves through longjmp, which doesn't unblock
+static void smvm_install_faults(void) {
+  struct sigaction action = {.sa_flags = SA_SIGINFO | SA_NODEFER};
+  action.sa_sigaction = smvm_fault;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &smvm_previous_segv);
+  sigaction(SIGBUS, &action, &smvm_previous_bus);
+}
+
+static void smvm_catch_faults(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, smvm_install_faults);
+}
+#endif
 
 void smvm_init(smvm *vm) {
   *vm = (smvm){0};
   listmv_init(&vm->bytecode, sizeof(u8));
-  listmv_init(&vm->memory, sizeof(u8));
-  listmv_init(&vm->stack, sizeof(u8));
+  if (!msmv_init(&vm->memory, msmv_default_size, msmv_file)) {
+    fprintf(stderr, "Reserving guest memory failed.\n");
+    exit(1);
+  }
+  if (!msmv_stack_init(&vm->stack, msmv_stack_default_size, msmv_file)) {
+    fprintf(stderr, "Reserving the guest stack failed.\n");
+    exit(1);
+  }
+#if smvm_guard_traps
+  smvm_catch_faults();
+#endif
+  listmv_init(&vm->stringpool, sizeof(u8));
+  listmv_init(&vm->globals, sizeof(u8));
+  listmv_init(&vm->syscalls, sizeof(smvm_syscall));
+  listmv_init(&vm->regions, sizeof(smvm_region));
   vm->little_endian = is_little_endian();
+  vm->fusions = fuse_all;
+  vm->fuel = smvm_fuel_unlimited;
+  vm->quota = smvm_quota_unlimited;
+}
+
+bool smvm_set_memory(smvm *vm, u64 size, u8 flags) {
+  msmv memory;
+  if (!msmv_init(&memory, size, flags | (vm->memory.flags & (msmv_lazy | msmv_file))))
+    return false;
+  msmv_free(&vm->memory);
+  vm->memory = memory;
+  vm->regions.len = 0;  // they were in the old memory
+  hsmv_free(&vm->heap);
+  vsmv_verify(vm);  // direct addresses may not fit anymore
+  return true;
+}
+
+bool smvm_map_region(smvm *vm, u64 guest_addr, void *host_ptr, u64 len,
+                     u8 prot) {
+  for (u64 i = 0; i < vm->regions.len; i++) {
+    smvm_region *region = listmv_at(&vm->regions, i);
+    if (guest_addr < region->addr + region->len &&
+        region->addr < guest_addr + len)
+      return false;
+  }
+  if (!msmv_alias(&vm->memory, guest_addr, host_ptr, len, prot)) return false;
+  listmv_push(&vm->regions, &(smvm_region){guest_addr, len, prot});
+  return true;
+}
+
+bool smvm_unmap_region(smvm *vm, u64 guest_addr) {
+  for (u64 i = 0; i < vm->regions.len; i++) {
+    smvm_region *region = listmv_at(&vm->regions, i);
+    if (region->addr != guest_addr) continue;
+    msmv_unalias(&vm->memory, region->addr, region->len);
+    *region = *(smvm_region *)listmv_at(&vm->regions, vm->regions.len - 1);
+    vm->regions.len--;
+    return true;
+  }
+  return false;
+}
+
+bool smvm_set_heap(smvm *vm, u64 guest_addr, u64 size) {
+  hsmv heap;
+  if (size > vm->memory.size || guest_addr > vm->memory.size - size ||
+      !hsmv_init(&heap, guest_addr, size))
+    return false;
+  hsmv_free(&vm->heap);
+  vm->heap = heap;
+  return true;
+}
+
+hsmv_stats smvm_get_heap_stats(smvm *vm) { return vm->heap.stats; }
+
+bool smvm_attach_shared(smvm *vm, u64 guest_addr, msmv *segment, u8 prot) {
+  return smvm_map_region(vm, guest_addr, segment->base, segment->size, prot);
+}
+
+bool smvm_set_stack(smvm *vm, u64 size) {
+  msmv stack;
+  if (!msmv_stack_init(&stack, size, vm->stack.flags)) return false;
+  msmv_free(&vm->stack);
+  vm->stack = stack;
+  vm->registers[reg_sp] = 0;
+  return true;
+}
+
+void smvm_set_quota(smvm *vm, u64 bytes) {
+  msmv_make_lazy(&vm->memory);
+  msmv_make_lazy(&vm->stack);
+  vm->quota = bytes;
+}
+
+smvm_usage smvm_get_usage(smvm *vm) {
+  return (smvm_usage){
+      .current = vm->memory.committed + vm->stack.committed,
+      .peak = vm->peak,
+      .quota = vm->quota,
+  };
+}
+
+u64 smvm_link_syscall(smvm *vm, smvm_syscall_func fn, const char *name) {
+  u64 index = smvm_find_syscall_index(vm, name);
+  if (index != (u64)-1) {
+    ((smvm_syscall *)listmv_at(&vm->syscalls, index))->function = fn;
+    return index;
+  }
+
+  smvm_syscall syscall = {
+      .id = vm->syscalls.len,
+      .name = malloc((strlen(name) + 1) * sizeof(char)),
+      .function = fn,
+  };
+  strcpy(syscall.name, name);
+  listmv_push(&vm->syscalls, &syscall);
+  return syscall.id;
+}
+
+static void smvm_free_syscalls(smvm *vm) {
+  for (u64 i = 0; i < vm->syscalls.len; i++)
+    free(((smvm_syscall *)listmv_at(&vm->syscalls, i))->name);
+  listmv_free(&vm->syscalls);
+}
+
+static void smvm_free_packed(smvm_packed *packed) {
+  free(packed->codes);
+  free(packed->operands);
+  free(packed->data);
+  listmv_free(&packed->immediates);
+  *packed = (smvm_packed){0};
+}
+
+void smvm_pack(smvm *vm) {
+  smvm_packed *packed = &vm->packed;
+  smvm_free_packed(packed);
+
+  u64 len = vm->instructions.len;
+  packed->len = len;
+  packed->codes = malloc(len + 1);
+  packed->operands = malloc((len + 1) * sizeof(*packed->operands));
+  packed->data = malloc((len + 1) * sizeof(u32));
+  listmv_init(&packed->immediates, sizeof(u64));
+
+  for (u64 i = 0; i < len; i++) {
+    asmv_inst *inst = listmv_at(&vm->instructions, i);
+    packed->codes[i] = inst->code;
+    packed->data[i] = packed->immediates.len;
+
+    for (int j = 0; j < instruction_table[inst->code].num_ops; j++) {
+      asmv_operand *op = &inst->operands[j];
+      if (op->data.type == asmv_str_type) {
+        packed->operands[i][j] =
+            smvm_operand(op->mode, op->width, 0) | smvm_operand_str;
+        listmv_push(&packed->immediates, &op->data.str.offset);
+        continue;
+      }
+      bool has_reg = op->mode == mode_register || op->mode == mode_indirect;
+      packed->operands[i][j] =
+          smvm_operand(op->mode, op->width, has_reg ? op->data.reg : 0);
+      if (!has_reg) listmv_push(&packed->immediates, &op->data.unum);
+    }
+
+    switch (inst->code) {
+      case op_call:
+        listmv_push(&packed->immediates, &inst->label_index);
+        listmv_push(&packed->immediates, &inst->index);
+        break;
+      case op_jmp:
+      case op_je:
+      case op_jne:
+      case op_jl: listmv_push(&packed->immediates, &inst->label_index); break;
+      default: break;
+    }
+  }
 }
 
 u64 smvm_find_syscall_index(smvm *vm, const char *name) {
@@ -76,83 +349,509 @@ void smvm_assemble(smvm *vm, char *code) {
   assembler.code = code;
   asmv_assemble(&assembler);
   if (vm->bytecode.data != NULL) listmv_free(&vm->bytecode);
+  listmv_free(&vm->instructions);
   vm->instructions = assembler.instructions;
   vm->bytecode = assembler.bytecode;  // ownership to vm
+  listmv_free(&vm->stringpool);
+  vm->stringpool = assembler.stringpool;
+  listmv_free(&vm->globals);
+  vm->globals = assembler.memory;
   vm->header = assembler.header;
-  listmv_free(&vm->syscalls);
-  vm->syscalls = assembler.syscalls;
+  listmv_free(&vm->program);
+  vm->program = (listmv){0};  // stale, re-decoded on the next execute
+  jsmv_free(vm);
+  jsmv_free_traces(vm);
+  // the assembler's list starts with the vm's, only names new to it are
+  // copied out of the arena
+  for (u64 i = vm->syscalls.len; i < assembler.syscalls.len; i++)
+    smvm_link_syscall(
+        vm, NULL, ((smvm_syscall *)listmv_at(&assembler.syscalls, i))->name);
   asmv_free(&assembler);
+  smvm_pack(vm);
+  vsmv_verify(vm);
+  smvm_load_globals(vm);
 }
 
-// TODO error return type
-void smvm_execute(smvm *vm) {
-  for (vm->registers[reg_ip] = 0; vm->registers[reg_ip] < vm->instructions.len;
-       vm->registers[reg_ip]++) {
-    asmv_inst *instruction =
-        (asmv_inst *)listmv_at(&vm->instructions, vm->registers[reg_ip]);
-    vm->cache.instruction = instruction;
-
-    u8 code = instruction->code;
-    u8 num_ops = instruction_table[code].num_ops;
-    u8 code_width = num_ops != 3 ? 3 : 4;
-
-    for (int j = 0; j < num_ops; j++) {
-      asmv_operand *op = &instruction->operands[j];
-      switch (op->mode) {
-        case mode_register: {
-          vm->cache.pointers[j] = &vm->registers[op->data.reg];
-          break;
-        }
-        case mode_indirect: {
-          listmv_grow(&vm->memory,
-                      vm->registers[op->data.reg] + (1 << op->width));
-          vm->cache.pointers[j] =
-              listmv_at(&vm->memory, vm->registers[op->data.reg]);
-          break;
-        }
-        case mode_direct: {
-          listmv_grow(&vm->memory, op->data.unum + (1 << op->width));
-          vm->cache.pointers[j] = listmv_at(&vm->memory, op->data.unum);
-          break;
-        }
-        case mode_immediate: {
-          vm->cache.data[j] = op->data.unum;
-          vm->cache.pointers[j] = &vm->cache.data[j];
-          break;
-        }
-        default: {
-          fprintf(stderr, "Unknown operand mode\n");
-          smvm_set_flag(vm, flag_t);
-          return;
-        }
-      }
-      vm->cache.widths[j] = 1 << op->width;
+static void smvm_put_be(listmv(u8) *image, u64 value, u8 size) {
+  for (int n = size - 1; n >= 0; n--) listmv_push(image, &(u8){value >> (n * 8)});
+}
 
-      if (op->data.type == asmv_str_type) {
-        vm->cache.pointers[j] = (i64 *)listmv_at(&op->data.str, 0);
+static u64 smvm_get_be(u8 *bytes, u8 size) {
+  u64 value = 0;
+  for (int n = 0; n < size; n++) value = (value << 8) | bytes[n];
+  return value;
+}
+
+// image layout: header, global variables, code, then the NUL terminated
+// syscall names in index order so they can be linked again by name
+void smvm_emit_image(smvm *vm, listmv(u8) *image) {
+  smvm_header header = vm->header;
+  header.global_variables_len = vm->globals.len;
+  header.code_len = vm->bytecode.len;
+  header.checksum = checksum_32bit(vm->globals, vm->bytecode);
+
+  smvm_put_be(image, header.version, 2);
+  smvm_put_be(image, header.header_flags, 2);
+  smvm_put_be(image, header.checksum, 4);
+  smvm_put_be(image, header.global_variables_len, 8);
+  smvm_put_be(image, header.code_len, 8);
+  listmv_push_array(image, vm->globals.data, vm->globals.len);
+  listmv_push_array(image, vm->bytecode.data, vm->bytecode.len);
+
+  for (u64 i = 0; i < vm->syscalls.len; i++) {
+    char *name = ((smvm_syscall *)listmv_at(&vm->syscalls, i))->name;
+    listmv_push_array(image, name, strlen(name) + 1);
+  }
+}
+
+void smvm_relink_syscalls(smvm *vm, u8 *names, u8 *end) {
+  listmv(smvm_syscall) syscalls;
+  listmv_init(&syscalls, sizeof(smvm_syscall));
+  while (names < end) {
+    u8 *name_end = memchr(names, '\0', end - names);
+    if (name_end == NULL) break;
+    u64 linked = smvm_find_syscall_index(vm, (char *)names);
+    smvm_syscall syscall = {
+        .id = syscalls.len,
+        .name = malloc(name_end - names + 1),
+        .function = linked == (u64)-1
+                        ? NULL
+                        : ((smvm_syscall *)listmv_at(&vm->syscalls, linked))
+                              ->function,
+    };
+    strcpy(syscall.name, (char *)names);
+    listmv_push(&syscalls, &syscall);
+    names = name_end + 1;
+  }
+  for (u64 i = 0; i < vm->syscalls.len; i++) {
+    smvm_syscall *old = listmv_at(&vm->syscalls, i);
+    bool present = false;
+    for (u64 j = 0; j < syscalls.len && !present; j++)
+      present = !strcmp(((smvm_syscall *)listmv_at(&syscalls, j))->name,
+                        old->name);
+    if (present) continue;
+    smvm_syscall syscall = {
+        .id = syscalls.len, .name = old->name, .function = old->function};
+    old->name = NULL;  // moved
+    listmv_push(&syscalls, &syscall);
+  }
+  smvm_free_syscalls(vm);
+  vm->syscalls = syscalls;
+}
+
+// index of the instruction starting at a bytecode address, the end of the
+// code maps to one past the last instruction like a trailing label does
+static u64 smvm_find_instruction(listmv(asmv_inst) *instructions, u64 addr) {
+  u64 low = 0, high = instructions->len;
+  while (low < high) {
+    u64 mid = low + (high - low) / 2;
+    asmv_inst *inst = listmv_at(instructions, mid);
+    if (inst->index < addr) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+// every entry of a data section is whole
+static bool smvm_globals_valid(u8 *globals, u64 len) {
+  for (u64 at = 0; at < len;) {
+    if (len - at < smvm_global_size) return false;
+    u64 size = smvm_get_be(globals + at + 8, 8);
+    u8 kind = globals[at + 16];
+    at += smvm_global_size;
+    if (kind == global_zero) continue;
+    if ((kind != global_bytes && kind != global_u16 && kind != global_u32 &&
+         kind != global_u64) ||
+        size % kind || size > len - at)
+      return false;
+    at += size;
+  }
+  return true;
+}
+
+bool smvm_load_image(smvm *vm, u8 *image, u64 len) {
+  if (len < smvm_header_size) return false;
+
+  smvm_header header = {
+      .version = smvm_get_be(image, 2),
+      .header_flags = smvm_get_be(image + 2, 2),
+      .checksum = smvm_get_be(image + 4, 4),
+      .global_variables_len = smvm_get_be(image + 8, 8),
+      .code_len = smvm_get_be(image + 16, 8),
+  };
+  if (header.version != smvm_version) return false;
+  if (header.global_variables_len > len - smvm_header_size ||
+      header.code_len >
+          len - smvm_header_size - header.global_variables_len)
+    return false;
+
+  u8 *code = image + smvm_header_size + header.global_variables_len;
+  u8 *names = code + header.code_len;
+  listmv(u8) bytecode = {
+      .data = code, .len = header.code_len, .size = sizeof(u8)};
+  listmv(u8) globals = {.data = image + smvm_header_size,
+                        .len = header.global_variables_len,
+                        .size = sizeof(u8)};
+  if (!checksum32bit_valid(globals, bytecode, header.checksum) ||
+      !smvm_globals_valid(globals.data, globals.len))
+    return false;
+
+  // decode everything once, the engines never look at the bytes again
+  listmv(asmv_inst) instructions;
+  listmv(u8) stringpool;
+  asmv_strings strings;
+  listmv_init(&instructions, sizeof(asmv_inst));
+  listmv_init(&stringpool, sizeof(u8));
+  asmv_strings_init(&strings, NULL);
+  for (u64 bp = 0; bp < header.code_len;) {
+    asmv_inst inst;
+    u64 size = dsmv_decode_inst(code + bp, header.code_len - bp, &inst,
+                                &stringpool, &strings);
+    if (size == 0) {
+      listmv_free(&instructions);
+      listmv_free(&stringpool);
+      asmv_strings_free(&strings);
+      return false;
+    }
+    inst.index = bp;
+    listmv_push(&instructions, &inst);
+    bp += size;
+  }
+  asmv_strings_free(&strings);
+
+  for (u64 i = 0; i < instructions.len; i++) {
+    asmv_inst *inst = listmv_at(&instructions, i);
+    int target = -1;
+    switch (inst->code) {
+      case op_jmp:
+      case op_call: target = 0; break;
+      case op_je:
+      case op_jne:
+      case op_jl: target = 2; break;
+      default: continue;
+    }
+    inst->label_index =
+        smvm_find_instruction(&instructions, inst->operands[target].data.unum);
+  }
+
+  // natives linked before the load keep their functions, in image order
+  smvm_relink_syscalls(vm, names, image + len);
+
+  listmv_free(&vm->instructions);
+  listmv_free(&vm->bytecode);
+  listmv_free(&vm->program);
+  vm->program = (listmv){0};
+  jsmv_free(vm);
+  jsmv_free_traces(vm);
+
+  listmv_free(&vm->stringpool);
+  listmv_free(&vm->globals);
+  vm->instructions = instructions;
+  vm->stringpool = stringpool;
+  listmv_init(&vm->globals, sizeof(u8));
+  listmv_push_array(&vm->globals, globals.data, globals.len);
+  vm->header = header;
+  listmv_init(&vm->bytecode, sizeof(u8));
+  listmv_push_array(&vm->bytecode, code, header.code_len);
+  smvm_pack(vm);
+  vsmv_verify(vm);
+  smvm_load_globals(vm);
+  return true;
+}
+
+// fills vm->cache for one instruction. unchecked, there's no bad mode to
+// trap on
+static inline bool smvm_load(smvm *vm, u64 index, const bool checked) {
+  smvm_packed *packed = &vm->packed;
+  vm->cache.instruction = listmv_at(&vm->instructions, index);
+
+  u8 num_ops = instruction_table[packed->codes[index]].num_ops;
+  u8 *operands = packed->operands[index];
+  u64 *data = (u64 *)packed->immediates.data + packed->data[index];
+
+  for (int j = 0; j < num_ops; j++) {
+    u8 op = operands[j];
+    if (op & smvm_operand_str) {
+      vm->cache.pointers[j] = listmv_at(&vm->stringpool, *data++);
+      vm->cache.widths[j] = 1 << smvm_operand_width(op);
+      continue;
+    }
+
+    switch (smvm_operand_mode(op)) {
+      case mode_register: {
+        vm->cache.pointers[j] = &vm->registers[smvm_operand_reg(op)];
+        break;
+      }
+      case mode_indirect: {
+        u64 addr = vm->registers[smvm_operand_reg(op)];
+        vm->cache.pointers[j] = (i64 *)msmv_at(&vm->memory, addr);
+        break;
+      }
+      case mode_direct: {
+        vm->cache.pointers[j] = (i64 *)msmv_at(&vm->memory, *data++);
+        break;
+      }
+      case mode_immediate: {
+        vm->cache.data[j] = *data++;
+        vm->cache.pointers[j] = &vm->cache.data[j];
+        break;
+      }
+      default: {
+        if (!checked) break;
+        smvm_raise(vm, status_trapped, trap_operand_mode);
+        return false;
       }
     }
+    vm->cache.widths[j] = 1 << smvm_operand_width(op);
+  }
 
-    vm->cache.offset = code_width;
-    instruction_table[code].fn(vm);
+  vm->cache.extra = data;
+  vm->cache.offset = num_ops != 3 ? 3 : 4;
+  return true;
+}
 
-    if (smvm_get_flag(vm, flag_t)) break;  // TODO, so much
+// the loop engine, with checked a constant so each caller gets its own copy
+static inline void smvm_run(smvm *vm, const bool checked) {
+  for (; vm->registers[reg_ip] < vm->instructions.len;
+       vm->registers[reg_ip]++) {
+    instruction_info *info =
+        &instruction_table[vm->packed.codes[vm->registers[reg_ip]]];
+    smvm_load(vm, vm->registers[reg_ip], checked);
+    if (checked || !info->unchecked) info->fn(vm);
+    else info->unchecked(vm);
   }
 }
 
-void smvm_free(smvm *vm) {
-  listmv_free(&vm->memory);
-  for (int i = 0; i < vm->instructions.len; i++) {
-    asmv_inst instruction = *(asmv_inst *)listmv_at(&vm->instructions, i);
-    for (int j = 0; j < instruction_table[instruction.code].num_ops; j++) {
-      asmv_operand *op = &instruction.operands[j];
-      if (op->data.type == asmv_str_type) { listmv_free(&op->data.str); }
+smvm_result smvm_execute(smvm *vm) {
+  vm->registers[reg_ip] = 0;
+  return smvm_resume(vm);
+}
+
+static void smvm_run_checked(smvm *vm) { smvm_run(vm, true); }
+static void smvm_run_unchecked(smvm *vm) { smvm_run(vm, false); }
+
+// handlers leave through smvm_raise, so the loop itself checks nothing
+static smvm_result smvm_enter(smvm *vm, void (*run)(smvm *vm)) {
+  jmp_buf escape;
+  jmp_buf *outer = vm->escape;
+  vm->escape = &escape;
+#if smvm_guard_traps
+  smvm *outer_vm = smvm_running;
+  smvm_running = vm;
+#endif
+  vm->result = (smvm_result){.status = status_halted, .trap = trap_none};
+  smvm_reset_flag(vm, flag_t);
+
+  if (setjmp(escape) == 0) {
+    run(vm);
+    vm->result.index = vm->registers[reg_ip];
+  }
+
+  vm->escape = outer;
+#if smvm_guard_traps
+  smvm_running = outer_vm;
+#endif
+  return vm->result;
+}
+
+smvm_result smvm_resume(smvm *vm) {
+  if (vm->engine == engine_threaded) return smvm_enter(vm, tsmv_execute);
+  if (vm->engine == engine_jit) return smvm_enter(vm, smvm_execute_jit);
+  return smvm_enter(vm, vm->verified.ok ? smvm_run_unchecked : smvm_run_checked);
+}
+
+smvm_result smvm_execute_aot(smvm *vm, void (*run)(smvm *vm)) {
+  vm->registers[reg_ip] = 0;
+  return smvm_enter(vm, run);
+}
+
+// ends the run, or only sets flag_t when no smvm_execute or smvm_step is
+// running (natives called by hand)
+void smvm_raise(smvm *vm, smvm_status status, smvm_trap trap) {
+  vm->result = (smvm_result){status, trap, vm->registers[reg_ip]};
+  smvm_set_flag(vm, flag_t);
+  if (vm->escape) longjmp(*vm->escape, 1);
+}
+
+static void smvm_store_globals(smvm *vm) {
+  u8 *globals = vm->globals.data;
+  for (u64 at = 0; at < vm->globals.len;) {
+    u64 addr = smvm_get_be(globals + at, 8);
+    u64 len = smvm_get_be(globals + at + 8, 8);
+    u8 kind = globals[at + 16];
+    at += smvm_global_size;
+    if (kind == global_zero) {
+      msmv_store(&vm->memory, addr, NULL, len);
+      continue;
     }
+    if (kind == global_bytes) {
+      msmv_store(&vm->memory, addr, globals + at, len);
+      at += len;
+      continue;
+    }
+    // to host order a word at a time, smvm_reset runs this with no malloc
+    for (u64 i = 0; i < len; i += kind) {
+      u64 word = smvm_get_be(globals + at + i, kind);
+      msmv_store(&vm->memory, addr + i, &word, kind);
+    }
+    at += len;
   }
+}
+
+bool smvm_load_globals(smvm *vm) {
+  if (vm->globals.len == 0) return true;
+  // a fault on a lazy page has to have somewhere to go, like in smvm_step
+  jmp_buf escape;
+  jmp_buf *outer = vm->escape;
+  vm->escape = &escape;
+#if smvm_guard_traps
+  smvm *outer_vm = smvm_running;
+  smvm_running = vm;
+#endif
+  bool ok = setjmp(escape) == 0;
+  if (ok) smvm_store_globals(vm);
+#if smvm_guard_traps
+  smvm_running = outer_vm;
+#endif
+  vm->escape = outer;
+  return ok;
+}
+
+bool smvm_reset(smvm *vm) {
+  memset(vm->registers, 0, sizeof(vm->registers));
+  vm->flags = 0;
+  vm->result = (smvm_result){0};
+  msmv_clear(&vm->stack);
+  msmv_clear(&vm->memory);
+  for (u64 i = 0; i < vm->regions.len; i++) {
+    smvm_region *region = listmv_at(&vm->regions, i);
+    msmv_protect(&vm->memory, region->addr, region->len, region->prot);
+  }
+  hsmv_reset(&vm->heap);
+  return smvm_load_globals(vm);
+}
+
+u64 smvm_step(smvm *vm, u64 index) {
+  // a fault in the stack's guard has to have somewhere to go
+  if (vm->escape == NULL) {
+    jmp_buf escape;
+    u64 next;
+    vm->escape = &escape;
+#if smvm_guard_traps
+    smvm *outer_vm = smvm_running;
+    smvm_running = vm;
+#endif
+    if (setjmp(escape) == 0) next = smvm_step(vm, index);
+    else next = smvm_step_exit;
+#if smvm_guard_traps
+    smvm_running = outer_vm;
+#endif
+    vm->escape = NULL;
+    return next;
+  }
+
+  vm->registers[reg_ip] = index;
+  if (!smvm_load_operands(vm, index)) return smvm_step_exit;
+  instruction_table[vm->packed.codes[index]].fn(vm);
+  if (smvm_get_flag(vm, flag_t)) return smvm_step_exit;
+  return vm->registers[reg_ip] + 1;
+}
+
+void smvm_free(smvm *vm) {
+  msmv_free(&vm->memory);
   listmv_free(&vm->instructions);
+  smvm_free_packed(&vm->packed);
+  listmv_free(&vm->program);
+  jsmv_free(vm);
+  jsmv_free_traces(vm);
   listmv_free(&vm->bytecode);
-  listmv_free(&vm->stack);
-  listmv_free(&vm->syscalls);
+  msmv_free(&vm->stack);
+  listmv_free(&vm->stringpool);
+  listmv_free(&vm->globals);
+  listmv_free(&vm->regions);
+  hsmv_free(&vm->heap);
+  smvm_free_syscalls(vm);
+}
+
+static void smvm_copy_list(listmv *to, listmv *from) {
+  listmv_init(to, from->size);
+  listmv_push_array(to, from->data, from->len);
+}
+
+// what the program is made of, deep, nothing compiled or decoded lazily
+static void smvm_copy_program(smvm *to, smvm *from) {
+  smvm_copy_list(&to->bytecode, &from->bytecode);
+  smvm_copy_list(&to->stringpool, &from->stringpool);
+  smvm_copy_list(&to->globals, &from->globals);
+  smvm_copy_list(&to->instructions, &from->instructions);
+  smvm_copy_list(&to->syscalls, &from->syscalls);
+  for (u64 i = 0; i < to->syscalls.len; i++) {
+    smvm_syscall *syscall = listmv_at(&to->syscalls, i);
+    char *name = malloc(strlen(syscall->name) + 1);
+    syscall->name = strcpy(name, syscall->name);
+  }
+
+  u64 len = from->packed.len;
+  to->packed = (smvm_packed){.len = len};
+  to->packed.codes = malloc(len + 1);
+  to->packed.operands = malloc((len + 1) * sizeof(*to->packed.operands));
+  to->packed.data = malloc((len + 1) * sizeof(u32));
+  memcpy(to->packed.codes, from->packed.codes, len);
+  memcpy(to->packed.operands, from->packed.operands,
+         len * sizeof(*to->packed.operands));
+  memcpy(to->packed.data, from->packed.data, len * sizeof(u32));
+  smvm_copy_list(&to->packed.immediates, &from->packed.immediates);
+
+  to->program = (listmv){0};
+  to->jit = NULL;
+  to->tracer = NULL;
+  to->escape = NULL;
+  to->cache = (struct cache){0};
+}
+
+bool smvm_snapshot(smvm *vm, smvm_frozen *snapshot) {
+  int memory = msmv_freeze(&vm->memory);
+  if (memory < 0) return false;
+  int stack = msmv_freeze(&vm->stack);
+  if (stack < 0) {
+    close(memory);
+    return false;
+  }
+
+  *snapshot = (smvm_frozen){.vm = *vm, .memory = memory, .stack = stack};
+  smvm_copy_program(&snapshot->vm, vm);
+  // only the shape is kept, forks map the files
+  snapshot->vm.memory.base = NULL;
+  snapshot->vm.stack.base = NULL;
+  snapshot->vm.memory.open = NULL;
+  snapshot->vm.stack.open = NULL;
+  listmv_init(&snapshot->vm.regions, sizeof(smvm_region));  // host's, not in it
+  hsmv_copy(&snapshot->vm.heap, &vm->heap);
+  snapshot->vm.peak = 0;
+  snapshot->vm.stats = (struct stats){0};
+  return true;
+}
+
+bool smvm_fork(smvm_frozen *snapshot, smvm *vm) {
+  // built on the side, until it's whole it shares everything with snapshot
+  smvm fork = snapshot->vm;
+  if (!msmv_fork(&fork.memory, &snapshot->vm.memory, snapshot->memory, 0))
+    return false;
+  if (!msmv_fork(&fork.stack, &snapshot->vm.stack, snapshot->stack, 0)) {
+    msmv_free(&fork.memory);
+    return false;
+  }
+  smvm_copy_program(&fork, &snapshot->vm);
+  listmv_init(&fork.regions, sizeof(smvm_region));
+  hsmv_copy(&fork.heap, &snapshot->vm.heap);
+  *vm = fork;
+  return true;
+}
+
+void smvm_free_snapshot(smvm_frozen *snapshot) {
+  smvm_free(&snapshot->vm);
+  close(snapshot->memory);
+  close(snapshot->stack);
 }
 
 void smvm_disassemble(smvm *vm, char *code) {
@@ -165,7 +864,10 @@ void smvm_disassemble(smvm *vm, char *code) {
   dsmv_free(&ds);
 }
 
-void update_stack_pointer(smvm *vm) { vm->registers[reg_sp] = vm->stack.len; }
+// false (and trap) on a bad operand mode
+bool smvm_load_operands(smvm *vm, u64 index) {
+  return smvm_load(vm, index, true);
+}
 
 smvm_data_width min_space_neededu(u64 data) {
   if ((data >> 8) == 0) return smvm_reg8;
@@ -195,17 +897,36 @@ void smvm_reset_flag(smvm *vm, smvm_flag flag) { vm->flags &= ~flag; }
 
 /* vm - helpers - implementation */
 
+// running off the top faults in the guard, see smvm_fault
 void smvm_push(smvm *vm, u8 *value, u64 width) {
-  listmv_grow(&vm->stack, vm->stack.len + width);
-  mov_mem((u8 *)vm->stack.data, value, width);
-  vm->stack.len += width;
-  update_stack_pointer(vm);
+  u64 sp = vm->registers[reg_sp];
+  mov_mem(msmv_stack_at(&vm->stack, sp), value, width);
+  vm->registers[reg_sp] = sp + width;
 }
 
 u8 *smvm_pop(smvm *vm, u64 width) {
-  u8 *bytes = listmv_pop_array(&vm->stack, width);
-  update_stack_pointer(vm);
-  return bytes;
+  u64 sp = vm->registers[reg_sp];
+  if (sp < width) {
+    smvm_raise(vm, status_trapped, trap_stack_underflow);
+    return NULL;
+  }
+  vm->registers[reg_sp] = sp - width;
+  return msmv_stack_at(&vm->stack, sp - width);
+}
+
+void smvm_push_frame(smvm *vm, u64 ip, u64 bp) {
+  smvm_frame frame = {ip, bp};
+  smvm_push(vm, (u8 *)&frame, sizeof(smvm_frame));
+}
+
+u64 smvm_pop_frame(smvm *vm) {
+  u8 *bytes = smvm_pop(vm, sizeof(smvm_frame));
+  if (bytes == NULL) return vm->instructions.len;  // past the end, run over
+
+  smvm_frame frame;
+  mov_mem((u8 *)&frame, bytes, sizeof(smvm_frame));
+  vm->registers[reg_bp] = frame.bp;
+  return frame.ip + 1;
 }
 
 bool is_little_endian() {
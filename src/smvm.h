@@ -1,6 +1,10 @@
 #ifndef smv_smvm_smvm_h
 #define smv_smvm_smvm_h
 
+#include <setjmp.h>
+
+#include "hsmv.h"
+#include "msmv.h"
 #include "util.h"
 
 // version -> ff.fff.fff
@@ -9,6 +13,12 @@
 #define smvm_register_num (8)
 
 typedef struct asmv_inst asmv_inst;
+typedef struct tsmv_inst tsmv_inst;
+typedef struct jsmv jsmv;
+typedef struct jsmv_tracer jsmv_tracer;
+
+// on-disk size of smvm_header, fields are stored big endian like immediates
+#define smvm_header_size (24)
 
 typedef struct smvm_header {
   u16 version;
@@ -28,18 +38,135 @@ typedef struct smvm_syscall {
   smvm_syscall_func function;
 } smvm_syscall;
 
+typedef enum smvm_engine : u8 {
+  engine_loop = 0,      // smvm_execute's operand-resolving loop
+  engine_threaded = 1,  // pre-decoded, direct-threaded (see tsmv.h)
+  engine_jit = 2,       // x86-64 native code (see jsmv.h)
+  engine_tracing = 3,   // engine_loop, hot loops get compiled into traces
+} smvm_engine;
+
+// how a run ended, see smvm_result
+typedef enum smvm_status : u8 {
+  status_halted = 0,       // halt, or ran off the end of the program
+  status_trapped = 1,      // see smvm_trap
+  status_out_of_fuel = 2,  // vm->fuel ran out on a taken branch
+} smvm_status;
+
+typedef enum smvm_trap : u8 {
+  trap_none = 0,
+  trap_operand_mode = 1,     // an operand mode smvm_load_operands can't do
+  trap_syscall_missing = 2,  // scall on a syscall with no native linked
+  trap_syscall_range = 3,    // scall index past the end of vm->syscalls
+  trap_stack_underflow = 4,  // pop or ret on a stack too short for it
+  trap_stack_overflow = 5,   // push or call past the top of vm->stack
+  trap_quota = 6,            // a page more than vm->quota, see smvm_set_quota
+  trap_protection = 7,       // an access a mapped region doesn't allow
+  trap_misaligned = 8,       // an atomic off its width's alignment
+  trap_heap = 9,             // free or realloc of what alloc didn't give out
+  trap_bounds = 10,          // an access running off the end of vm->memory
+} smvm_trap;
+
+typedef struct smvm_result {
+  smvm_status status;
+  smvm_trap trap;  // trap_none unless status_trapped
+  u64 index;       // instruction the run stopped at
+} smvm_result;
+
+#define smvm_fuel_unlimited ((u64)-1)
+#define smvm_quota_unlimited ((u64)-1)
+
+// bytes of memory and stack the guest has touched, counted a page at a time
+// once smvm_set_quota made them lazy, 0 before that
+typedef struct smvm_usage {
+  u64 current;
+  u64 peak;
+  u64 quota;
+} smvm_usage;
+
+// the data section, smvm_header.global_variables_len bytes of an image and
+// vm->globals, is a run of entries: an 8 byte address, an 8 byte length and
+// a kind, big endian like the header, then the bytes unless it's
+// global_zero. words are big endian in the section and host order in memory
+#define smvm_global_size (17)
+typedef enum smvm_global_kind : u8 {
+  global_zero = 0,   // len zero bytes
+  global_bytes = 1,  // len bytes as they go into memory
+  global_u16 = 2,    // words of that many bytes
+  global_u32 = 4,
+  global_u64 = 8,
+} smvm_global_kind;
+
+// what call pushes and ret pops, one record so ret needs no lookup
+typedef struct smvm_frame {
+  u64 ip;  // the call instruction
+  u64 bp;  // its bytecode address
+} smvm_frame;
+
+// an operand of smvm_packed in one byte, what's left of asmv_operand once
+// its data has gone to the immediates table
+#define smvm_operand(_mode, _width, _reg) \
+  ((_mode) | (_width) << 2 | (_reg) << 4)
+#define smvm_operand_mode(_op) ((_op) & 0b11)
+#define smvm_operand_width(_op) (((_op) >> 2) & 0b11)
+#define smvm_operand_reg(_op) (((_op) >> 4) & 0b111)
+#define smvm_operand_str (1 << 7)  // its data is an offset into stringpool
+
+// vm->instructions packed for the interpreter, one entry per instruction in
+// each array. immediates, direct addresses and string offsets go to the side
+// tables in operand order, after them jumps add their target's index and
+// call its own bytecode address as well (vm->cache.extra)
+typedef struct smvm_packed {
+  u64 len;
+  u8 *codes;
+  u8 (*operands)[3];
+  u32 *data;  // where the instruction's entries in immediates start
+  listmv(u64) immediates;
+} smvm_packed;
+
+// superinstructions the threaded engine may fuse, see tsmv_fuse
+typedef enum smvm_fusion : u8 {
+  fuse_dec_jnz = 1,           // dec rx, jne rx 0 .l
+  fuse_inc_jne = 1 << 1,      // inc rx, jne rx y .l
+  fuse_mov_add = 1 << 2,      // mov rx ry, add ra rb rc
+  fuse_mov_add_mov = 1 << 3,  // mov rx ry, add ra rb rc, mov ry rz
+  fuse_all = 0b1111,
+} smvm_fusion;
+#define smvm_fusion_num (4)
+
 typedef struct smvm {
   listmv(u8) bytecode;
-  listmv(u8) stringpool;
-  listmv(u8) memory;
-  listmv(u8) stack;
+  listmv(u8) stringpool;  // string operands, NUL terminated, see asmv_string
+  listmv(u8) globals;     // the data section, see smvm_global_kind
+  msmv memory;  // msmv_default_size, see smvm_set_memory
+  msmv stack;  // msmv_stack_default_size, sp is the offset into it
   listmv(asmv_inst) instructions;
   listmv(smvm_syscall) syscalls;  // natives
+  listmv(smvm_region) regions;    // host memory in memory, by address
+  hsmv heap;                      // alloc's, see smvm_set_heap
+  smvm_packed packed;             // what the interpreter runs
+  listmv(tsmv_inst) program;      // decoded lazily by the threaded engine
+  jsmv *jit;                      // compiled lazily by smvm_execute_jit
+  jsmv_tracer *tracer;            // hot loops, for engine_tracing
 
   smvm_header header;
   i64 registers[smvm_register_num];
   u8 flags;
   bool little_endian;
+  smvm_engine engine;
+  u8 fusions;  // enum smvm_fusion, fuse_all by default
+  u64 fuel;    // taken branches left, smvm_fuel_unlimited by default
+  u64 quota;   // bytes of memory and stack, smvm_quota_unlimited by default
+  u64 peak;    // the most of the quota used at once, see smvm_get_usage
+
+  // how the last smvm_execute ended, escape is where smvm_raise jumps to
+  // while one is running
+  smvm_result result;
+  jmp_buf *escape;
+
+  // filled in by vsmv_verify whenever a program is assembled or loaded
+  struct verified {
+    bool ok;  // the loop engine may skip its run time checks
+  } verified;
 
   struct cache {
     asmv_inst *instruction;
@@ -47,9 +174,34 @@ typedef struct smvm {
     i64 data[3];
     u8 widths[3];
     u8 offset;
+    u64 *extra;  // past the operands' data in vm->packed.immediates
   } cache;
+
+  // filled in by the threaded engine, traces by engine_tracing
+  struct stats {
+    u64 executed;
+    u64 quickened;  // executed on an operand-specialized handler
+    u64 fused[smvm_fusion_num];  // superinstructions run, by bit of fusion
+    u64 traces;                  // traces compiled
+    u64 trace_runs;              // times the loop engine entered a trace
+  } stats;
 } smvm;
 
+// host memory in vm->memory, see smvm_map_region
+typedef struct smvm_region {
+  u64 addr;
+  u64 len;
+  u8 prot;  // enum msmv_prot
+} smvm_region;
+
+// a vm frozen after warm-up by smvm_snapshot, each smvm_fork of it starts
+// from there. memory and stack are files the forks map copy on write
+typedef struct smvm_frozen {
+  smvm vm;     // never runs, memory and stack only keep their shape
+  int memory;  // see msmv_freeze
+  int stack;
+} smvm_frozen;
+
 typedef enum smvm_opcode : u8 {
   op_halt = 0b000000,
   op_mov = 0b000001,
@@ -96,6 +248,14 @@ typedef enum smvm_opcode : u8 {
   op_putu = 0b101010,
   op_putf = 0b101011,
   op_puts = 0b101100,
+  op_aload = 0b101101,
+  op_astore = 0b101110,
+  op_cas = 0b101111,
+  op_xadd = 0b110000,
+  op_fence = 0b110001,
+  op_alloc = 0b110010,
+  op_free = 0b110011,
+  op_realloc = 0b110100,
 } smvm_opcode;
 
 typedef enum smvm_register : u8 {
@@ -120,7 +280,7 @@ typedef enum smvm_data_width : u8 {
 typedef enum smvm_flag : u8 {
   flag_o = 1,       // overflow
   flag_d = 1 << 1,  // direction
-  flag_t = 1 << 2,  // trap ~TODO add errors~
+  flag_t = 1 << 2,  // trap, vm->result says why
   flag_s = 1 << 3,  // sign
   flag_z = 1 << 4,  // zero
 } smvm_flag;
@@ -144,10 +304,91 @@ typedef enum smvm_mode {
   // mode_implicit = 0b111,  // TODO remove?
 } smvm_mode;
 
+// the first smvm_init in a process takes SIGSEGV and SIGBUS over, guard
+// pages, lazy commits and regions trap through them. faults that aren't a
+// running vm's go to whatever handler was installed before, or kill the
+// process like they would have. a handler installed after has to hand the
+// faults it doesn't know on to the one it replaced
 void smvm_init(smvm *vm);
+// swaps guest memory for a fresh range of size bytes (see msmv.h), false
+// and the old one kept if it can't be mapped
+bool smvm_set_memory(smvm *vm, u64 size, u8 flags);
+// swaps the stack for an empty one of size bytes, false and the old one kept
+// if it can't be mapped
+bool smvm_set_stack(smvm *vm, u64 size);
+// counts the pages of memory and stack the guest touches from now on, the
+// one that goes past bytes traps with trap_quota. a write running off the
+// end of memory still traps with trap_bounds once its first page fits. no
+// quota without mmap
+void smvm_set_quota(smvm *vm, u64 bytes);
+smvm_usage smvm_get_usage(smvm *vm);
+// where alloc, free and realloc get their blocks, size bytes of memory from
+// guest_addr on (see hsmv.h). the upper half of memory unless it's set,
+// blocks from before are forgotten. false if it doesn't fit in memory or
+// guest_addr is 0 or not page aligned
+bool smvm_set_heap(smvm *vm, u64 guest_addr, u64 size);
+hsmv_stats smvm_get_heap_stats(smvm *vm);
+// exposes len bytes of host memory at guest_addr, zero copy, see msmv_alias
+// for what the host memory has to be. guest accesses there are plain memory
+// accesses, the ones prot doesn't allow trap with trap_protection. the vm
+// never frees host_ptr, regions don't count towards the quota and aren't
+// part of snapshots or checkpoints
+bool smvm_map_region(smvm *vm, u64 guest_addr, void *host_ptr, u64 len,
+                     u8 prot);
+// the memory that was at guest_addr comes back, false if no region starts
+// there
+bool smvm_unmap_region(smvm *vm, u64 guest_addr);
+// a segment from msmv_shared_init as a region, every vm attaching it sees
+// the same memory, from whichever thread it runs on. the guest goes through
+// the atomic opcodes (aload, astore, cas, xadd, fence) for what the others
+// may touch at the same time. smvm_unmap_region detaches it, the segment can
+// be freed while vms still have it attached
+bool smvm_attach_shared(smvm *vm, u64 guest_addr, msmv *segment, u8 prot);
 u64 smvm_link_syscall(smvm *vm, smvm_syscall_func fn, const char *name);
 void smvm_assemble(smvm *vm, char *code);
-void smvm_execute(smvm *vm);
+void smvm_emit_image(smvm *vm, listmv(u8) *image);
+bool smvm_load_image(smvm *vm, u8 *image, u64 len);
+// vm->packed built again from vm->instructions, their codes are in
+// instruction_table
+void smvm_pack(smvm *vm);
+// swaps vm->syscalls for the NUL terminated names between names and end, in
+// that order. natives linked before keep their functions, and the ones the
+// names leave out go after them
+void smvm_relink_syscalls(smvm *vm, u8 *names, u8 *end);
+// writes vm->globals into memory, smvm_assemble and smvm_load_image do at
+// load. lazy pages count towards the quota like the guest touched them,
+// false once that runs out
+bool smvm_load_globals(smvm *vm);
+smvm_result smvm_execute(smvm *vm);
+// smvm_execute from the instruction at reg_ip on rather than the first, to
+// carry on after a run that ended early (out of fuel, a trap the embedder
+// dealt with) or one restored from a checkpoint, see psmv_save
+smvm_result smvm_resume(smvm *vm);
+// smvm_execute for the code csmv generates, run being its body. traps and
+// faults in it (a call past the stack, a lazy page) end up here the same
+// way, the generated smvm_aot_run goes through this
+smvm_result smvm_execute_aot(smvm *vm, void (*run)(smvm *vm));
+// vm the way smvm_assemble left it, for the next run: registers, flags,
+// stack, memory and the heap cleared and the data section written again.
+// the program, natives, regions and the room every buffer has stay, so a vm
+// reset and run over and over allocates nothing after its first run. false
+// like smvm_load_globals
+bool smvm_reset(smvm *vm);
+// from the instruction at reg_ip, like every engine
+void smvm_execute_jit(smvm *vm);
+// runs the instruction at index the way smvm_execute does, returns the index
+// of the next one or smvm_step_exit once the run is over. traps end the step
+// through vm->escape, its own when no smvm_execute is running
+u64 smvm_step(smvm *vm, u64 index);
+#define smvm_step_exit ((u64)-1)
+// false when vm's memory or stack has no file behind it (no memfd on this
+// host). forks share the snapshot's pages until they write them, and cost
+// the same however much memory the guest has. a fork is a vm like any other,
+// it can be snapshotted in turn and is smvm_free'd, the snapshot is freed
+// on its own. a fork that fails leaves vm as it was
+bool smvm_snapshot(smvm *vm, smvm_frozen *snapshot);
+bool smvm_fork(smvm_frozen *snapshot, smvm *vm);
+void smvm_free_snapshot(smvm_frozen *snapshot);
 void smvm_disassemble(smvm *vm, char *code);
 void smvm_free(smvm *vm);
 
@@ -155,13 +396,17 @@ void smvm_free(smvm *vm);
 u64 smvm_find_syscall_index(smvm *vm, const char *name);
 
 /* some helpers */
+void smvm_raise(smvm *vm, smvm_status status, smvm_trap trap);
 void smvm_push(smvm *vm, u8 *value, u64 width);
 u8 *smvm_pop(smvm *vm, u64 width);
+void smvm_push_frame(smvm *vm, u64 ip, u64 bp);
+// restores bp, returns the instruction to continue at
+u64 smvm_pop_frame(smvm *vm);
 bool is_little_endian();
 
 /* helpers */
 
-void update_stack_pointer(smvm *vm);
+bool smvm_load_operands(smvm *vm, u64 index);
 smvm_data_width min_space_neededu(u64 data);
 smvm_data_width min_space_needed(i64 data);
 void smvm_bytecode_inc(smvm *vm, u64 inc);
@@ -209,8 +454,10 @@ void jl_fn(smvm *vm);
 void loop_fn(smvm *vm);
 void call_fn(smvm *vm);
 void ret_fn(smvm *vm);
+void ret_unchecked_fn(smvm *vm);
 void push_fn(smvm *vm);
 void pop_fn(smvm *vm);
+void pop_unchecked_fn(smvm *vm);
 void extern_fn(smvm *vm);
 void scall_fn(smvm *vm);
 void getu_fn(smvm *vm);
@@ -218,6 +465,17 @@ void puti_fn(smvm *vm);
 void putu_fn(smvm *vm);
 void putf_fn(smvm *vm);
 void puts_fn(smvm *vm);
+// sequentially consistent, the memory operand naturally aligned to its width
+void aload_fn(smvm *vm);   // aload rx @y, rx <- @y
+void astore_fn(smvm *vm);  // astore @x y, @x <- y
+void cas_fn(smvm *vm);     // cas @x ry z, @x <- z if @x == ry, else ry <- @x
+void xadd_fn(smvm *vm);    // xadd @x ry, @x += ry, ry <- the old @x
+void fence_fn(smvm *vm);
+// the guest heap, a failed alloc or realloc gives 0 and realloc keeps the
+// block, a free or realloc of anything alloc didn't give out traps
+void alloc_fn(smvm *vm);    // alloc rx y, rx <- a block of y bytes
+void free_fn(smvm *vm);     // free x, nothing for 0
+void realloc_fn(smvm *vm);  // realloc rx y, rx <- rx's block resized to y
 
 // TODO, implement hashing or something
 typedef struct instruction_info {
@@ -225,9 +483,10 @@ typedef struct instruction_info {
   u8 str_size : 4;
   u8 num_ops : 4;
   void (*fn)(smvm *);
+  void (*unchecked)(smvm *);  // for verified programs, fn when NULL
 } instruction_info;
 
-#define instruction_table_len (45)
+#define instruction_table_len (53)
 extern instruction_info instruction_table[instruction_table_len];
 
 #endif
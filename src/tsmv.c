@@ -0,0 +1,534 @@
+#include "tsmv.h"
+
+#include "asmv.h"
+#include "smvm.h"
+
+// 'r' for a full 64-bit general register, 'i' for an immediate, '?' else
+static char tsmv_shape(asmv_operand *op) {
+  if (op->mode == mode_register && op->width == smvm_reg64) return 'r';
+  if (op->mode == mode_immediate) return 'i';
+  return '?';
+}
+
+static tsmv_op tsmv_quicken(asmv_inst *inst, tsmv_op op) {
+  char shape[4] = {0};
+  for (int i = 0; i < instruction_table[inst->code].num_ops; i++)
+    shape[i] = tsmv_shape(&inst->operands[i]);
+
+#define tsmv_quick_binary(_name)                                     \
+  case tsmv_##_name:                                                 \
+    if (!strcmp(shape, "rrr")) return tsmv_##_name##_r64_r64_r64;    \
+    if (!strcmp(shape, "rri")) return tsmv_##_name##_r64_r64_imm;    \
+    return op;
+#define tsmv_quick_branch(_name)                                     \
+  case tsmv_##_name:                                                 \
+    if (!strcmp(shape, "rri")) return tsmv_##_name##_r64_r64;        \
+    if (!strcmp(shape, "rii")) return tsmv_##_name##_r64_imm;        \
+    return op;
+
+  switch (op) {
+    case tsmv_mov:
+      if (!strcmp(shape, "rr")) return tsmv_mov_r64_r64;
+      if (!strcmp(shape, "ri")) return tsmv_mov_r64_imm;
+      return op;
+    // the unsigned variants wrap to the same 64 bits
+    case tsmv_addu: return tsmv_quicken(inst, tsmv_add);
+    case tsmv_subu: return tsmv_quicken(inst, tsmv_sub);
+    case tsmv_mulu: return tsmv_quicken(inst, tsmv_mul);
+    tsmv_quick_binary(add);
+    tsmv_quick_binary(sub);
+    tsmv_quick_binary(mul);
+    tsmv_quick_binary(div);
+    tsmv_quick_binary(divu);
+    tsmv_quick_binary(and);
+    tsmv_quick_binary(or);
+    tsmv_quick_binary(xor);
+    tsmv_quick_binary(shl);
+    tsmv_quick_binary(shr);
+    case tsmv_inc: return !strcmp(shape, "r") ? tsmv_inc_r64 : op;
+    case tsmv_dec: return !strcmp(shape, "r") ? tsmv_dec_r64 : op;
+    tsmv_quick_branch(je);
+    tsmv_quick_branch(jne);
+    tsmv_quick_branch(jl);
+    default: return op;
+  }
+
+#undef tsmv_quick_binary
+#undef tsmv_quick_branch
+}
+
+static tsmv_op tsmv_select(asmv_inst *inst) {
+  // strings need the asmv_inst, and ip only exists as a local in
+  // tsmv_execute, so anything touching either goes through instruction_table
+  for (int i = 0; i < instruction_table[inst->code].num_ops; i++) {
+    asmv_operand *op = &inst->operands[i];
+    if (op->data.type == asmv_str_type) return tsmv_generic;
+    if ((op->mode == mode_register || op->mode == mode_indirect) &&
+        op->data.reg == reg_ip)
+      return tsmv_generic;
+  }
+
+  switch (inst->code) {
+    case op_halt: return tsmv_halt;
+    case op_mov:
+    case op_movu:
+    case op_movf: return tsmv_mov;
+    case op_add: return tsmv_add;
+    case op_addu: return tsmv_addu;
+    case op_sub: return tsmv_sub;
+    case op_subu: return tsmv_subu;
+    case op_mul: return tsmv_mul;
+    case op_mulu: return tsmv_mulu;
+    case op_div: return tsmv_div;
+    case op_divu: return tsmv_divu;
+    case op_inc: return tsmv_inc;
+    case op_dec: return tsmv_dec;
+    case op_and: return tsmv_and;
+    case op_or: return tsmv_or;
+    case op_xor: return tsmv_xor;
+    case op_shl: return tsmv_shl;
+    case op_shr: return tsmv_shr;
+    case op_jmp: return tsmv_jmp;
+    case op_je: return tsmv_je;
+    case op_jne: return tsmv_jne;
+    case op_jl: return tsmv_jl;
+    case op_call: return tsmv_call;
+    case op_ret: return tsmv_ret;
+    case op_push: return tsmv_push;
+    case op_pop: return tsmv_pop;
+    default: return tsmv_generic;
+  }
+}
+
+void tsmv_decode(smvm *vm) {
+  listmv_free(&vm->program);
+  listmv_init(&vm->program, sizeof(tsmv_inst));
+
+  for (u64 i = 0; i < vm->instructions.len; i++) {
+    asmv_inst *inst = listmv_at(&vm->instructions, i);
+    tsmv_inst decoded = {.source = inst};
+    decoded.op = tsmv_quicken(inst, tsmv_select(inst));
+
+    for (int j = 0; j < instruction_table[inst->code].num_ops; j++) {
+      asmv_operand *op = &inst->operands[j];
+      decoded.operands[j] = (tsmv_operand){
+          .data = op->data.num,
+          .reg = op->data.reg,
+          .width = 1 << op->width,
+          .mode = op->mode,
+      };
+    }
+    listmv_push(&vm->program, &decoded);
+  }
+
+  // jumps to a trailing label land here
+  listmv_push(&vm->program, &(tsmv_inst){.op = tsmv_end});
+
+  // the program won't move again, branches can point straight at their target
+  tsmv_inst *program = vm->program.data;
+  for (u64 i = 0; i < vm->instructions.len; i++) {
+    u64 label_index = program[i].source->label_index;
+    if (label_index <= vm->instructions.len)
+      program[i].target = program + label_index;
+  }
+  tsmv_fuse(vm);
+}
+
+static bool tsmv_same_reg(tsmv_inst *a, int i, tsmv_inst *b, int j) {
+  return a->operands[i].reg == b->operands[j].reg;
+}
+
+// rewrites the head of each matching sequence into a superinstruction,
+// every other slot is left alone
+void tsmv_fuse(smvm *vm) {
+  tsmv_inst *program = vm->program.data;
+  u64 len = vm->program.len - 1;  // without the sentinel
+
+  for (u64 i = 0; i + 1 < len; i++) {
+    tsmv_inst *first = &program[i], *second = &program[i + 1];
+    tsmv_inst *third = i + 2 < len ? &program[i + 2] : NULL;
+
+    if ((vm->fusions & fuse_dec_jnz) && first->op == tsmv_dec_r64 &&
+        second->op == tsmv_jne_r64_imm && tsmv_same_reg(first, 0, second, 0) &&
+        second->operands[1].data == 0) {
+      first->op = tsmv_dec_jnz;
+    } else if ((vm->fusions & fuse_inc_jne) && first->op == tsmv_inc_r64 &&
+               (second->op == tsmv_jne_r64_r64 ||
+                second->op == tsmv_jne_r64_imm) &&
+               tsmv_same_reg(first, 0, second, 0)) {
+      first->op = second->op == tsmv_jne_r64_r64 ? tsmv_inc_jne_r64
+                                                 : tsmv_inc_jne_imm;
+    } else if (first->op == tsmv_mov_r64_r64 &&
+               second->op == tsmv_add_r64_r64_r64) {
+      if ((vm->fusions & fuse_mov_add_mov) && third &&
+          third->op == tsmv_mov_r64_r64)
+        first->op = tsmv_mov_add_mov;
+      else if (vm->fusions & fuse_mov_add) first->op = tsmv_mov_add;
+    }
+  }
+}
+
+// same resolution as smvm_load_operands, minus the cache
+static inline i64 *tsmv_resolve(smvm *vm, i64 *regs, tsmv_operand *op,
+                                i64 *scratch) {
+  switch (op->mode) {
+    case mode_register: return &regs[op->reg];
+    case mode_immediate: *scratch = op->data; return scratch;
+    case mode_indirect: return (i64 *)msmv_at(&vm->memory, regs[op->reg]);
+    default: return (i64 *)msmv_at(&vm->memory, op->data);
+  }
+}
+
+void tsmv_execute(smvm *vm) {
+  static const void *handlers[tsmv_op_len] = {
+      [tsmv_end] = &&do_end,   [tsmv_generic] = &&do_generic,
+      [tsmv_halt] = &&do_halt, [tsmv_mov] = &&do_mov,
+      [tsmv_add] = &&do_add,   [tsmv_addu] = &&do_addu,
+      [tsmv_sub] = &&do_sub,   [tsmv_subu] = &&do_subu,
+      [tsmv_mul] = &&do_mul,   [tsmv_mulu] = &&do_mulu,
+      [tsmv_div] = &&do_div,   [tsmv_divu] = &&do_divu,
+      [tsmv_inc] = &&do_inc,   [tsmv_dec] = &&do_dec,
+      [tsmv_and] = &&do_and,   [tsmv_or] = &&do_or,
+      [tsmv_xor] = &&do_xor,   [tsmv_shl] = &&do_shl,
+      [tsmv_shr] = &&do_shr,   [tsmv_jmp] = &&do_jmp,
+      [tsmv_je] = &&do_je,     [tsmv_jne] = &&do_jne,
+      [tsmv_jl] = &&do_jl,     [tsmv_call] = &&do_call,
+      [tsmv_ret] = &&do_ret,   [tsmv_push] = &&do_push,
+      [tsmv_pop] = &&do_pop,
+      [tsmv_mov_r64_r64] = &&do_mov_r64_r64,
+      [tsmv_mov_r64_imm] = &&do_mov_r64_imm,
+      [tsmv_add_r64_r64_r64] = &&do_add_r64_r64_r64,
+      [tsmv_add_r64_r64_imm] = &&do_add_r64_r64_imm,
+      [tsmv_sub_r64_r64_r64] = &&do_sub_r64_r64_r64,
+      [tsmv_sub_r64_r64_imm] = &&do_sub_r64_r64_imm,
+      [tsmv_mul_r64_r64_r64] = &&do_mul_r64_r64_r64,
+      [tsmv_mul_r64_r64_imm] = &&do_mul_r64_r64_imm,
+      [tsmv_div_r64_r64_r64] = &&do_div_r64_r64_r64,
+      [tsmv_div_r64_r64_imm] = &&do_div_r64_r64_imm,
+      [tsmv_divu_r64_r64_r64] = &&do_divu_r64_r64_r64,
+      [tsmv_divu_r64_r64_imm] = &&do_divu_r64_r64_imm,
+      [tsmv_and_r64_r64_r64] = &&do_and_r64_r64_r64,
+      [tsmv_and_r64_r64_imm] = &&do_and_r64_r64_imm,
+      [tsmv_or_r64_r64_r64] = &&do_or_r64_r64_r64,
+      [tsmv_or_r64_r64_imm] = &&do_or_r64_r64_imm,
+      [tsmv_xor_r64_r64_r64] = &&do_xor_r64_r64_r64,
+      [tsmv_xor_r64_r64_imm] = &&do_xor_r64_r64_imm,
+      [tsmv_shl_r64_r64_r64] = &&do_shl_r64_r64_r64,
+      [tsmv_shl_r64_r64_imm] = &&do_shl_r64_r64_imm,
+      [tsmv_shr_r64_r64_r64] = &&do_shr_r64_r64_r64,
+      [tsmv_shr_r64_r64_imm] = &&do_shr_r64_r64_imm,
+      [tsmv_inc_r64] = &&do_inc_r64,
+      [tsmv_dec_r64] = &&do_dec_r64,
+      [tsmv_je_r64_r64] = &&do_je_r64_r64,
+      [tsmv_je_r64_imm] = &&do_je_r64_imm,
+      [tsmv_jne_r64_r64] = &&do_jne_r64_r64,
+      [tsmv_jne_r64_imm] = &&do_jne_r64_imm,
+      [tsmv_jl_r64_r64] = &&do_jl_r64_r64,
+      [tsmv_jl_r64_imm] = &&do_jl_r64_imm,
+      [tsmv_dec_jnz] = &&do_dec_jnz,
+      [tsmv_inc_jne_r64] = &&do_inc_jne_r64,
+      [tsmv_inc_jne_imm] = &&do_inc_jne_imm,
+      [tsmv_mov_add] = &&do_mov_add,
+      [tsmv_mov_add_mov] = &&do_mov_add_mov,
+  };
+
+  if (vm->program.len == 0) tsmv_decode(vm);
+
+  tsmv_inst *program = vm->program.data;
+  if (program[0].handler == NULL)
+    for (u64 i = 0; i < vm->program.len; i++)
+      program[i].handler = handlers[program[i].op];
+
+  // the vm's own ip lives here and is only written back to reg_ip when a
+  // generic handler or the caller needs to see it
+  i64 *regs = vm->registers;
+  u64 len = vm->program.len - 1;  // the sentinel once ip is past the rest
+  tsmv_inst *pc = program + (regs[reg_ip] < len ? regs[reg_ip] : len);
+  i64 scratch[3];
+  u64 executed = 0, quickened = 0;
+  u64 fused[smvm_fusion_num] = {0};
+
+#define tsmv_operand_ptr(_n) \
+  tsmv_resolve(vm, regs, &pc->operands[_n], &scratch[_n])
+#define tsmv_width(_n) (pc->operands[_n].width)
+#define tsmv_dispatch() \
+  do {                  \
+    executed++;         \
+    goto *pc->handler;  \
+  } while (0)
+#define tsmv_flush()                            \
+  do {                                          \
+    vm->stats.executed += executed;             \
+    vm->stats.quickened += quickened;           \
+    for (int i = 0; i < smvm_fusion_num; i++) { \
+      vm->stats.fused[i] += fused[i];           \
+      fused[i] = 0;                             \
+    }                                           \
+    executed = quickened = 0;                   \
+  } while (0)
+#define tsmv_exit() \
+  do {              \
+    tsmv_flush();   \
+    return;         \
+  } while (0)
+// a taken branch at pc, see smvm_fuel_unlimited
+#define tsmv_charge()                                                     \
+  if (vm->fuel != smvm_fuel_unlimited && vm->fuel-- == 0) {               \
+    vm->fuel = 0;                                                         \
+    regs[reg_ip] = pc - program;                                          \
+    vm->result = (smvm_result){status_out_of_fuel, trap_none, pc - program}; \
+    smvm_set_flag(vm, flag_t);                                            \
+    tsmv_exit();                                                          \
+  }
+#define tsmv_next() \
+  do {              \
+    pc++;           \
+    tsmv_dispatch(); \
+  } while (0)
+#define tsmv_jump()                        \
+  do {                                     \
+    tsmv_charge();                         \
+    regs[reg_bp] = pc->operands[2].data;   \
+    pc = pc->target;                       \
+    tsmv_dispatch();                       \
+  } while (0)
+#define tsmv_binary(_type, _op)                                   \
+  {                                                               \
+    i64 *dest = tsmv_operand_ptr(0);                              \
+    i64 *left = tsmv_operand_ptr(1);                              \
+    i64 *right = tsmv_operand_ptr(2);                             \
+    _type result = *(_type *)left _op * (_type *)right;           \
+    mov_mem((u8 *)dest, (u8 *)&result, tsmv_width(0));            \
+    tsmv_next();                                                  \
+  }
+#define tsmv_unary(_op)                                  \
+  {                                                      \
+    i64 *dest = tsmv_operand_ptr(0);                     \
+    u64 result = *dest _op 1;                            \
+    mov_mem((u8 *)dest, (u8 *)&result, tsmv_width(0));   \
+    tsmv_next();                                         \
+  }
+#define tsmv_compare_widths(_left, _right)                          \
+  i64 _left = 0, _right = 0;                                        \
+  mov_mem((u8 *)&_left, (u8 *)tsmv_operand_ptr(0), tsmv_width(0));  \
+  mov_mem((u8 *)&_right, (u8 *)tsmv_operand_ptr(1), tsmv_width(1));
+
+  tsmv_dispatch();
+
+do_end:
+  executed--;  // the sentinel is not an instruction
+  regs[reg_ip] = pc - program;
+  tsmv_exit();
+do_halt:
+  regs[reg_ip] = pc - program;
+  vm->result = (smvm_result){status_halted, trap_none, pc - program};
+  smvm_set_flag(vm, flag_t);
+  tsmv_exit();
+do_generic:
+  // the handler may leave through smvm_raise, stats go out first
+  tsmv_flush();
+  regs[reg_ip] = pc - program;
+  smvm_load_operands(vm, pc - program);
+  instruction_table[pc->source->code].fn(vm);
+  pc = program + regs[reg_ip] + 1;
+  tsmv_dispatch();
+
+do_mov: {
+  i64 *dest = tsmv_operand_ptr(0);
+  i64 *src = tsmv_operand_ptr(1);
+  mov_mem((u8 *)dest, (u8 *)src, tsmv_width(0));
+  tsmv_next();
+}
+do_add: tsmv_binary(i64, +);
+do_addu: tsmv_binary(u64, +);
+do_sub: tsmv_binary(i64, -);
+do_subu: tsmv_binary(u64, -);
+do_mul: tsmv_binary(i64, *);
+do_mulu: tsmv_binary(u64, *);
+do_div: tsmv_binary(i64, /);
+do_divu: tsmv_binary(u64, /);
+do_inc: tsmv_unary(+);
+do_dec: tsmv_unary(-);
+do_and: tsmv_binary(i64, &);
+do_or: tsmv_binary(i64, |);
+do_xor: tsmv_binary(i64, ^);
+do_shl: tsmv_binary(i64, <<);
+do_shr: tsmv_binary(i64, >>);
+
+do_jmp:
+  tsmv_charge();
+  regs[reg_bp] = pc->operands[0].data;
+  pc = pc->target;
+  tsmv_dispatch();
+do_je: {
+  i64 *left = tsmv_operand_ptr(0);
+  i64 *right = tsmv_operand_ptr(1);
+  if (*left != *right) tsmv_next();
+  tsmv_jump();
+}
+do_jne: {
+  tsmv_compare_widths(left, right);
+  if (left == right) tsmv_next();
+  tsmv_jump();
+}
+do_jl: {
+  tsmv_compare_widths(left, right);
+  if (left < right) tsmv_next();
+  tsmv_jump();
+}
+do_call:
+  tsmv_charge();
+  regs[reg_ip] = pc - program;  // for a stack overflow trap
+  smvm_push_frame(vm, pc - program, pc->source->index);
+  regs[reg_bp] = pc->operands[0].data;
+  pc = pc->target;
+  tsmv_dispatch();
+do_ret:
+  regs[reg_ip] = pc - program;  // for a stack underflow trap
+  pc = program + smvm_pop_frame(vm);
+  tsmv_dispatch();
+do_push:
+  smvm_push(vm, (u8 *)tsmv_operand_ptr(0), tsmv_width(0));
+  tsmv_next();
+do_pop: {
+  i64 *dest = tsmv_operand_ptr(0);
+  u8 *data = smvm_pop(vm, tsmv_width(0));
+  mov_mem((u8 *)dest, data, tsmv_width(0));
+  tsmv_next();
+}
+
+#define tsmv_reg(_n) regs[pc->operands[_n].reg]
+#define tsmv_imm(_n) pc->operands[_n].data
+#define tsmv_quick(_stmt) \
+  {                       \
+    quickened++;          \
+    _stmt;                \
+    tsmv_next();          \
+  }
+#define tsmv_quick_branch(_cond) \
+  {                              \
+    quickened++;                 \
+    if (!(_cond)) tsmv_next();   \
+    tsmv_jump();                 \
+  }
+// wraps like the 64-bit mov_mem store in functions.c does
+#define tsmv_wrap(_left, _op, _right) (i64)((u64)(_left)_op(u64)(_right))
+
+do_mov_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_reg(1));
+do_mov_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_imm(1));
+do_add_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(1), +, tsmv_reg(2)));
+do_add_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(1), +, tsmv_imm(2)));
+do_sub_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(1), -, tsmv_reg(2)));
+do_sub_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(1), -, tsmv_imm(2)));
+do_mul_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(1), *, tsmv_reg(2)));
+do_mul_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(1), *, tsmv_imm(2)));
+do_div_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) / tsmv_reg(2));
+do_div_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) / tsmv_imm(2));
+do_divu_r64_r64_r64: tsmv_quick(tsmv_reg(0) = (u64)tsmv_reg(1) / (u64)tsmv_reg(2));
+do_divu_r64_r64_imm: tsmv_quick(tsmv_reg(0) = (u64)tsmv_reg(1) / (u64)tsmv_imm(2));
+do_and_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) & tsmv_reg(2));
+do_and_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) & tsmv_imm(2));
+do_or_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) | tsmv_reg(2));
+do_or_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) | tsmv_imm(2));
+do_xor_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) ^ tsmv_reg(2));
+do_xor_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) ^ tsmv_imm(2));
+do_shl_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) << tsmv_reg(2));
+do_shl_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) << tsmv_imm(2));
+do_shr_r64_r64_r64: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) >> tsmv_reg(2));
+do_shr_r64_r64_imm: tsmv_quick(tsmv_reg(0) = tsmv_reg(1) >> tsmv_imm(2));
+do_inc_r64: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(0), +, 1));
+do_dec_r64: tsmv_quick(tsmv_reg(0) = tsmv_wrap(tsmv_reg(0), -, 1));
+do_je_r64_r64: tsmv_quick_branch(tsmv_reg(0) == tsmv_reg(1));
+do_je_r64_imm: tsmv_quick_branch(tsmv_reg(0) == tsmv_imm(1));
+do_jne_r64_r64: tsmv_quick_branch(tsmv_reg(0) != tsmv_reg(1));
+do_jne_r64_imm: tsmv_quick_branch(tsmv_reg(0) != tsmv_imm(1));
+do_jl_r64_r64: tsmv_quick_branch(!(tsmv_reg(0) < tsmv_reg(1)));
+do_jl_r64_imm: tsmv_quick_branch(!(tsmv_reg(0) < tsmv_imm(1)));
+
+// superinstructions, _n more instructions retired than were dispatched
+#define tsmv_fused(_bit, _n) \
+  executed += _n;            \
+  quickened += _n + 1;       \
+  fused[_bit]++;
+// the branch half of a fused pair, at pc + 1
+#define tsmv_fused_branch(_cond)                     \
+  {                                                  \
+    tsmv_inst *branch = pc + 1;                      \
+    if (!(_cond)) {                                  \
+      pc += 2;                                       \
+      tsmv_dispatch();                               \
+    }                                                \
+    pc = branch;                                     \
+    tsmv_charge();                                   \
+    regs[reg_bp] = branch->operands[2].data;         \
+    pc = branch->target;                             \
+    tsmv_dispatch();                                 \
+  }
+#define tsmv_reg_at(_inst, _n) regs[(_inst)->operands[_n].reg]
+
+do_dec_jnz:
+  tsmv_fused(0, 1);
+  tsmv_reg(0) = tsmv_wrap(tsmv_reg(0), -, 1);
+  tsmv_fused_branch(tsmv_reg(0) != 0);
+do_inc_jne_r64:
+  tsmv_fused(1, 1);
+  tsmv_reg(0) = tsmv_wrap(tsmv_reg(0), +, 1);
+  tsmv_fused_branch(tsmv_reg(0) != tsmv_reg_at(branch, 1));
+do_inc_jne_imm:
+  tsmv_fused(1, 1);
+  tsmv_reg(0) = tsmv_wrap(tsmv_reg(0), +, 1);
+  tsmv_fused_branch(tsmv_reg(0) != branch->operands[1].data);
+do_mov_add: {
+  tsmv_fused(2, 1);
+  tsmv_inst *add = pc + 1;
+  tsmv_reg(0) = tsmv_reg(1);
+  tsmv_reg_at(add, 0) =
+      tsmv_wrap(tsmv_reg_at(add, 1), +, tsmv_reg_at(add, 2));
+  pc += 2;
+  tsmv_dispatch();
+}
+do_mov_add_mov: {
+  tsmv_fused(3, 2);
+  tsmv_inst *add = pc + 1, *mov = pc + 2;
+  tsmv_reg(0) = tsmv_reg(1);
+  tsmv_reg_at(add, 0) =
+      tsmv_wrap(tsmv_reg_at(add, 1), +, tsmv_reg_at(add, 2));
+  tsmv_reg_at(mov, 0) = tsmv_reg_at(mov, 1);
+  pc += 3;
+  tsmv_dispatch();
+}
+
+#undef tsmv_fused
+#undef tsmv_fused_branch
+#undef tsmv_reg_at
+#undef tsmv_reg
+#undef tsmv_imm
+#undef tsmv_quick
+#undef tsmv_quick_branch
+#undef tsmv_wrap
+#undef tsmv_operand_ptr
+#undef tsmv_width
+#undef tsmv_dispatch
+#undef tsmv_exit
+#undef tsmv_flush
+#undef tsmv_charge
+#undef tsmv_next
+#undef tsmv_jump
+#undef tsmv_binary
+#undef tsmv_unary
+#undef tsmv_compare_widths
+}
+
+void tsmv_print_stats(smvm *vm, FILE *out) {
+  u64 executed = vm->stats.executed;
+  fprintf(out, "executed:  %lu\n", executed);
+  fprintf(out, "quickened: %lu (%.1f%%)\n", vm->stats.quickened,
+          executed ? 100.0 * vm->stats.quickened / executed : 0.0);
+
+  static const char *fusion_names[smvm_fusion_num] = {
+      "dec_jnz", "inc_jne", "mov_add", "mov_add_mov"};
+  for (int i = 0; i < smvm_fusion_num; i++) {
+    if (vm->stats.fused[i] == 0) continue;
+    fprintf(out, "fused %-11s %lu\n", fusion_names[i], vm->stats.fused[i]);
+  }
+}
@@ -0,0 +1,107 @@
+#ifndef smv_smvm_tsmv_h
+#define smv_smvm_tsmv_h
+
+#include "asmv.h"
+#include "smvm.h"
+#include "util.h"
+
+// tsmv - the threaded engine
+// vm->instructions gets decoded once into a flat stream of tsmv_inst, each one
+// carrying the address of its handler. dispatch is a computed goto straight
+// into the next handler, no listmv_at, no instruction_table lookup and no
+// indirect call for the common instructions. everything else falls back to
+// the instruction_table handlers through vm->cache.
+
+typedef enum tsmv_op : u8 {
+  tsmv_end = 0,  // sentinel after the last instruction
+  tsmv_generic,  // goes through instruction_table
+  tsmv_halt,
+  tsmv_mov,
+  tsmv_add,
+  tsmv_addu,
+  tsmv_sub,
+  tsmv_subu,
+  tsmv_mul,
+  tsmv_mulu,
+  tsmv_div,
+  tsmv_divu,
+  tsmv_inc,
+  tsmv_dec,
+  tsmv_and,
+  tsmv_or,
+  tsmv_xor,
+  tsmv_shl,
+  tsmv_shr,
+  tsmv_jmp,
+  tsmv_je,
+  tsmv_jne,
+  tsmv_jl,
+  tsmv_call,
+  tsmv_ret,
+  tsmv_push,
+  tsmv_pop,
+  // quickened variants, picked at decode time when every operand is a full
+  // 64-bit register (r64) or an immediate (imm). these skip tsmv_resolve
+  // and mov_mem entirely
+  tsmv_mov_r64_r64,
+  tsmv_mov_r64_imm,
+  tsmv_add_r64_r64_r64,
+  tsmv_add_r64_r64_imm,
+  tsmv_sub_r64_r64_r64,
+  tsmv_sub_r64_r64_imm,
+  tsmv_mul_r64_r64_r64,
+  tsmv_mul_r64_r64_imm,
+  tsmv_div_r64_r64_r64,
+  tsmv_div_r64_r64_imm,
+  tsmv_divu_r64_r64_r64,
+  tsmv_divu_r64_r64_imm,
+  tsmv_and_r64_r64_r64,
+  tsmv_and_r64_r64_imm,
+  tsmv_or_r64_r64_r64,
+  tsmv_or_r64_r64_imm,
+  tsmv_xor_r64_r64_r64,
+  tsmv_xor_r64_r64_imm,
+  tsmv_shl_r64_r64_r64,
+  tsmv_shl_r64_r64_imm,
+  tsmv_shr_r64_r64_r64,
+  tsmv_shr_r64_r64_imm,
+  tsmv_inc_r64,
+  tsmv_dec_r64,
+  tsmv_je_r64_r64,
+  tsmv_je_r64_imm,
+  tsmv_jne_r64_r64,
+  tsmv_jne_r64_imm,
+  tsmv_jl_r64_r64,
+  tsmv_jl_r64_imm,
+  // superinstructions, see smvm_fusion. the slots they cover stay decoded
+  // as usual so jumps into the middle of one still work
+  tsmv_dec_jnz,
+  tsmv_inc_jne_r64,
+  tsmv_inc_jne_imm,
+  tsmv_mov_add,
+  tsmv_mov_add_mov,
+  tsmv_op_len,
+} tsmv_op;
+
+typedef struct tsmv_operand {
+  i64 data;  // immediate or direct address
+  u8 reg;
+  u8 width;  // in bytes, unlike asmv_operand
+  smvm_mode mode : 2;
+} tsmv_operand;
+
+typedef struct tsmv_inst {
+  const void *handler;  // filled in on the first run
+  asmv_inst *source;    // for the generic fallback
+  tsmv_inst *target;    // branches and calls, linked after decoding
+  tsmv_operand operands[3];
+  tsmv_op op;
+} tsmv_inst;
+
+void tsmv_decode(smvm *vm);
+void tsmv_fuse(smvm *vm);
+// from the instruction at reg_ip on
+void tsmv_execute(smvm *vm);
+void tsmv_print_stats(smvm *vm, FILE *out);
+
+#endif
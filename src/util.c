@@ -1,34 +1,115 @@
 #include "util.h"
 
+/* arenamv */
+
+struct arenamv_chunk {
+  arenamv_chunk *next;
+  u64 used;
+  u64 cap;
+  u64 data[];
+};
+
+void arenamv_init(arenamv *arena) { arena->chunks = NULL; }
+
+void *arenamv_alloc(arenamv *arena, u64 size) {
+  size = (size + 7) & ~7ull;
+  arenamv_chunk *chunk = arena->chunks;
+  if (chunk == NULL || chunk->cap - chunk->used < size) {
+    u64 cap = size > arenamv_chunk_size ? size : arenamv_chunk_size;
+    chunk = malloc(sizeof(arenamv_chunk) + cap);
+    if (chunk == NULL) {
+      fprintf(stderr, "Memory allocation failed in growing an arena.\n");
+      exit(1);
+    }
+    *chunk = (arenamv_chunk){.cap = cap};
+    // a chunk for one big block goes behind the one with room left
+    if (arena->chunks && size > arenamv_chunk_size) {
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+    } else {
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+    }
+  }
+  void *ptr = (u8 *)chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+void *arenamv_resize(arenamv *arena, void *ptr, u64 old, u64 size) {
+  arenamv_chunk *chunk = arena->chunks;
+  old = (old + 7) & ~7ull;
+  if (ptr && chunk && (u8 *)ptr + old == (u8 *)chunk->data + chunk->used &&
+      size <= old + (chunk->cap - chunk->used)) {
+    chunk->used += ((size + 7) & ~7ull) - old;
+    return ptr;
+  }
+  void *moved = arenamv_alloc(arena, size);
+  if (ptr) memcpy(moved, ptr, old < size ? old : size);
+  return moved;
+}
+
+void arenamv_free(arenamv *arena) {
+  while (arena->chunks) {
+    arenamv_chunk *next = arena->chunks->next;
+    free(arena->chunks);
+    arena->chunks = next;
+  }
+}
+
 /* listmv */
 
-void listmv_init(listmv *ls, long size) {
+void listmv_init(listmv *ls, long size) { listmv_init_arena(ls, size, NULL); }
+
+void listmv_init_arena(listmv *ls, long size, arenamv *arena) {
+  ls->data = NULL;
   ls->len = 0;
-  ls->cap = 1;
+  ls->cap = 0;
   ls->size = size;
-  ls->data = calloc(ls->cap, size);
+  ls->arena = arena;
 }
 
-void listmv_push(listmv *ls, void *data) {
-  if (ls->len >= ls->cap) { ls->cap *= 2; }
-  ls->data = realloc(ls->data, ls->cap * ls->size);
-  if (ls->data == NULL) {
-    fprintf(stderr, "Memory reallocation failed in growing memory/stack.\n");
-    exit(1);
+void listmv_grow(listmv *ls, u64 new_cap) {
+  if (new_cap <= ls->cap) return;
+  if (ls->arena) {
+    ls->data = arenamv_resize(ls->arena, ls->data, ls->cap * ls->size,
+                              new_cap * ls->size);
+  } else {
+    ls->data = realloc(ls->data, new_cap * ls->size);
+    if (ls->data == NULL) {
+      fprintf(stderr, "Memory reallocation failed in growing memory/stack.\n");
+      exit(1);
+    }
   }
+  ls->cap = new_cap;
+}
+
+void listmv_reserve(listmv *ls, u64 num) {
+  if (ls->len + num <= ls->cap) return;
+  u64 cap = ls->cap ? ls->cap * 2 : 4;
+  listmv_grow(ls, ls->len + num > cap ? ls->len + num : cap);
+}
+
+void listmv_shrink(listmv *ls) {
+  if (ls->len == ls->cap || ls->arena) return;
+  if (ls->len == 0) {
+    free(ls->data);
+    ls->data = NULL;
+  } else {
+    ls->data = realloc(ls->data, ls->len * ls->size);
+  }
+  ls->cap = ls->len;
+}
+
+void listmv_push(listmv *ls, void *data) {
+  if (ls->len == ls->cap) listmv_reserve(ls, 1);
   memcpy((char *)ls->data + ls->len * ls->size, data, ls->size);
   ls->len++;
 }
 
 void listmv_push_array(listmv *ls, void *data, size_t num) {
-  while (ls->len + num >= ls->cap) {
-    ls->cap *= 2;
-    ls->data = realloc((char *)ls->data, ls->cap * ls->size);
-    if (ls->data == NULL) {
-      fprintf(stderr, "Memory reallocation failed in growing memory/stack.\n");
-      exit(1);
-    }
-  }
+  if (num == 0) return;
+  listmv_reserve(ls, num);
   mov_mem((u8 *)ls->data + ls->len * ls->size, (u8 *)data, num * ls->size);
   ls->len += num;
 }
@@ -45,22 +126,14 @@ void *listmv_pop_array(listmv *ls, u64 num) {
   return (char *)ls->data + ls->len * ls->size;
 }
 
-void listmv_grow(listmv *ls, u64 new_cap) {
-  if (new_cap <= ls->cap) return;
-  ls->cap = new_cap;
-  ls->data = realloc(ls->data, ls->cap * ls->size);
-  if (ls->data == NULL) {
-    fprintf(stderr, "Memory reallocation failed in growing memory/stack.\n");
-    exit(1);
-  }
-}
-
 void *listmv_at(listmv *ls, u64 index) {
   return (char *)ls->data + index * ls->size;
 }
 
 void listmv_free(listmv *ls) {
-  free(ls->data);
+  if (ls->arena == NULL) free(ls->data);
+  ls->data = NULL;
+  ls->len = 0;
   ls->cap = 0;
 }
 
@@ -20,22 +20,51 @@ typedef double f64;
 typedef float f32;
 
 /*** util ***/
+// arenamv - memory handed out from big chunks and freed all at once, for
+// things that all go away together
+typedef struct arenamv_chunk arenamv_chunk;
+typedef struct arenamv {
+  arenamv_chunk *chunks;  // the one handing out memory first
+} arenamv;
+
+#define arenamv_chunk_size (64 * 1024)
+
+void arenamv_init(arenamv *arena);
+// 8 byte aligned, never NULL
+void *arenamv_alloc(arenamv *arena, u64 size);
+// ptr's old bytes in a block of size, grown in place when ptr was the last
+// thing handed out
+void *arenamv_resize(arenamv *arena, void *ptr, u64 old, u64 size);
+void arenamv_free(arenamv *arena);
+
+// listmv - a growable array. nothing is allocated until the first push and
+// capacity at least doubles when it runs out, so pushes are amortized O(1).
+// a list with an arena takes its memory from there and listmv_free leaves
+// it to arenamv_free
 typedef struct listmv {
   void *data;
   u64 len;
   u64 cap;
   long size;
+  arenamv *arena;  // NULL for malloc
 } listmv;
 
 #define listmv(_type) listmv
 
 void listmv_init(listmv *ls, long size);
+void listmv_init_arena(listmv *ls, long size, arenamv *arena);
 void listmv_push(listmv *ls, void *data);
 void listmv_push_array(listmv *ls, void *data, size_t num);
 void *listmv_pop(listmv *ls);
 void *listmv_pop_array(listmv *ls, u64 num);
+// room for num more entries, so that many pushes never reallocate
+void listmv_reserve(listmv *ls, u64 num);
+// capacity of exactly new_cap, when it's more than now
 void listmv_grow(listmv *ls, u64 new_cap);
+// capacity down to len
+void listmv_shrink(listmv *ls);
 void *listmv_at(listmv *ls, u64 index);
+// empty again, ready for pushes
 void listmv_free(listmv *ls);
 i64 parse_signed(u64 unum, u8 width);
 // just a helper for better debugging
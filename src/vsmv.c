@@ -0,0 +1,184 @@
+#include "vsmv.h"
+
+#include "asmv.h"
+#include "smvm.h"
+
+#define vsmv_unseen ((u64)-1)
+
+// where the stack walk still has to go, main is false inside a call
+typedef struct vsmv_state {
+  u64 index;
+  u64 depth;  // bytes pushed since the function was entered
+  bool main;
+} vsmv_state;
+
+// the operand a jump or call goes through, -1 for anything else
+static int vsmv_target_operand(smvm_opcode code) {
+  switch (code) {
+    case op_jmp:
+    case op_call: return 0;
+    case op_je:
+    case op_jne:
+    case op_jl: return 2;
+    default: return -1;
+  }
+}
+
+// how many of the leading operands the handler writes to
+static int vsmv_written(smvm_opcode code) {
+  switch (code) {
+    case op_swap:
+    case op_cas:
+    case op_xadd: return 2;
+    case op_jmp:
+    case op_je:
+    case op_jne:
+    case op_jl:
+    case op_loop:
+    case op_call:
+    case op_push:
+    case op_extern:
+    case op_scall:
+    case op_puti:
+    case op_putu:
+    case op_putf:
+    case op_puts:
+    case op_free: return 0;
+    default: return instruction_table[code].num_ops ? 1 : 0;
+  }
+}
+
+static vsmv_error vsmv_check_inst(smvm *vm, asmv_inst *inst) {
+  if (inst->code >= instruction_table_len || !instruction_table[inst->code].fn ||
+      inst->error != asmv_all_ok)
+    return verify_opcode;
+
+  int target = vsmv_target_operand(inst->code);
+  for (int i = 0; i < instruction_table[inst->code].num_ops; i++) {
+    asmv_operand *op = &inst->operands[i];
+    if ((op->data.type == asmv_str_type) !=
+        (inst->code == op_puts || inst->code == op_extern))
+      return verify_operand;
+    if (op->data.type == asmv_str_type) continue;
+
+    if (i == target) {
+      u64 len = vm->instructions.len;
+      if (op->mode != mode_immediate || inst->label_index > len)
+        return verify_target;
+      u64 addr = inst->label_index == len
+                     ? vm->bytecode.len
+                     : ((asmv_inst *)listmv_at(&vm->instructions,
+                                               inst->label_index))
+                           ->index;
+      if (op->data.unum != addr) return verify_target;
+    }
+
+    switch (op->mode) {
+      case mode_immediate:
+        if (min_space_neededu(op->data.unum) > op->width)
+          return verify_width;
+        break;
+      case mode_direct:
+        if (op->data.unum > vm->memory.size - (1 << op->width))
+          return verify_address;
+        break;
+      case mode_register:
+        if (i < vsmv_written(inst->code) &&
+            (op->data.reg == reg_ip || op->data.reg == reg_bp))
+          return verify_control;
+        break;
+      default: break;
+    }
+  }
+  return verify_ok;
+}
+
+static void vsmv_visit(listmv(vsmv_state) *work, u64 index, u64 depth,
+                       bool main) {
+  listmv_push(work, &(vsmv_state){index, depth, main});
+}
+
+// walks every path once, keeping the stack depth at each instruction
+static vsmv_result vsmv_check_stack(smvm *vm) {
+  u64 len = vm->instructions.len;
+  u64 *depths = malloc((len + 1) * sizeof(u64));
+  bool *mains = calloc(len + 1, sizeof(bool));
+  for (u64 i = 0; i <= len; i++) depths[i] = vsmv_unseen;
+
+  listmv(vsmv_state) work;
+  listmv_init(&work, sizeof(vsmv_state));
+  vsmv_visit(&work, 0, 0, true);
+
+  vsmv_result result = {verify_ok, 0};
+  vsmv_state *next;
+  while (result.error == verify_ok && (next = listmv_pop(&work))) {
+    vsmv_state state = *next;
+    u64 i = state.index;
+    if (i >= len) continue;  // ran off the end, that's a halt
+
+    if (depths[i] != vsmv_unseen) {
+      if (depths[i] != state.depth) {
+        result = (vsmv_result){verify_stack, i};
+        break;
+      }
+      // seen at this depth already, only going from a call to main is new
+      if (mains[i] || !state.main) continue;
+    }
+    depths[i] = state.depth;
+    mains[i] |= state.main;
+
+    asmv_inst *inst = listmv_at(&vm->instructions, i);
+    u64 width = 1 << inst->operands[0].width;
+    switch (inst->code) {
+      case op_halt: break;
+      case op_ret:
+        if (state.main || state.depth != 0)
+          result = (vsmv_result){verify_stack, i};
+        break;
+      case op_jmp:
+        vsmv_visit(&work, inst->label_index, state.depth, state.main);
+        break;
+      case op_je:
+      case op_jne:
+      case op_jl:
+        vsmv_visit(&work, inst->label_index, state.depth, state.main);
+        vsmv_visit(&work, i + 1, state.depth, state.main);
+        break;
+      case op_call:
+        // the callee comes back at the depth it was called at
+        vsmv_visit(&work, inst->label_index, 0, false);
+        vsmv_visit(&work, i + 1, state.depth, state.main);
+        break;
+      case op_loop: vsmv_visit(&work, i + 1, state.depth + 8, state.main); break;
+      case op_push:
+        vsmv_visit(&work, i + 1, state.depth + width, state.main);
+        break;
+      case op_pop:
+        if (state.depth < width) result = (vsmv_result){verify_stack, i};
+        else vsmv_visit(&work, i + 1, state.depth - width, state.main);
+        break;
+      default: vsmv_visit(&work, i + 1, state.depth, state.main); break;
+    }
+  }
+
+  listmv_free(&work);
+  free(depths);
+  free(mains);
+  return result;
+}
+
+vsmv_result vsmv_verify(smvm *vm) {
+  vm->verified.ok = false;
+
+  for (u64 i = 0; i < vm->instructions.len; i++) {
+    asmv_inst *inst = listmv_at(&vm->instructions, i);
+    vsmv_error error = vsmv_check_inst(vm, inst);
+    if (error != verify_ok) return (vsmv_result){error, i};
+  }
+
+  vsmv_result result = vsmv_check_stack(vm);
+  if (result.error != verify_ok) return result;
+
+  vm->verified.ok = true;
+  return result;
+}
@@ -0,0 +1,46 @@
+#ifndef smv_smvm_vsmv_h
+#define smv_smvm_vsmv_h
+
+#include "smvm.h"
+#include "util.h"
+
+// vsmv - the bytecode verifier
+// runs once over vm->instructions whenever a program is assembled or loaded,
+// and proves what the loop engine would otherwise have to check at run time:
+//   - every opcode is in instruction_table, strings only go to puts/extern
+//   - jump and call targets are immediates that land on an instruction, or
+//     right past the last one, and agree with their bytecode address
+//   - immediates fit in their operand width
+//   - nothing writes ip or bp, so control flow is what the branches say
+//   - the stack is as deep at an instruction on every path leading there,
+//     pop never takes more than was pushed since the function was entered,
+//     ret is back at that depth and never runs outside a call
+//   - direct addresses fit in vm->memory without wrapping around
+// indirect addresses are only known at run time, an access through one that
+// runs off the end of vm->memory hits its guard and traps with trap_bounds
+// (see msmv.h), verified or not.
+// natives are trusted to leave the stack the way they found it.
+// verified programs run on the loop engine without those checks, see
+// smvm_execute, anything else still runs, checked like before.
+
+typedef enum vsmv_error : u8 {
+  verify_ok = 0,
+  verify_opcode = 1,   // not in instruction_table, or the assembler failed
+  verify_operand = 2,  // a string where there shouldn't be one
+  verify_target = 3,   // jump or call to somewhere that's not an instruction
+  verify_width = 4,    // immediate wider than its operand
+  verify_control = 5,  // writes ip or bp
+  verify_stack = 6,    // depth differs between paths, underflows or ret
+                       // outside a call
+  verify_address = 7,  // direct address past the end of vm->memory
+} vsmv_error;
+
+typedef struct vsmv_result {
+  vsmv_error error;
+  u64 index;  // instruction it failed at
+} vsmv_result;
+
+// also fills in vm->verified
+vsmv_result vsmv_verify(smvm *vm);
+
+#endif
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <time.h>
+
+#include "asmv.h"
+#include "bsmv.h"
+#include "smvm.h"
+#include "tsmv.h"
+#include "util.h"
+
+typedef struct bench_case {
+  const char* name;
+  const char* code;
+} bench_case;
+
+static const bench_case bench_cases[] = {
+    {"fibonacci",
+     "mov ra 0\n"
+     "mov rb 1\n"
+     "mov rc 2000000\n"
+     ".loop\n"
+     "mov rd rb\n"
+     "add rb ra rb\n"
+     "mov ra rd\n"
+     "dec rc\n"
+     "jne rc 0 .loop\n"
+     "halt"},
+    {"nested",
+     "mov ra 2000\n"
+     ".outer\n"
+     "mov rb 1000\n"
+     ".inner\n"
+     "add rc rc rb\n"
+     "dec rb\n"
+     "jne rb 0 .inner\n"
+     "dec ra\n"
+     "jne ra 0 .outer\n"
+     "halt"},
+    {"calls",
+     "mov rc 500000\n"
+     ".loop\n"
+     "call .body\n"
+     "dec rc\n"
+     "jne rc 0 .loop\n"
+     "halt\n"
+     ".body\n"
+     "inc ra\n"
+     "ret"},
+    {"recursion",
+     "mov ra 22\n"
+     "call .fib\n"
+     "halt\n"
+     ".fib\n"
+     "jl ra 2 .recurse\n"
+     "mov rb ra\n"
+     "ret\n"
+     ".recurse\n"
+     "dec ra\n"
+     "call .fib\n"
+     "push rb\n"
+     "dec ra\n"
+     "call .fib\n"
+     "pop rc\n"
+     "add rb rb rc\n"
+     "add ra ra 2\n"
+     "ret"},
+};
+
+static const char* engine_names[] = {
+    [engine_loop] = "loop",
+    [engine_threaded] = "threaded",
+    [engine_jit] = "jit",
+    [engine_tracing] = "tracing",
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double run(const bench_case* bench, smvm_engine engine,
+                  struct stats* stats, double* packed) {
+  smvm vm;
+  smvm_init(&vm);
+  vm.engine = engine;
+  smvm_assemble(&vm, (char*)bench->code);
+
+  double start = now();
+  smvm_execute(&vm);
+  double elapsed = now() - start;
+
+  // bytes per instruction the interpreter walks, side tables included
+  smvm_packed* p = &vm.packed;
+  *packed = (double)(p->len * (1 + sizeof(*p->operands) + sizeof(u32)) +
+                     p->immediates.len * sizeof(u64) + vm.stringpool.len) /
+            p->len;
+
+  *stats = vm.stats;
+  smvm_free(&vm);
+  return elapsed;
+}
+
+// the same program over many inputs, one vm per input against one batch
+#define batch_lanes (4096)
+static const char* batch_code =
+    "mov rb 0\n"
+    ".loop\n"
+    "add rb rb ra\n"
+    "xor rb rb rc\n"
+    "dec rc\n"
+    "jne rc 0 .loop\n"
+    "halt";
+
+static void bench_batch(void) {
+  smvm vm;
+  smvm_init(&vm);
+  smvm_assemble(&vm, (char*)batch_code);
+
+  vm.engine = engine_threaded;
+  double start = now();
+  for (u64 l = 0; l < batch_lanes; l++) {
+    vm.registers[reg_a] = l;
+    vm.registers[reg_c] = 200 + l % 64;
+    smvm_execute(&vm);
+  }
+  double single = now() - start;
+
+  bsmv_lane* lanes = calloc(batch_lanes, sizeof(bsmv_lane));
+  for (u64 l = 0; l < batch_lanes; l++) {
+    lanes[l].registers[reg_a] = l;
+    lanes[l].registers[reg_c] = 200 + l % 64;
+  }
+  start = now();
+  bsmv_execute(&vm, lanes, batch_lanes);
+  double batch = now() - start;
+
+  printf("%-10s %-9s %8.3f ms  (x1.00)\n", "batch", "threaded", single * 1e3);
+  printf("%-10s %-9s %8.3f ms  (x%.2f)\n", "batch", "lanes", batch * 1e3,
+         single / batch);
+  for (u64 l = 0; l < batch_lanes; l++) msmv_free(&lanes[l].memory);
+  free(lanes);
+  smvm_free(&vm);
+}
+
+int main(int argc, char** argv) {
+  for (int i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+    struct stats stats[engine_tracing + 1];
+    double elapsed[engine_tracing + 1], packed;
+    for (int e = engine_loop; e <= engine_tracing; e++)
+      elapsed[e] = run(&bench_cases[i], e, &stats[e], &packed);
+
+    // only the threaded engine counts, every engine runs the same instructions
+    u64 executed = stats[engine_threaded].executed;
+    printf("%-10s %zu bytes/inst as asmv_inst, %.1f packed\n",
+           bench_cases[i].name, sizeof(asmv_inst), packed);
+    for (int e = engine_loop; e <= engine_tracing; e++) {
+      printf("%-10s %-9s %8.3f ms  (x%.2f)  %7.1f Minst/s",
+             bench_cases[i].name, engine_names[e], elapsed[e] * 1e3,
+             elapsed[engine_loop] / elapsed[e], executed / elapsed[e] * 1e-6);
+      if (stats[e].executed)
+        printf("  quickened %.1f%%",
+               100.0 * stats[e].quickened / stats[e].executed);
+      printf("\n");
+    }
+  }
+  bench_batch();
+  return 0;
+}
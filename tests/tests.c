@@ -1,6 +1,34 @@
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS, sigaction
+
 #include "mini_catch2.h"
+#include "asmv.h"
+#include "bsmv.h"
+#include "psmv.h"
 #include "smvm.h"
 #include "util.h"
+#include "vsmv.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+// every malloc, calloc and realloc, see TEST_WRAP in the Makefile
+static u64 allocations = 0;
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t num, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __wrap_malloc(size_t size) {
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+void* __wrap_calloc(size_t num, size_t size) {
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc(num, size);
+}
+void* __wrap_realloc(void* ptr, size_t size) {
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
 
 smvm bake_vm(const char* code) {
   smvm vm;
@@ -9,6 +37,21 @@ smvm bake_vm(const char* code) {
   return vm;
 }
 
+// assembles code, then loads it back from its bytecode image
+smvm bake_vm_from_image(const char* code) {
+  smvm assembled = bake_vm(code);
+  listmv image;
+  listmv_init(&image, sizeof(u8));
+  smvm_emit_image(&assembled, &image);
+  smvm_free(&assembled);
+
+  smvm vm;
+  smvm_init(&vm);
+  REQUIRE(smvm_load_image(&vm, image.data, image.len));
+  listmv_free(&image);
+  return vm;
+}
+
 bool assert_register(smvm* vm, smvm_register reg, i64 expected) {
   return vm->registers[reg] == expected;
 }
@@ -208,4 +251,1252 @@ TEST_CASE(test_fibonacci) {
   smvm_free(&vm);
 }
 
+TEST_CASE(test_threaded_engine) {
+  const char* programs[] = {
+      "mov ra 5\nmov rb 7\nadd rc ra rb\nsub rd rb ra\nhalt",
+      "mov ra 6\nmov rb 7\nmul rc ra rb\ndiv rd rc rb\nhalt",
+      "mov ra 123\npush ra\nmov ra 456\npop rb\nhalt",
+      "mov ra 0\ncall .sub\njmp .end\n.sub\nmov ra 42\nret\n.end\nhalt",
+      "mov ra 0\nmov rb 1\nmov rc 10\n.loop\ndec rc\njne rc 0 .continue\n"
+      "jmp .end\n.continue\nmov rd rb\nadd rb ra rb\nmov ra rd\n"
+      "jmp .loop\n.end\nhalt",
+      "mov @8 42\nmov ra 8\nmov rb @ra\nadd @16 rb @8\nmov rc @16\nhalt",
+  };
+
+  for (int i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    smvm loop = bake_vm(programs[i]);
+    smvm threaded = bake_vm(programs[i]);
+    threaded.engine = engine_threaded;
+    smvm_execute(&loop);
+    smvm_execute(&threaded);
+    for (int reg = reg_a; reg <= reg_d; reg++)
+      ASSERT_EQUAL(threaded.registers[reg], loop.registers[reg]);
+    ASSERT_EQUAL(threaded.registers[reg_ip], loop.registers[reg_ip]);
+    smvm_free(&loop);
+    smvm_free(&threaded);
+  }
+}
+
+TEST_CASE(test_quickened_stats) {
+  smvm vm = bake_vm("mov ra 5\nmov rb32 7\nadd rc ra rb\nhalt");
+  vm.engine = engine_threaded;
+  smvm_execute(&vm);
+  ASSERT_EQUAL(vm.registers[reg_c], 12);
+  ASSERT_EQUAL(vm.stats.executed, 4);
+  ASSERT_EQUAL(vm.stats.quickened, 2);  // rb32 takes the generic mov
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_superinstructions) {
+  const char* code =
+      "mov ra 0\nmov rb 1\nmov rc 10\n"
+      ".loop\nmov rd rb\nadd rb ra rb\nmov ra rd\n"
+      "dec rc\njne rc 0 .loop\nhalt";
+
+  smvm fused = bake_vm(code);
+  fused.engine = engine_threaded;
+  smvm_execute(&fused);
+  ASSERT_EQUAL(fused.registers[reg_b], 89);
+  ASSERT_EQUAL(fused.stats.fused[0], 10);  // dec_jnz
+  ASSERT_EQUAL(fused.stats.fused[3], 10);  // mov_add_mov
+  ASSERT_EQUAL(fused.stats.executed, 3 + 10 * 5 + 1);
+
+  smvm plain = bake_vm(code);
+  plain.engine = engine_threaded;
+  plain.fusions = fuse_mov_add;
+  smvm_execute(&plain);
+  ASSERT_EQUAL(plain.registers[reg_b], 89);
+  ASSERT_EQUAL(plain.stats.fused[0], 0);
+  ASSERT_EQUAL(plain.stats.fused[2], 10);
+  ASSERT_EQUAL(plain.stats.executed, fused.stats.executed);
+
+  smvm_free(&fused);
+  smvm_free(&plain);
+}
+
+TEST_CASE(test_bytecode_conformance) {
+  // every program above, run from asmv and from its bytecode image
+  const char* programs[] = {
+      "mov ra 42\nhalt",
+      "mov ra 5\nmov rb 7\nadd rc ra rb\nhalt",
+      "mov ra 15\nmov rb 7\nsub rc ra rb\nhalt",
+      "mov ra 6\nmov rb 7\nmul rc ra rb\nhalt",
+      "mov ra 20\nmov rb 5\ndiv rc ra rb\nhalt",
+      "mov ra 123\npush ra\nmov ra 456\npop rb\nhalt",
+      "mov ra 1\njmp .skip\nmov ra 2\n.skip\nmov rb 3\nhalt",
+      "mov ra 5\nmov rb 5\nje ra rb .equal\nmov rc 0\njmp .end\n"
+      ".equal\nmov rc 1\n.end\nhalt",
+      "mov ra 5\nmov rb 10\njne ra rb .notequal\nmov rc 0\njmp .end\n"
+      ".notequal\nmov rc 1\n.end\nhalt",
+      "mov ra 0\ncall .subroutine\njmp .end\n.subroutine\nmov ra 42\n"
+      "ret\n.end\nhalt",
+      "mov ra 5\nmov rb 3\nand rc ra rb\nor rd ra rb\nxor ra ra rb\nhalt",
+      "mov ra 10\ninc ra\nmov rb 20\ndec rb\nhalt",
+      "mov ra 1\nmov rb 2\nshl rc ra rb\nmov rd 16\nshr ra rd rb\nhalt",
+      "mov ra 0\nmov rb 1\nmov rc 10\n.loop\ndec rc\njne rc 0 .continue\n"
+      "jmp .end\n.continue\nmov rd rb\nadd rb ra rb\nmov ra rd\n"
+      "jmp .loop\n.end\nhalt",
+      "mov ra 5\nmov rb32 7\nadd rc ra rb\nhalt",
+      "mov @8 42\nmov ra 8\nmov rb @ra\nadd @16 rb @8\nmov rc @16>16\n"
+      "halt",
+      "mov ra -3\nadd rb ra 300\nputs \"\"\nhalt",
+  };
+
+  for (int i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    smvm expected = bake_vm(programs[i]);
+    smvm_execute(&expected);
+
+    for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+      smvm vm = bake_vm_from_image(programs[i]);
+      vm.engine = engine;
+      smvm_execute(&vm);
+      for (int reg = reg_a; reg <= reg_d; reg++)
+        ASSERT_EQUAL(vm.registers[reg], expected.registers[reg]);
+      ASSERT_EQUAL(vm.registers[reg_ip], expected.registers[reg_ip]);
+      ASSERT_EQUAL(vm.flags, expected.flags);
+      smvm_free(&vm);
+    }
+    smvm_free(&expected);
+  }
+}
+
+TEST_CASE(test_image_relinks_syscalls) {
+  smvm assembled = bake_vm("scall \"first\"\nscall \"second\"\nhalt");
+  listmv image;
+  listmv_init(&image, sizeof(u8));
+  smvm_emit_image(&assembled, &image);
+  smvm_free(&assembled);
+
+  smvm vm;
+  smvm_init(&vm);
+  smvm_link_syscall(&vm, (smvm_syscall_func)abort, "unused");
+  smvm_link_syscall(&vm, NULL, "second");
+  REQUIRE(smvm_load_image(&vm, image.data, image.len));
+  ASSERT_EQUAL(smvm_find_syscall_index(&vm, "first"), 0);
+  ASSERT_EQUAL(smvm_find_syscall_index(&vm, "second"), 1);
+  ASSERT_EQUAL(smvm_find_syscall_index(&vm, "unused"), 2);
+
+  ((u8*)image.data)[smvm_header_size] ^= 1;  // corrupt the code
+  REQUIRE(!smvm_load_image(&vm, image.data, image.len));
+
+  listmv_free(&image);
+  smvm_free(&vm);
+}
+
+static void add_native(smvm* vm) { vm->registers[reg_b] += 10; }
+
+TEST_CASE(test_assemble_keeps_syscalls) {
+  smvm vm;
+  smvm_init(&vm);
+  smvm_link_syscall(&vm, add_native, "add");
+
+  // names the program brings outlive the assembler's arena
+  for (int round = 0; round < 3; round++) {
+    smvm_assemble(&vm,
+                  "jmp .start\n.back\nscall \"add\"\nhalt\n"
+                  ".start\nscall \"add\"\nscall \"later\"\njmp .back");
+    ASSERT_EQUAL(vm.syscalls.len, 2);
+    ASSERT_EQUAL(smvm_find_syscall_index(&vm, "add"), 0);
+    ASSERT_EQUAL(smvm_find_syscall_index(&vm, "later"), 1);
+  }
+  smvm_link_syscall(&vm, add_native, "later");
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.status, status_halted);
+  ASSERT_EQUAL(vm.registers[reg_b], 30);
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_jit_engine) {
+  const char* programs[] = {
+      "mov ra 0\nmov rb 1\nmov rc 50\n.loop\nmov rd rb\nadd rb ra rb\n"
+      "mov ra rd\ndec rc\njne rc 0 .loop\nhalt",
+      "mov ra 3\nmov rb -2\nmul rc ra rb\nsub rd rc 1000000000000\n"
+      "xor ra ra rd\nor rb rb 4096\nand rc rc rb\nhalt",
+      "mov ra 1\n.loop\ninc ra\njl ra 10 .done\njmp .loop\n.done\nhalt",
+      "mov rc 3\n.loop\ncall .body\ndec rc\njne rc 0 .loop\nhalt\n"
+      ".body\ninc ra\nmov @8 ra\nmov rb @8\nret",
+      "mov ra 7\nje ra 7 .end\nmov ra 8\n.end",
+      "mov ra -1\njl ra 5 .end\nmov rb 1\n.end\nmov rc 2\njl rc ra .out\n"
+      "mov rd 3\n.out",
+  };
+
+  for (int i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    smvm loop = bake_vm(programs[i]);
+    smvm jit = bake_vm(programs[i]);
+    jit.engine = engine_jit;
+    smvm_execute(&loop);
+    smvm_execute(&jit);
+    for (int reg = reg_a; reg <= reg_d; reg++)
+      ASSERT_EQUAL(jit.registers[reg], loop.registers[reg]);
+    ASSERT_EQUAL(jit.registers[reg_ip], loop.registers[reg_ip]);
+    ASSERT_EQUAL(jit.flags, loop.flags);
+    smvm_free(&loop);
+    smvm_free(&jit);
+  }
+}
+
+TEST_CASE(test_tracing_engine) {
+  const char* programs[] = {
+      // hot, fully traceable
+      "mov ra 0\nmov rb 1\nmov rc 500\n.loop\nmov rd rb\nadd rb ra rb\n"
+      "mov ra rd\ndec rc\njne rc 0 .loop\nhalt",
+      // inner loop traced, outer one side exits into it
+      "mov ra 20\n.outer\nmov rb 100\n.inner\nadd rc rc rb\ndec rb\n"
+      "jne rb 0 .inner\ndec ra\njne ra 0 .outer\nhalt",
+      // a branch inside the loop flips halfway through, guard fails
+      "mov rc 200\n.loop\njl rc 100 .big\ninc rb\njmp .next\n.big\n"
+      "inc ra\n.next\ndec rc\njne rc 0 .loop\nhalt",
+      // leaves through the last guard with the jmp before it taken, and
+      // through the first one halfway
+      "mov rc 200\n.loop\njmp .body\n.body\njl rc 100 .big\ninc rb\n.big\n"
+      "dec rc\njne rc 0 .loop\nhalt",
+      // memory in the body, stays cold
+      "mov rc 100\n.loop\nmov @8 rc\nadd ra ra @8\ndec rc\njne rc 0 .loop",
+  };
+
+  for (int i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    smvm loop = bake_vm(programs[i]);
+    smvm tracing = bake_vm(programs[i]);
+    tracing.engine = engine_tracing;
+    smvm_execute(&loop);
+    smvm_execute(&tracing);
+    for (int reg = reg_a; reg <= reg_d; reg++)
+      ASSERT_EQUAL(tracing.registers[reg], loop.registers[reg]);
+    ASSERT_EQUAL(tracing.registers[reg_ip], loop.registers[reg_ip]);
+    // the last jump taken before the exit, inside the trace or not
+    ASSERT_EQUAL(tracing.registers[reg_bp], loop.registers[reg_bp]);
+    ASSERT_EQUAL(tracing.flags, loop.flags);
+#if defined(__x86_64__) && defined(__unix__)
+    ASSERT_EQUAL(tracing.stats.traces > 0, i != 4);
+#endif
+    smvm_free(&loop);
+    smvm_free(&tracing);
+  }
+}
+
+TEST_CASE(test_execute_result) {
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm("mov ra 1\nhalt\nmov ra 2");
+    vm.engine = engine;
+    smvm_result result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_halted);
+    ASSERT_EQUAL(result.index, 1);
+    ASSERT_EQUAL(vm.registers[reg_a], 1);
+
+    // runs again from the top, flag_t from the halt is no obstacle
+    vm.registers[reg_a] = 0;
+    result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.index, 1);
+    ASSERT_EQUAL(vm.registers[reg_a], 1);
+    smvm_free(&vm);
+
+    vm = bake_vm("mov ra 5\nscall \"nothing\"\nmov ra 6");
+    vm.engine = engine;
+    result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_trapped);
+    ASSERT_EQUAL(result.trap, trap_syscall_missing);
+    ASSERT_EQUAL(result.index, 1);
+    ASSERT_EQUAL(vm.registers[reg_a], 5);
+    smvm_free(&vm);
+
+    vm = bake_vm("mov ra 5\nmov ra 6");
+    vm.engine = engine;
+    result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_halted);
+    ASSERT_EQUAL(result.index, 2);
+    smvm_free(&vm);
+
+    // ten taken branches, the eleventh runs out
+    vm = bake_vm("mov rc 100\n.loop\ndec rc\njne rc 0 .loop\nhalt");
+    vm.engine = engine;
+    vm.fuel = 10;
+    result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_out_of_fuel);
+    ASSERT_EQUAL(result.index, 2);
+    ASSERT_EQUAL(vm.registers[reg_c], 89);
+    ASSERT_EQUAL(vm.fuel, 0);
+    smvm_free(&vm);
+  }
+}
+
+TEST_CASE(test_recursive_calls) {
+  const char* fibonacci =
+      "mov ra 15\n"
+      "call .fib\n"
+      "halt\n"
+      ".fib\n"  // rb = fib(ra), ra is preserved
+      "jl ra 2 .recurse\n"
+      "mov rb ra\n"
+      "ret\n"
+      ".recurse\n"
+      "dec ra\n"
+      "call .fib\n"
+      "push rb\n"
+      "dec ra\n"
+      "call .fib\n"
+      "pop rc\n"
+      "add rb rb rc\n"
+      "add ra ra 2\n"
+      "ret";
+
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm(fibonacci);
+    vm.engine = engine;
+    smvm_result result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_halted);
+    ASSERT_EQUAL(result.index, 2);
+    ASSERT_EQUAL(vm.registers[reg_a], 15);
+    ASSERT_EQUAL(vm.registers[reg_b], 610);
+    ASSERT_EQUAL(vm.registers[reg_sp], 0);
+    // ret leaves bp at the address of the call it returned to
+    ASSERT_EQUAL(vm.registers[reg_bp],
+                 ((asmv_inst*)listmv_at(&vm.instructions, 1))->index);
+    smvm_free(&vm);
+
+    vm = bake_vm("mov ra 1\nret\nmov ra 2");
+    vm.engine = engine;
+    result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_trapped);
+    ASSERT_EQUAL(result.trap, trap_stack_underflow);
+    ASSERT_EQUAL(result.index, 1);
+    ASSERT_EQUAL(vm.registers[reg_a], 1);
+    smvm_free(&vm);
+  }
+}
+
+TEST_CASE(test_batch_lanes) {
+  // collatz steps, lanes split up on every je and meet again at .loop
+  const char* collatz =
+      "jl ra 1000 .trap\n"
+      "mov rb 0\n"
+      ".loop\n"
+      "je ra 1 .done\n"
+      "inc rb\n"
+      "and rc ra 1\n"
+      "je rc 0 .even\n"
+      "mul ra ra 3\n"
+      "add ra ra 1\n"
+      "jmp .loop\n"
+      ".even\n"
+      "divu ra ra 2\n"  // runs lane by lane
+      "jmp .loop\n"
+      ".done\n"
+      "mov @8 rb\n"
+      "halt\n"
+      ".trap\n"
+      "scall \"missing\"";
+  u64 inputs[] = {1, 2, 3, 6, 7, 9, 27, 97, 5000, 871, 12};
+  u64 count = sizeof(inputs) / sizeof(inputs[0]);
+
+  smvm vm = bake_vm(collatz);
+  bsmv_lane lanes[sizeof(inputs) / sizeof(inputs[0])] = {0};
+  for (u64 l = 0; l < count; l++) lanes[l].registers[reg_a] = inputs[l];
+  REQUIRE(bsmv_execute(&vm, lanes, count));
+
+  for (u64 l = 0; l < count; l++) {
+    smvm single = bake_vm(collatz);
+    single.registers[reg_a] = inputs[l];
+    smvm_result result = smvm_execute(&single);
+
+    ASSERT_EQUAL(lanes[l].result.status, result.status);
+    ASSERT_EQUAL(lanes[l].result.trap, result.trap);
+    ASSERT_EQUAL(lanes[l].result.index, result.index);
+    for (int reg = 0; reg < smvm_register_num; reg++)
+      ASSERT_EQUAL(lanes[l].registers[reg], single.registers[reg]);
+    ASSERT_EQUAL(*(u64*)msmv_at(&lanes[l].memory, 8),
+                 *(u64*)msmv_at(&single.memory, 8));
+    msmv_free(&lanes[l].memory);
+    smvm_free(&single);
+  }
+  ASSERT_EQUAL(lanes[8].result.trap, trap_syscall_missing);
+  ASSERT_EQUAL(lanes[6].registers[reg_b], 111);  // 27 takes its time
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_batch_stacks_cleared) {
+  // the first lane of each block gets the same stack, the one in the
+  // second block looks under its sp for what the first one pushed
+  smvm vm = bake_vm(
+      "je ra 0 .look\n"
+      "push rb\n"
+      "halt\n"
+      ".look\n"
+      "mov rsp 8\n"
+      "pop rb\n"
+      "halt");
+  u64 count = 257;
+  bsmv_lane* lanes = calloc(count, sizeof(bsmv_lane));
+  for (u64 l = 0; l < count - 1; l++) {
+    lanes[l].registers[reg_a] = 1;
+    lanes[l].registers[reg_b] = 77;
+  }
+  REQUIRE(bsmv_execute(&vm, lanes, count));
+
+  ASSERT_EQUAL(lanes[0].result.status, status_halted);
+  ASSERT_EQUAL(lanes[0].registers[reg_sp], 8);
+  ASSERT_EQUAL(lanes[count - 1].result.status, status_halted);
+  ASSERT_EQUAL(lanes[count - 1].registers[reg_b], 0);
+  for (u64 l = 0; l < count; l++) msmv_free(&lanes[l].memory);
+  free(lanes);
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_verifier) {
+  struct {
+    const char* code;
+    vsmv_error error;
+    u64 index;
+  } cases[] = {
+      {"mov ra 1\ncall .f\nhalt\n.f\npush ra\npop rb\nret", verify_ok, 0},
+      {"mov ra 1\nret", verify_stack, 1},
+      {"push ra\npop rb\npop rc", verify_stack, 2},
+      {".l\npush ra\njmp .l", verify_stack, 0},
+      {"call .f\n.f\npush ra\nret", verify_stack, 2},
+      {"mov rip 0\nhalt", verify_control, 0},
+      {"jmp .nowhere\nhalt", verify_target, 0},
+      {"mov @8589934592 ra", verify_address, 0},
+  };
+
+  for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    smvm vm = bake_vm(cases[i].code);
+    vsmv_result result = vsmv_verify(&vm);
+    ASSERT_EQUAL(result.error, cases[i].error);
+    ASSERT_EQUAL(result.index, cases[i].index);
+    ASSERT_EQUAL(vm.verified.ok, cases[i].error == verify_ok);
+    smvm_free(&vm);
+  }
+
+  // verified at load, and runs the same as when it isn't
+  const char* code =
+      "mov @16 ra\n"
+      "mov rc 10\n"
+      ".loop\n"
+      "call .body\n"
+      "dec rc\n"
+      "jne rc 0 .loop\n"
+      "mov rb @16\n"
+      "halt\n"
+      ".body\n"
+      "push rc\n"
+      "pop rd\n"
+      "add ra ra rd\n"
+      "ret";
+  smvm verified = bake_vm_from_image(code);
+  smvm checked = bake_vm(code);
+  REQUIRE(verified.verified.ok);
+  checked.verified.ok = false;
+  verified.registers[reg_a] = checked.registers[reg_a] = 7;
+  smvm_execute(&verified);
+  smvm_execute(&checked);
+  for (int reg = 0; reg < smvm_register_num; reg++)
+    ASSERT_EQUAL(verified.registers[reg], checked.registers[reg]);
+  ASSERT_EQUAL(verified.registers[reg_a], 62);
+  ASSERT_EQUAL(verified.registers[reg_b], 7);
+  smvm_free(&verified);
+  smvm_free(&checked);
+
+  // indirect addresses aren't the verifier's, one running off the end of
+  // memory traps on the unchecked path all the same
+  smvm vm = bake_vm("mov ra 4294967295\nmov @ra ra\nhalt");
+  REQUIRE(vm.verified.ok);
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.status, status_trapped);
+  ASSERT_EQUAL(result.trap, trap_bounds);
+  ASSERT_EQUAL(result.index, 1);
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_string_interning) {
+  const char* code =
+      "puts \"hi\"\n"
+      "extern \"hi\"\n"
+      "puts \"yo\"\n"
+      "puts \"hi\"\n"
+      "halt";
+  smvm vms[2] = {bake_vm(code), bake_vm_from_image(code)};
+  for (int v = 0; v < 2; v++) {
+    smvm* vm = &vms[v];
+    ASSERT_EQUAL(vm->stringpool.len, 6);
+    REQUIRE(!memcmp(vm->stringpool.data, "hi\0yo\0", 6));
+    u64 offsets[4];
+    for (int i = 0; i < 4; i++) {
+      asmv_inst* inst = listmv_at(&vm->instructions, i);
+      ASSERT_EQUAL(inst->operands[0].data.type, asmv_str_type);
+      ASSERT_EQUAL(inst->operands[0].data.str.len, 3);
+      offsets[i] = inst->operands[0].data.str.offset;
+    }
+    ASSERT_EQUAL(offsets[0], 0);
+    ASSERT_EQUAL(offsets[1], 0);
+    ASSERT_EQUAL(offsets[2], 3);
+    ASSERT_EQUAL(offsets[3], 0);
+    smvm_free(vm);
+  }
+}
+
+TEST_CASE(test_string_interning_many) {
+  // enough strings for the table to grow a few times, each twice
+  listmv(char) code;
+  listmv_init(&code, sizeof(char));
+  char line[32];
+  for (int pass = 0; pass < 2; pass++)
+    for (int i = 0; i < 1000; i++) {
+      int n = snprintf(line, sizeof(line), "puts \"s%d\"\n", i);
+      listmv_push_array(&code, line, n);
+    }
+  listmv_push_array(&code, "halt", 5);
+
+  smvm vms[2] = {bake_vm(code.data), bake_vm_from_image(code.data)};
+  for (int v = 0; v < 2; v++) {
+    smvm* vm = &vms[v];
+    u64 unique = 0;
+    for (int i = 0; i < 1000; i++) unique += snprintf(line, 32, "s%d", i) + 1;
+    ASSERT_EQUAL(vm->stringpool.len, unique);
+    for (int i = 0; i < 1000; i++) {
+      asmv_inst* first = listmv_at(&vm->instructions, i);
+      asmv_inst* again = listmv_at(&vm->instructions, 1000 + i);
+      ASSERT_EQUAL(again->operands[0].data.str.offset,
+                   first->operands[0].data.str.offset);
+      snprintf(line, sizeof(line), "s%d", i);
+      REQUIRE(!strcmp(listmv_at(&vm->stringpool,
+                                first->operands[0].data.str.offset),
+                      line));
+    }
+    smvm_free(vm);
+  }
+  listmv_free(&code);
+}
+
+TEST_CASE(test_guest_memory) {
+  // high and sparse, only the touched pages get backed
+  smvm vm = bake_vm(
+      "mov rb 3000000000\n"
+      "mov @rb ra\n"
+      "mov rc @rb\n"
+      "mov @16 ra\n"
+      "mov rd @16\n"
+      "halt");
+  vm.registers[reg_a] = 42;
+  smvm_execute(&vm);
+  ASSERT_EQUAL(vm.registers[reg_c], 42);
+  ASSERT_EQUAL(vm.registers[reg_d], 42);
+  ASSERT_EQUAL(vm.memory.size, msmv_default_size);
+  REQUIRE(vm.verified.ok);
+  smvm_free(&vm);
+
+  // addresses wrap at the size, which is rounded up to a power of two
+  vm = bake_vm("mov @ra rb\nmov rc @16\nmov @70000 rc\nhalt");
+  REQUIRE(vm.verified.ok);
+  REQUIRE(smvm_set_memory(&vm, 50000, 0));
+  ASSERT_EQUAL(vm.memory.size, 65536);
+  ASSERT_EQUAL(vm.memory.mask, 65535);
+  REQUIRE(!vm.verified.ok);  // @70000 doesn't fit anymore
+  vm.registers[reg_a] = 65536 + 16;
+  vm.registers[reg_b] = 7;
+  smvm_execute(&vm);
+  ASSERT_EQUAL(vm.registers[reg_c], 7);
+  ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, 70000 - 65536), 7);
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_guest_stack) {
+  // sp is the real offset, runaway recursion ends up in the guard
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm("push ra\n.f\ncall .f");
+    vm.engine = engine;
+    REQUIRE(smvm_set_stack(&vm, 5000));
+    ASSERT_EQUAL(vm.stack.size, 8192);
+    smvm_result result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_trapped);
+    ASSERT_EQUAL(result.trap, trap_stack_overflow);
+    ASSERT_EQUAL(result.index, 1);
+    ASSERT_EQUAL(vm.registers[reg_sp], 8 + 511 * sizeof(smvm_frame));
+    smvm_free(&vm);
+  }
+
+  // verified, so pop doesn't check, and sp going under 0 faults instead
+  smvm vm = bake_vm("push ra\nmov rsp 4\npop rb\nhalt");
+  REQUIRE(vm.verified.ok);
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.status, status_trapped);
+  ASSERT_EQUAL(result.trap, trap_stack_underflow);
+  ASSERT_EQUAL(result.index, 2);
+  smvm_free(&vm);
+}
+
+// the embedder's own handler, it opens the page that faulted
+static u8* foreign_page;
+static int foreign_faults = 0;
+static void foreign_handler(int sig, siginfo_t* info, void* context) {
+  foreign_faults++;
+  mprotect(foreign_page, msmv_page(), PROT_READ | PROT_WRITE);
+}
+
+TEST_CASE(test_foreign_faults_chain) {
+  struct sigaction action = {.sa_flags = SA_SIGINFO};
+  action.sa_sigaction = foreign_handler;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, NULL);
+  foreign_page = mmap(NULL, msmv_page(), PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  // smvm takes the signal over, but a fault that isn't a vm's still gets
+  // to the handler from before, while a vm's own traps stay with the vm
+  smvm vm = bake_vm("push ra\n.f\ncall .f");
+  *(volatile u64*)foreign_page = 7;
+  ASSERT_EQUAL(foreign_faults, 1);
+  ASSERT_EQUAL(*(u64*)foreign_page, 7);
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.trap, trap_stack_overflow);
+  ASSERT_EQUAL(foreign_faults, 1);
+  smvm_free(&vm);
+  munmap(foreign_page, msmv_page());
+}
+
+TEST_CASE(test_memory_bounds) {
+  // 8 bytes 4 from the end run into the guard, every engine traps
+  const char* programs[] = {
+      "mov ra 1\nmov @4294967292>64 ra\nhalt",
+      "mov ra 4294967295\nmov @ra ra\nhalt",
+      "mov ra 4294967295\nmov rb @ra\nhalt",
+  };
+  for (int p = 0; p < 3; p++)
+    for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+      smvm vm = bake_vm(programs[p]);
+      vm.engine = engine;
+      smvm_result result = smvm_execute(&vm);
+      ASSERT_EQUAL(result.status, status_trapped);
+      ASSERT_EQUAL(result.trap, trap_bounds);
+      smvm_free(&vm);
+    }
+
+  // an access ending right at the end is still in range
+  smvm vm =
+      bake_vm("mov ra 7\nmov @4294967288>64 ra\nmov rb @4294967288>64\nhalt");
+  ASSERT_EQUAL(smvm_execute(&vm).status, status_halted);
+  ASSERT_EQUAL(vm.registers[reg_b], 7);
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_memory_quota) {
+  // one page a store, the fifth goes past the quota
+  u64 page = msmv_page();
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm(".l\nmov @ra rb\nadd ra ra rc\njmp .l");
+    vm.engine = engine;
+    vm.registers[reg_b] = 7;
+    vm.registers[reg_c] = page;
+    smvm_set_quota(&vm, 4 * page);
+    smvm_result result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_trapped);
+    ASSERT_EQUAL(result.trap, trap_quota);
+    ASSERT_EQUAL(vm.registers[reg_a], 4 * page);
+    ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, 3 * page), 7);
+    smvm_usage usage = smvm_get_usage(&vm);
+    ASSERT_EQUAL(usage.current, 4 * page);
+    ASSERT_EQUAL(usage.peak, 4 * page);
+    ASSERT_EQUAL(usage.quota, 4 * page);
+    smvm_free(&vm);
+  }
+
+  // the stack counts too, pages already committed don't count twice
+  smvm vm = bake_vm("push ra\npop rb\nmov @8 ra\nmov @16 ra\nhalt");
+  smvm_set_quota(&vm, 2 * page);
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.status, status_halted);
+  ASSERT_EQUAL(smvm_get_usage(&vm).current, 2 * page);
+  smvm_free(&vm);
+
+  // a write running off the end traps under a quota too, with room for the
+  // last page or without
+  for (int engine = engine_loop; engine <= engine_tracing; engine++)
+    for (u64 quota = 0; quota <= 4 * page; quota += 4 * page) {
+      vm = bake_vm("mov ra 4294967292\nmov @ra ra\nhalt");
+      vm.engine = engine;
+      smvm_set_quota(&vm, quota);
+      result = smvm_execute(&vm);
+      ASSERT_EQUAL(result.status, status_trapped);
+      ASSERT_EQUAL(result.trap, quota ? trap_bounds : trap_quota);
+      ASSERT_EQUAL(smvm_get_usage(&vm).current <= quota, true);
+      smvm_free(&vm);
+    }
+}
+
+TEST_CASE(test_scattered_quota) {
+  // a page every other page, far more than the kernel maps separately. the
+  // guest gets the gaps too instead of taking the host down
+  u64 page = msmv_page();
+  smvm vm = bake_vm(".l\nmov @ra rb\nadd ra ra rc\ndec rd\njne rd 0 .l\nhalt");
+  vm.registers[reg_b] = 7;
+  vm.registers[reg_c] = 2 * page;
+  vm.registers[reg_d] = 70000;
+  smvm_set_quota(&vm, 1ull << 30);
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.status, status_halted);
+  ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, 69999 * 2 * page), 7);
+  ASSERT_EQUAL(vm.memory.runs <= msmv_max_runs, true);
+  u64 used = smvm_get_usage(&vm).current;
+  ASSERT_EQUAL(used >= 70000 * page && used <= 140000 * page + page, true);
+
+  // the quota still holds with pages opened a run at a time
+  smvm_free(&vm);
+  vm = bake_vm(".l\nmov @ra rb\nadd ra ra rc\njmp .l");
+  vm.registers[reg_c] = 2 * page;
+  smvm_set_quota(&vm, 4096 * page);
+  result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.trap, trap_quota);
+  ASSERT_EQUAL(smvm_get_usage(&vm).current <= 4096 * page, true);
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_snapshot_fork) {
+  smvm warm = bake_vm("mov @100 ra\npush ra\nmov rb 7\nhalt");
+  warm.registers[reg_a] = 42;
+  smvm_execute(&warm);
+  smvm_frozen snapshot;
+  REQUIRE(smvm_snapshot(&warm, &snapshot));
+  *(u64*)msmv_at(&warm.memory, 100) = 0;  // frozen, the forks don't see it
+
+  // each fork writes its own pages, the others still see the snapshot's
+  for (u64 n = 1; n <= 2; n++) {
+    smvm fork;
+    REQUIRE(smvm_fork(&snapshot, &fork));
+    ASSERT_EQUAL(fork.registers[reg_b], 7);
+    ASSERT_EQUAL(fork.registers[reg_sp], 8);
+    smvm_assemble(&fork, "mov rd @100\npop rc\nmov @100 rb\nhalt");
+    fork.registers[reg_b] = n;
+    smvm_result result = smvm_execute(&fork);
+    ASSERT_EQUAL(result.status, status_halted);
+    ASSERT_EQUAL(fork.registers[reg_c], 42);
+    ASSERT_EQUAL(fork.registers[reg_d], 42);
+    ASSERT_EQUAL(*(u64*)msmv_at(&fork.memory, 100), n);
+
+    // a fork of a fork sees what the first one wrote
+    smvm_frozen again;
+    smvm refork;
+    REQUIRE(smvm_snapshot(&fork, &again));
+    smvm_free(&fork);
+    REQUIRE(smvm_fork(&again, &refork));
+    ASSERT_EQUAL(*(u64*)msmv_at(&refork.memory, 100), n);
+    ASSERT_EQUAL(refork.registers[reg_c], 42);
+    smvm_free(&refork);
+    smvm_free_snapshot(&again);
+  }
+
+  // a fork that fails, at the memory or at the stack, leaves vm alone
+  smvm untouched = {.fuel = 1234};
+  int memory = snapshot.memory, stack = snapshot.stack;
+  snapshot.memory = -1;
+  REQUIRE(!smvm_fork(&snapshot, &untouched));
+  ASSERT_EQUAL(untouched.fuel, 1234);
+  ASSERT_EQUAL(untouched.memory.base, NULL);
+  snapshot.memory = memory;
+  snapshot.stack = -1;
+  REQUIRE(!smvm_fork(&snapshot, &untouched));
+  ASSERT_EQUAL(untouched.fuel, 1234);
+  ASSERT_EQUAL(untouched.memory.base, NULL);
+  snapshot.stack = stack;
+
+  smvm_free_snapshot(&snapshot);
+  smvm_free(&warm);
+}
+
+static u64 checkpoint_calls = 0;
+static void checkpoint_native(smvm* vm) { checkpoint_calls++; }
+
+TEST_CASE(test_checkpoint_restore) {
+  const char* path = "out/test.checkpoint";
+  smvm vm = bake_vm(
+      "mov rb 3000000000\n"
+      "mov @rb ra\n"
+      "push ra\n"
+      "scall \"tick\"\n"
+      "halt");
+  smvm_link_syscall(&vm, checkpoint_native, "tick");
+  vm.registers[reg_a] = 42;
+  smvm_execute(&vm);
+  ASSERT_EQUAL(checkpoint_calls, 1);
+  REQUIRE(psmv_save(&vm, path));
+  smvm_free(&vm);
+
+  // linked again by name, the rest comes back as it was
+  smvm restored;
+  smvm_init(&restored);
+  smvm_link_syscall(&restored, checkpoint_native, "tick");
+  REQUIRE(psmv_restore(&restored, path));
+  ASSERT_EQUAL(restored.registers[reg_a], 42);
+  ASSERT_EQUAL(restored.registers[reg_sp], 8);
+  ASSERT_EQUAL(*(u64*)msmv_at(&restored.memory, 3000000000ull), 42);
+  ASSERT_EQUAL(restored.memory.size, msmv_default_size);
+  REQUIRE(restored.verified.ok);
+
+  // it runs, and a restored vm checkpoints again with what it changed
+  restored.registers[reg_a] = 43;
+  smvm_result result = smvm_execute(&restored);
+  ASSERT_EQUAL(result.status, status_halted);
+  ASSERT_EQUAL(checkpoint_calls, 2);
+  REQUIRE(psmv_save(&restored, path));
+  smvm_free(&restored);
+
+  smvm_init(&restored);
+  REQUIRE(psmv_restore(&restored, path));
+  ASSERT_EQUAL(*(u64*)msmv_at(&restored.memory, 3000000000ull), 43);
+  ASSERT_EQUAL(restored.registers[reg_sp], 16);
+  ASSERT_EQUAL(*(u64*)msmv_at(&restored.stack, 0), 42);
+  result = smvm_execute(&restored);
+  ASSERT_EQUAL(result.trap, trap_syscall_missing);  // tick isn't linked
+  smvm_free(&restored);
+
+  REQUIRE(!psmv_restore(&restored, "tests/tests.c"));
+  remove(path);
+}
+
+// saves the vm on the third time round, from inside the run
+static void checkpoint_midway(smvm* vm) {
+  checkpoint_calls++;
+  if (vm->registers[reg_c] == 3) REQUIRE(psmv_save(vm, "out/test.midway"));
+}
+
+TEST_CASE(test_checkpoint_resume) {
+  const char* code =
+      "mov rc 0\n"
+      ".l\n"
+      "add rc rc 1\n"
+      "scall \"save\"\n"
+      "add rb rb rc\n"
+      "mov @64 rb\n"
+      "jne rc 5 .l\n"
+      "halt";
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm(code);
+    vm.engine = engine;
+    smvm_link_syscall(&vm, checkpoint_midway, "save");
+    checkpoint_calls = 0;
+    ASSERT_EQUAL(smvm_execute(&vm).status, status_halted);
+    ASSERT_EQUAL(vm.registers[reg_b], 15);
+    ASSERT_EQUAL(checkpoint_calls, 5);
+    smvm_free(&vm);
+
+    // picks up right after the scall that saved it and finishes the same
+    smvm restored;
+    smvm_init(&restored);
+    smvm_link_syscall(&restored, checkpoint_native, "save");
+    REQUIRE(psmv_restore(&restored, "out/test.midway"));
+    restored.engine = engine;
+    ASSERT_EQUAL(restored.registers[reg_c], 3);
+    ASSERT_EQUAL(restored.registers[reg_b], 3);
+    checkpoint_calls = 0;
+    smvm_result result = smvm_resume(&restored);
+    ASSERT_EQUAL(result.status, status_halted);
+    ASSERT_EQUAL(restored.registers[reg_b], 15);
+    ASSERT_EQUAL(*(u64*)msmv_at(&restored.memory, 64), 15);
+    ASSERT_EQUAL(checkpoint_calls, 2);
+    smvm_free(&restored);
+  }
+  remove("out/test.midway");
+
+  // a run out of fuel carries on from the branch it stopped at
+  smvm vm = bake_vm(".l\ninc ra\njne ra 10 .l\nhalt");
+  vm.fuel = 3;
+  ASSERT_EQUAL(smvm_execute(&vm).status, status_out_of_fuel);
+  vm.fuel = smvm_fuel_unlimited;
+  ASSERT_EQUAL(smvm_resume(&vm).status, status_halted);
+  ASSERT_EQUAL(vm.registers[reg_a], 10);
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_checkpoint_checked) {
+  const char* path = "out/test.checked";
+  smvm vm = bake_vm("mov ra 1\njmp .end\n.end\nputs \"hi\"\nhalt");
+  REQUIRE(smvm_set_heap(&vm, 1 << 20, 1 << 20));
+  REQUIRE(hsmv_alloc(&vm.heap, 64));
+  smvm restored;
+  smvm_init(&restored);
+
+  // an opcode past instruction_table
+  asmv_inst* first = listmv_at(&vm.instructions, 0);
+  u8 code = first->code;
+  first->code = 200;
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(!psmv_restore(&restored, path));
+  first->code = code;
+
+  // a jump past the program, a register that isn't one, a string outside
+  // the pool
+  asmv_inst* jump = listmv_at(&vm.instructions, 1);
+  u64 label_index = jump->label_index;
+  jump->label_index = 999;
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(!psmv_restore(&restored, path));
+  jump->label_index = label_index;
+  u8 reg = first->operands[0].data.reg;
+  first->operands[0].data.reg = 200;
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(!psmv_restore(&restored, path));
+  first->operands[0].data.reg = reg;
+  asmv_inst* puts = listmv_at(&vm.instructions, 2);
+  asmv_string str = puts->operands[0].data.str;
+  puts->operands[0].data.str.offset = 1000;
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(!psmv_restore(&restored, path));
+  puts->operands[0].data.str = (asmv_string){str.offset, str.len + 1};
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(!psmv_restore(&restored, path));
+  puts->operands[0].data.str = str;
+
+  // heap indices past the pages it has
+  u32 partial = vm.heap.partial[0];
+  vm.heap.partial[0] = vm.heap.top + 5;
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(!psmv_restore(&restored, path));
+  vm.heap.partial[0] = partial;
+  hsmv_page* page = listmv_at(&vm.heap.pages, 0);
+  page->next = 12345;
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(!psmv_restore(&restored, path));
+  page->next = hsmv_none;
+
+  // verified again, whatever the vm thought, and packed from the
+  // instructions rather than taken from the file
+  first->operands[0].data.reg = reg_ip;
+  vm.verified.ok = true;
+  vm.packed.codes[0] = op_halt;
+  REQUIRE(psmv_save(&vm, path));
+  REQUIRE(psmv_restore(&restored, path));
+  REQUIRE(!restored.verified.ok);
+  ASSERT_EQUAL(restored.packed.codes[0], op_mov);
+  ASSERT_EQUAL(restored.heap.stats.blocks, 1);
+
+  smvm_free(&restored);
+  smvm_free(&vm);
+  remove(path);
+}
+
+TEST_CASE(test_map_region) {
+  u64 page = msmv_page();
+  u64* host = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  REQUIRE(host != MAP_FAILED);
+  host[0] = 42;
+
+  // the same pages, the guest reads and writes them in place
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm("mov ra @rc\nadd ra ra 1\nmov @rd ra\nhalt");
+    vm.engine = engine;
+    vm.registers[reg_c] = 4 * page;
+    vm.registers[reg_d] = 5 * page + 8;
+    REQUIRE(smvm_map_region(&vm, 4 * page, host, 2 * page,
+                            msmv_readable | msmv_writable));
+    REQUIRE(!smvm_map_region(&vm, 5 * page, host, page, msmv_readable));
+    smvm_result result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_halted);
+    ASSERT_EQUAL(host[page / 8 + 1], 43);
+    host[page / 8 + 1] = 0;
+
+    // and fresh pages of the guest's own come back
+    REQUIRE(smvm_unmap_region(&vm, 4 * page));
+    ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, 4 * page), 0);
+    REQUIRE(!smvm_unmap_region(&vm, 4 * page));
+    smvm_free(&vm);
+  }
+
+  // with a quota, unmapping doesn't charge the range's pages again. a memfd
+  // keeps them and what they held, otherwise they're gone
+  {
+    smvm vm = bake_vm("mov ra @rc\nmov @rc rb\nhalt");
+    vm.registers[reg_c] = 4 * page;
+    smvm_set_quota(&vm, 4 * page);
+    bool kept = vm.memory.flags & msmv_file;
+    for (int cycle = 0; cycle < 16; cycle++) {
+      vm.registers[reg_ip] = 0;
+      vm.registers[reg_b] = cycle + 1;
+      ASSERT_EQUAL(smvm_execute(&vm).status, status_halted);
+      ASSERT_EQUAL(vm.registers[reg_a], kept ? cycle : 0);
+      ASSERT_EQUAL(vm.memory.committed, page);
+      REQUIRE(smvm_map_region(&vm, 4 * page, host, 2 * page,
+                              msmv_readable | msmv_writable));
+      REQUIRE(smvm_unmap_region(&vm, 4 * page));
+      ASSERT_EQUAL(vm.memory.committed, kept ? page : 0);
+      ASSERT_EQUAL(vm.memory.runs, kept ? 1 : 0);
+    }
+    smvm_free(&vm);
+  }
+
+  // read only, the write traps
+  smvm vm = bake_vm("mov ra @rc\nmov @rc 7\nhalt");
+  vm.registers[reg_c] = page;
+  REQUIRE(smvm_map_region(&vm, page, host, page, msmv_readable));
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.status, status_trapped);
+  ASSERT_EQUAL(result.trap, trap_protection);
+  ASSERT_EQUAL(result.index, 1);
+  ASSERT_EQUAL(vm.registers[reg_a], 42);
+  ASSERT_EQUAL(host[0], 42);
+
+  // private memory can't be mapped twice
+  u64* private = mmap(NULL, page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  REQUIRE(!smvm_map_region(&vm, 8 * page, private, page, msmv_readable));
+  smvm_free(&vm);
+  munmap(private, page);
+  munmap(host, 2 * page);
+}
+
+TEST_CASE(test_data_section) {
+  const char* code =
+      "; globals\n"
+      "let @16>16 1 -2 3\n"
+      "let @64 \"hi\" zero 6 7  # after the string\n"
+      "let @8000>32 1.5\n"
+      "mov ra @16\n"
+      "halt\n";
+
+  // assembled, or loaded back from an image, it's in memory before a run
+  for (int from_image = 0; from_image < 2; from_image++) {
+    smvm vm = from_image ? bake_vm_from_image(code) : bake_vm(code);
+    ASSERT_EQUAL(vm.instructions.len, 2);
+    u8* memory = vm.memory.base;
+    ASSERT_EQUAL(*(u16*)(memory + 16), 1);
+    ASSERT_EQUAL(*(u16*)(memory + 18), 0xfffe);
+    ASSERT_EQUAL(*(u16*)(memory + 20), 3);
+    ASSERT_EQUAL(strcmp((char*)memory + 64, "hi"), 0);
+    u64 word;
+    memcpy(&word, memory + 73, 8);
+    ASSERT_EQUAL(word, 7);
+    ASSERT_EQUAL(*(f32*)(memory + 8000), 1.5f);
+
+    smvm_result result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_halted);
+    ASSERT_EQUAL(vm.registers[reg_a], 0x3fffe0001);
+
+    // zero clears what was there, whenever the section is written again
+    memory[70] = 0xff;
+    REQUIRE(smvm_load_globals(&vm));
+    ASSERT_EQUAL(memory[70], 0);
+    smvm_free(&vm);
+  }
+}
+
+TEST_CASE(test_listmv_growth) {
+  listmv(u64) ls;
+  listmv_init(&ls, sizeof(u64));
+  ASSERT_EQUAL(ls.cap, 0);  // nothing until the first push
+
+  // capacity doubles, it never reallocates on every push
+  u64 moves = 0;
+  for (u64 i = 0; i < 1000; i++) {
+    void* before = ls.data;
+    listmv_push(&ls, &i);
+    moves += ls.data != before;
+  }
+  ASSERT_EQUAL(ls.len, 1000);
+  ASSERT_EQUAL(ls.cap < 2 * ls.len, true);
+  ASSERT_EQUAL(moves <= 10, true);
+  ASSERT_EQUAL(*(u64*)listmv_at(&ls, 999), 999);
+
+  // reserved room is there for the pushes that follow
+  listmv_reserve(&ls, 5000);
+  void* reserved = ls.data;
+  for (u64 i = 0; i < 5000; i++) listmv_push(&ls, &i);
+  ASSERT_EQUAL(ls.data == reserved, true);
+  listmv_shrink(&ls);
+  ASSERT_EQUAL(ls.cap, 6000);
+  ASSERT_EQUAL(*(u64*)listmv_at(&ls, 5999), 4999);
+
+  listmv_free(&ls);
+  ASSERT_EQUAL(ls.len, 0);
+  listmv_push(&ls, &(u64){7});
+  ASSERT_EQUAL(*(u64*)listmv_at(&ls, 0), 7);
+  listmv_free(&ls);
+
+  // lists in an arena grow in place while they're the last thing in it
+  arenamv arena;
+  arenamv_init(&arena);
+  listmv(u8) a, b;
+  listmv_init_arena(&a, sizeof(u8), &arena);
+  listmv_init_arena(&b, sizeof(u8), &arena);
+  listmv_push_array(&a, "hello", 6);
+  void* start = a.data;
+  listmv_push_array(&a, "world", 6);
+  ASSERT_EQUAL(a.data == start, true);
+  listmv_push_array(&b, "again", 6);
+  listmv_push_array(&a, "!", 2);
+  ASSERT_EQUAL(strcmp(listmv_at(&a, 6), "world"), 0);
+  ASSERT_EQUAL(strcmp(b.data, "again"), 0);
+  u8* big = arenamv_alloc(&arena, 3 * arenamv_chunk_size);
+  memset(big, 1, 3 * arenamv_chunk_size);
+  listmv_free(&a);  // the arena still has it
+  listmv_free(&b);
+  arenamv_free(&arena);
+}
+
+TEST_CASE(test_guest_heap) {
+  const char* code =
+      "alloc ra 24\nalloc rb 24\nalloc rc 5000\nmov @ra 7\nfree rb\n"
+      "alloc rd 24\nrealloc ra 100\nfree rc\nhalt";
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm(code);
+    vm.engine = engine;
+    smvm_result result = smvm_execute(&vm);
+    ASSERT_EQUAL(result.status, status_halted);
+
+    // rb's block went to rd, ra moved with what it held
+    u64 ra = vm.registers[reg_a], rd = vm.registers[reg_d];
+    ASSERT_EQUAL(rd % hsmv_page_size, 32);
+    REQUIRE(ra != 0 && ra != rd - 32);
+    ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, ra), 7);
+
+    hsmv_stats stats = smvm_get_heap_stats(&vm);
+    ASSERT_EQUAL(stats.blocks, 2);
+    ASSERT_EQUAL(stats.in_use, 112 + 32);
+    ASSERT_EQUAL(stats.slabs, 2);
+    ASSERT_EQUAL(stats.free_pages, 2);  // rc's, under ra's slab
+    ASSERT_EQUAL(stats.footprint, 4 * hsmv_page_size);
+    smvm_free(&vm);
+  }
+
+  // only what alloc gave out, and only once
+  smvm vm = bake_vm("alloc ra 8\nfree ra\nfree ra\nhalt");
+  smvm_result result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.status, status_trapped);
+  ASSERT_EQUAL(result.trap, trap_heap);
+  ASSERT_EQUAL(result.index, 2);
+  smvm_assemble(&vm, "alloc ra 8\nadd ra ra 1\nrealloc ra 16\nhalt");
+  result = smvm_execute(&vm);
+  ASSERT_EQUAL(result.trap, trap_heap);
+  ASSERT_EQUAL(result.index, 2);
+
+  // everything freed goes back, the heap doesn't grow past what's live
+  REQUIRE(!smvm_set_heap(&vm, 0, 1 << 20));
+  REQUIRE(smvm_set_heap(&vm, 1 << 20, 1 << 24));
+  u64 addrs[1000], footprint = 0;
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < 1000; i++) {
+      addrs[i] = hsmv_alloc(&vm.heap, 1 + i * 37 % 3000);
+      REQUIRE(addrs[i] != 0);
+    }
+    if (round == 0) footprint = vm.heap.stats.footprint;
+    ASSERT_EQUAL(vm.heap.stats.footprint <= footprint, true);
+    for (int i = 1; i < 1000; i += 2)
+      REQUIRE(hsmv_release(&vm.heap, &vm.memory, addrs[i]));
+    for (int i = 0; i < 1000; i += 2)
+      REQUIRE(hsmv_release(&vm.heap, &vm.memory, addrs[i]));
+
+    hsmv_stats stats = vm.heap.stats;
+    ASSERT_EQUAL(stats.blocks, 0);
+    ASSERT_EQUAL(stats.in_use, 0);
+    ASSERT_EQUAL(stats.slabs <= hsmv_class_num, true);
+    ASSERT_EQUAL(stats.footprint,
+                 (stats.slabs + stats.free_pages) * hsmv_page_size);
+  }
+  smvm_free(&vm);
+}
+
+TEST_CASE(test_reset_reuses_vm) {
+  // memory, stack, heap and the data section all start over every run
+  const char* code =
+      "let @64 5 6\n"
+      "mov rb @64\n"
+      "add rb rb ra\n"
+      "add @256>64 @256>64 rb\n"
+      "mov rd @256>64\n"
+      "push rd\n"
+      "pop rb\n"
+      "call .twice\n"
+      "alloc rc 40\n"
+      "mov @rc rb\n"
+      "halt\n"
+      ".twice\n"
+      "add rb rb rb\n"
+      "ret";
+  for (int engine = engine_loop; engine <= engine_tracing; engine++) {
+    smvm vm = bake_vm(code);
+    vm.engine = engine;
+    smvm_set_quota(&vm, 1 << 20);
+    u64 first = 0;
+    for (int run = 0; run < 50; run++) {
+      // the first two runs warm up, decoding, compiling and sizing buffers
+      if (run == 2) first = allocations;
+      REQUIRE(smvm_reset(&vm));
+      vm.registers[reg_a] = run;
+      smvm_result result = smvm_execute(&vm);
+      ASSERT_EQUAL(result.status, status_halted);
+      ASSERT_EQUAL(vm.registers[reg_b], 2 * (run + 5));
+      ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, vm.registers[reg_c]),
+                   2 * (run + 5));
+      ASSERT_EQUAL(vm.heap.stats.blocks, 1);
+      ASSERT_EQUAL(vm.registers[reg_sp], 0);
+    }
+    REQUIRE(first > 0);  // the counting works
+    ASSERT_EQUAL(allocations - first, 0);
+
+    // gone after a reset, the quota counts from nothing again
+    REQUIRE(smvm_reset(&vm));
+    ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, 64), 5);
+    ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, 72), 6);
+    ASSERT_EQUAL(smvm_get_usage(&vm).current, msmv_page());
+    msmv_commit(&vm.memory, msmv_at(&vm.memory, 256), -1);
+    ASSERT_EQUAL(*(u64*)msmv_at(&vm.memory, 256), 0);
+    ASSERT_EQUAL(vm.heap.stats.blocks, 0);
+    smvm_free(&vm);
+  }
+}
+
+static void* run_vm(void* vm) {
+  smvm_execute(vm);
+  return NULL;
+}
+
+TEST_CASE(test_shared_atomics) {
+  u64 page = msmv_page();
+  msmv segment;
+  REQUIRE(msmv_shared_init(&segment, page));
+
+  // one vm per thread, on every engine, all counting into the segment
+  smvm vms[4];
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    vms[i] = bake_vm(
+        ".top\nmov ra 1\nxadd @rc ra\ndec rd\njne rd 0 .top\nhalt");
+    vms[i].engine = engine_loop + i;
+    vms[i].registers[reg_c] = 16 * page + 8;
+    vms[i].registers[reg_d] = 100000;
+    REQUIRE(smvm_attach_shared(&vms[i], 16 * page, &segment,
+                               msmv_readable | msmv_writable));
+  }
+  for (int i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, run_vm, &vms[i]);
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    ASSERT_EQUAL(vms[i].result.status, status_halted);
+  }
+  ASSERT_EQUAL(*(u64*)(segment.base + 8), 400000);
+
+  // cas only swaps when the guest guessed right, and says what was there
+  smvm* vm = &vms[0];
+  smvm_assemble(vm,
+                "astore @rc 5\naload ra @rc\nmov rb 5\ncas @rc rb 9\n"
+                "mov rd 1\ncas @rc rd 7\nfence\nhalt");
+  smvm_result result = smvm_execute(vm);
+  ASSERT_EQUAL(result.status, status_halted);
+  ASSERT_EQUAL(vm->registers[reg_a], 5);
+  ASSERT_EQUAL(vm->registers[reg_b], 5);
+  ASSERT_EQUAL(vm->registers[reg_d], 9);
+  ASSERT_EQUAL(*(u64*)(segment.base + 8), 9);
+
+  // the other vms see it too, and the segment outlives being freed
+  msmv_free(&segment);
+  smvm_assemble(&vms[1], "aload ra @rc\nhalt");
+  smvm_execute(&vms[1]);
+  ASSERT_EQUAL(vms[1].registers[reg_a], 9);
+
+  // an atomic across its width's alignment traps
+  smvm_assemble(vm, "mov ra 1\nxadd @rc ra\nhalt");
+  vm->registers[reg_c] = 16 * page + 4;
+  result = smvm_execute(vm);
+  ASSERT_EQUAL(result.status, status_trapped);
+  ASSERT_EQUAL(result.trap, trap_misaligned);
+  ASSERT_EQUAL(result.index, 1);
+  for (int i = 0; i < 4; i++) smvm_free(&vms[i]);
+}
+
 int main(int argc, char** argv) { return run_all_tests(); }